@@ -11,6 +11,9 @@
 #define EFSBADCRC	EBADMSG		/* Bad CRC detected */
 #define EFSCORRUPTED	EUCLEAN		/* Filesystem is corrupted */
 
+struct export_operations;
+struct file;
+
 /*
  * Inode and file operations
  */
@@ -19,6 +22,14 @@
 extern const struct file_operations apfs_file_operations;
 extern const struct inode_operations apfs_file_inode_operations;
 
+/* export.c */
+extern const struct export_operations apfs_export_ops;
+
+/* ioctl.c */
+extern long apfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+extern long apfs_compat_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg);
+
 /* namei.c */
 extern const struct inode_operations apfs_dir_inode_operations;
 extern const struct inode_operations apfs_special_inode_operations;
@@ -9,10 +9,13 @@
 #include <linux/slab.h>
 #include "apfs.h"
 #include "btree.h"
+#include "fusion.h"
 #include "key.h"
 #include "message.h"
 #include "node.h"
 #include "super.h"
+#include "sysfs.h"
+#include "trace.h"
 
 /**
  * apfs_child_from_query - Read the child id found by a successful nonleaf query
@@ -35,27 +38,129 @@ static int apfs_child_from_query(struct apfs_query *query, u64 *child)
 }
 
 /**
- * apfs_omap_lookup_block - Find the block number of a b-tree node from its id
+ * apfs_omap_cache_init - Initialize an empty omap translation cache
+ * @cache:	the cache
+ */
+void apfs_omap_cache_init(struct apfs_omap_cache *cache)
+{
+	apfs_slot_cache_init(&cache->base, cache->entries,
+			     APFS_OMAP_CACHE_SLOTS, sizeof(cache->entries[0]));
+}
+
+/**
+ * apfs_omap_cache_hash - Hash the key of an omap translation
+ * @entry:	the translation
+ */
+static inline u64 apfs_omap_cache_hash(struct apfs_omap_cache_entry *entry)
+{
+	return entry->oc_oid ^ (entry->oc_xid << 32) ^ entry->oc_tree;
+}
+
+static bool apfs_omap_cache_match(const void *entry, const void *key,
+				  void *out)
+{
+	const struct apfs_omap_cache_entry *curr = entry, *wanted = key;
+
+	if (curr->oc_tree != wanted->oc_tree ||
+	    curr->oc_oid != wanted->oc_oid ||
+	    curr->oc_xid != wanted->oc_xid)
+		return false;
+	memcpy(out, curr, sizeof(*curr));
+	return true;
+}
+
+/**
+ * apfs_omap_cache_lookup - Look for a translation in the omap cache
+ * @sb:		filesystem superblock
+ * @tree:	block number for the root of the object map
+ * @oid:	virtual object id
+ * @xid:	transaction id for the lookup
+ * @block:	on return, the cached block number
+ * @map_xid:	on return, the cached transaction id for the mapping
+ * @flags:	on return, the cached flags for the mapping
+ *
+ * Returns true on a cache hit, false otherwise.
+ */
+static bool apfs_omap_cache_lookup(struct super_block *sb, u64 tree, u64 oid,
+				   u64 xid, u64 *block, u64 *map_xid,
+				   u32 *flags)
+{
+	struct apfs_omap_cache *cache = &APFS_NXI(sb)->nx_omap_cache;
+	struct apfs_omap_cache_entry key = {
+		.oc_tree = tree, .oc_oid = oid, .oc_xid = xid,
+	};
+	struct apfs_omap_cache_entry entry;
+
+	if (!apfs_slot_cache_find(&cache->base, apfs_omap_cache_hash(&key),
+				  apfs_omap_cache_match, &key, &entry))
+		return false;
+	*block = entry.oc_bno;
+	*map_xid = entry.oc_map_xid;
+	*flags = entry.oc_flags;
+	return true;
+}
+
+/**
+ * apfs_omap_cache_insert - Add a translation to the omap cache
+ * @sb:		filesystem superblock
+ * @tree:	block number for the root of the object map
+ * @oid:	virtual object id
+ * @xid:	transaction id for the lookup
+ * @block:	block number found for @oid
+ * @map_xid:	transaction id for the mapping found
+ * @flags:	flags for the mapping found
+ *
+ * Replaces whatever translation was cached in the same slot before.
+ */
+static void apfs_omap_cache_insert(struct super_block *sb, u64 tree, u64 oid,
+				   u64 xid, u64 block, u64 map_xid, u32 flags)
+{
+	struct apfs_omap_cache *cache = &APFS_NXI(sb)->nx_omap_cache;
+	struct apfs_omap_cache_entry entry = {
+		.oc_tree = tree, .oc_oid = oid, .oc_xid = xid,
+		.oc_bno = block, .oc_map_xid = map_xid, .oc_flags = flags,
+	};
+
+	apfs_slot_cache_replace(&cache->base, apfs_omap_cache_hash(&entry),
+				&entry, NULL /* old */);
+}
+
+/**
+ * apfs_omap_lookup - Find the latest mapping for an object in an object map
  * @sb:		filesystem superblock
  * @tbl:	Root of the object map to be searched
  * @id:		id of the node
+ * @xid:	transaction id for the lookup
  * @block:	on return, the found block number
+ * @map_xid:	on return, the transaction id of the mapping
+ * @flags:	on return, the flags for the mapping
+ *
+ * Finds the most recent mapping for @id that is not newer than @xid, so that
+ * snapshots can be read by passing their transaction id.  The transaction id
+ * of the mapping is when the object was last written, so callers can use it
+ * to tell if the object changed after some point in time.
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
-			   u64 id, u64 *block)
+int apfs_omap_lookup(struct super_block *sb, struct apfs_node *tbl,
+		     u64 id, u64 xid, u64 *block, u64 *map_xid, u32 *flags)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_query *query;
 	struct apfs_key key;
+	struct apfs_omap_val *omap_val;
+	char *raw;
+	u64 tree = tbl->object.block_nr;
 	int ret = 0;
 
+	apfs_stat_inc(sb, APFS_STAT_OMAP_LOOKUPS);
+	if (apfs_omap_cache_lookup(sb, tree, id, xid, block, map_xid, flags))
+		return 0;
+
 	query = apfs_alloc_query(tbl, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
 
-	apfs_init_omap_key(id, sbi->s_xid, &key);
+	apfs_init_omap_key(id, xid, &key);
 	query->key = &key;
 	query->flags |= APFS_QUERY_OMAP;
 
@@ -63,16 +168,58 @@ int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
 	if (ret)
 		goto fail;
 
-	ret = apfs_bno_from_query(query, block);
+	/* The query may have found the last mapping for some other object */
+	raw = query->node->object.bh->b_data;
+	ret = apfs_read_omap_key(raw + query->key_off, query->key_len, &key);
 	if (ret)
+		goto fail;
+	if (key.id != id) {
+		ret = -ENODATA;
+		goto fail;
+	}
+
+	ret = apfs_bno_from_query(query, block);
+	if (ret) {
 		apfs_alert(sb, "bad object map leaf block: 0x%llx",
 			   query->node->object.block_nr);
+		goto fail;
+	}
+
+	/* The object was deleted before this transaction */
+	omap_val = (struct apfs_omap_val *)(raw + query->off);
+	*flags = le32_to_cpu(omap_val->ov_flags);
+	if (*flags & APFS_OMAP_VAL_DELETED) {
+		ret = -ENODATA;
+		goto fail;
+	}
+
+	*map_xid = key.number;
+	apfs_omap_cache_insert(sb, tree, id, xid, *block, *map_xid, *flags);
 
 fail:
 	apfs_free_query(sb, query);
 	return ret;
 }
 
+/**
+ * apfs_omap_lookup_block - Find the block number of a b-tree node from its id
+ * @sb:		filesystem superblock
+ * @tbl:	Root of the object map to be searched
+ * @id:		id of the node
+ * @xid:	transaction id for the lookup
+ * @block:	on return, the found block number
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_omap_lookup_block(struct super_block *sb, struct apfs_node *tbl,
+			   u64 id, u64 xid, u64 *block)
+{
+	u64 map_xid;
+	u32 flags;
+
+	return apfs_omap_lookup(sb, tbl, id, xid, block, &map_xid, &flags);
+}
+
 /**
  * apfs_alloc_query - Allocates a query structure
  * @node:	node to be searched
@@ -141,10 +288,10 @@ void apfs_free_query(struct super_block *sb, struct apfs_query *query)
  */
 int apfs_btree_query(struct super_block *sb, struct apfs_query **query)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_node *node;
 	struct apfs_query *parent;
-	u64 child_id, child_blk;
+	u64 child_id;
+	int nodes = 0, omaps = 0;
 	int err;
 
 next_node:
@@ -155,13 +302,17 @@ int apfs_btree_query(struct super_block *sb, struct apfs_query **query)
 		 * than enough to map every block.
 		 */
 		apfs_alert(sb, "b-tree is corrupted");
-		return -EFSCORRUPTED;
+		err = -EFSCORRUPTED;
+		goto out;
 	}
 
 	err = apfs_node_query(sb, *query);
+	++nodes;
 	if (err == -EAGAIN) {
-		if (!(*query)->parent) /* We are at the root of the tree */
-			return -ENODATA;
+		if (!(*query)->parent) { /* We are at the root of the tree */
+			err = -ENODATA;
+			goto out;
+		}
 
 		/* Move back up one level and continue the query */
 		parent = (*query)->parent;
@@ -171,38 +322,45 @@ int apfs_btree_query(struct super_block *sb, struct apfs_query **query)
 		goto next_node;
 	}
 	if (err)
-		return err;
+		goto out;
 	if (apfs_node_is_leaf((*query)->node)) /* All done */
-		return 0;
+		goto out;
 
 	err = apfs_child_from_query(*query, &child_id);
 	if (err) {
 		apfs_alert(sb, "bad index block: 0x%llx",
 			   (*query)->node->object.block_nr);
-		return err;
+		goto out;
 	}
 
 	/*
 	 * The omap maps a node id into a block number. The nodes
-	 * of the omap itself do not need this translation.
+	 * of the omap itself do not need this translation, and neither
+	 * do those of the snapshot metadata tree or the fusion middle tree.
 	 */
-	if ((*query)->flags & APFS_QUERY_OMAP) {
-		child_blk = child_id;
+	if ((*query)->flags & APFS_QUERY_FUSION) {
+		/* Reading a tier 2 node would need a middle tree lookup */
+		if (apfs_is_tier2(sb, child_id)) {
+			apfs_alert(sb, "bad fusion middle tree");
+			err = -EFSCORRUPTED;
+			goto out;
+		}
+		node = apfs_read_node(sb, child_id);
+	} else if ((*query)->flags & (APFS_QUERY_OMAP |
+				      APFS_QUERY_SNAP_META)) {
+		node = apfs_read_node(sb, child_id);
 	} else {
 		/*
 		 * we are always performing lookup from omap root. Might
 		 * need improvement in the future.
 		 */
-		err = apfs_omap_lookup_block(sb, sbi->s_omap_root,
-					     child_id, &child_blk);
-		if (err)
-			return err;
+		node = apfs_omap_read_node(sb, child_id);
+		++omaps;
+	}
+	if (IS_ERR(node)) {
+		err = PTR_ERR(node);
+		goto out;
 	}
-
-	/* Now go a level deeper and search the child */
-	node = apfs_read_node(sb, child_blk);
-	if (IS_ERR(node))
-		return PTR_ERR(node);
 
 	if (node->object.oid != child_id)
 		apfs_debug(sb, "corrupt b-tree");
@@ -222,6 +380,17 @@ int apfs_btree_query(struct super_block *sb, struct apfs_query **query)
 		(*query)->depth++;
 	}
 	goto next_node;
+
+out:
+	if ((*query)->flags & APFS_QUERY_TREE_MASK) {
+		apfs_stat_inc(sb, APFS_STAT_QUERY_OMAP +
+			      __ffs((*query)->flags & APFS_QUERY_TREE_MASK));
+	}
+	trace_apfs_btree_query(sb, (*query)->flags & APFS_QUERY_TREE_MASK,
+			       (*query)->key->id, (*query)->key->type,
+			       (*query)->key->number, (*query)->depth, nodes,
+			       omaps, err);
+	return err;
 }
 
 /**
@@ -235,14 +404,16 @@ struct apfs_node *apfs_omap_read_node(struct super_block *sb, u64 id)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_node *result;
-	u64 block;
+	u64 block, map_xid;
+	u32 flags;
 	int err;
 
-	err = apfs_omap_lookup_block(sb, sbi->s_omap_root, id, &block);
+	err = apfs_omap_lookup(sb, sbi->s_omap_root, id, sbi->s_xid, &block,
+			       &map_xid, &flags);
 	if (err)
 		return ERR_PTR(err);
 
-	result = apfs_read_node(sb, block);
+	result = __apfs_read_vnode(sb, block, flags, _RET_IP_);
 	if (IS_ERR(result))
 		return result;
 
@@ -9,18 +9,21 @@
 #define _APFS_BTREE_H
 
 #include <linux/types.h>
+#include "slotcache.h"
 
 struct super_block;
 
 /* Flags for the query structure */
-#define APFS_QUERY_TREE_MASK	0007	/* Which b-tree we query */
+#define APFS_QUERY_TREE_MASK	0017	/* Which b-tree we query */
 #define APFS_QUERY_OMAP		0001	/* This is a b-tree object map query */
 #define APFS_QUERY_CAT		0002	/* This is a catalog tree query */
-#define APFS_QUERY_NEXT		0010	/* Find next of multiple matches */
-#define APFS_QUERY_EXACT	0020	/* Search for an exact match */
-#define APFS_QUERY_DONE		0040	/* The search at this level is over */
-#define APFS_QUERY_ANY_NAME	0100	/* Multiple search for any name */
-#define APFS_QUERY_ANY_NUMBER	0200	/* Multiple search for any number */
+#define APFS_QUERY_SNAP_META	0004	/* This is a snapshot tree query */
+#define APFS_QUERY_FUSION	0010	/* This is a fusion middle tree query */
+#define APFS_QUERY_NEXT		0020	/* Find next of multiple matches */
+#define APFS_QUERY_EXACT	0040	/* Search for an exact match */
+#define APFS_QUERY_DONE		0100	/* The search at this level is over */
+#define APFS_QUERY_ANY_NAME	0200	/* Multiple search for any name */
+#define APFS_QUERY_ANY_NUMBER	0400	/* Multiple search for any number */
 #define APFS_QUERY_MULTIPLE	(APFS_QUERY_ANY_NAME | APFS_QUERY_ANY_NUMBER)
 
 /*
@@ -44,12 +47,42 @@ struct apfs_query {
 	int depth;			/* Put a limit on recursion */
 };
 
+/* Number of omap translations cached for each container */
+#define APFS_OMAP_CACHE_SLOTS	256
+
+/*
+ * A cached object map translation.  The transaction id is part of the key, so
+ * that mounts of different snapshots can share the cache.
+ */
+struct apfs_omap_cache_entry {
+	u64 oc_tree;			/* Block number of the omap root */
+	u64 oc_oid;			/* Virtual object id */
+	u64 oc_xid;			/* Transaction id for the lookup */
+	u64 oc_bno;			/* Physical block found by the lookup */
+	u64 oc_map_xid;			/* Transaction id for the mapping */
+	u32 oc_flags;			/* Flags for the mapping */
+};
+
+/*
+ * Direct-mapped cache of object map translations.  A zero tree block number
+ * marks an unused slot, since block zero is always the container superblock.
+ */
+struct apfs_omap_cache {
+	struct apfs_slot_cache base;
+	struct apfs_omap_cache_entry entries[APFS_OMAP_CACHE_SLOTS];
+};
+
+extern void apfs_omap_cache_init(struct apfs_omap_cache *cache);
 extern struct apfs_query *apfs_alloc_query(struct apfs_node *node,
 					   struct apfs_query *parent);
 extern void apfs_free_query(struct super_block *sb, struct apfs_query *query);
 extern int apfs_btree_query(struct super_block *sb, struct apfs_query **query);
 extern struct apfs_node *apfs_omap_read_node(struct super_block *sb, u64 id);
+extern int apfs_omap_lookup(struct super_block *sb, struct apfs_node *tbl,
+			    u64 id, u64 xid, u64 *block, u64 *map_xid,
+			    u32 *flags);
 extern int apfs_omap_lookup_block(struct super_block *sb,
-				  struct apfs_node *tbl, u64 id, u64 *block);
+				  struct apfs_node *tbl, u64 id, u64 xid,
+				  u64 *block);
 
 #endif	/* _APFS_BTREE_H */
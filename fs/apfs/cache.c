@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/cache.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/fs.h>
+#include <linux/fscache.h>
+#include <linux/pagemap.h>
+#include "apfs.h"
+#include "cache.h"
+#include "inode.h"
+#include "super.h"
+
+static struct fscache_netfs apfs_cache_netfs = {
+	.name		= "apfs",
+	.version	= 0,
+};
+
+/*
+ * Index key for the cache object of a file.  The transaction id is part of
+ * the key, so that each snapshot gets its own objects.
+ */
+struct apfs_cache_key {
+	__le64 ck_cnid;
+	__le64 ck_xid;
+} __packed;
+
+/*
+ * Auxiliary data for the cache object of a file, to catch stale objects left
+ * by an older mount of the same transaction (from an altered image, perhaps)
+ */
+struct apfs_cache_aux {
+	__le64 ca_mtime;
+	__le64 ca_size;
+} __packed;
+
+/**
+ * apfs_cache_register - Register the filesystem with fscache
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_cache_register(void)
+{
+	return fscache_register_netfs(&apfs_cache_netfs);
+}
+
+/**
+ * apfs_cache_unregister - Undo apfs_cache_register()
+ */
+void apfs_cache_unregister(void)
+{
+	fscache_unregister_netfs(&apfs_cache_netfs);
+}
+
+static const struct fscache_cookie_def apfs_cache_volume_def = {
+	.name		= "APFS.volume",
+	.type		= FSCACHE_COOKIE_TYPE_INDEX,
+};
+
+/**
+ * apfs_cache_get_volume_cookie - Set up caching for a volume
+ * @sb:		filesystem superblock
+ *
+ * Does nothing unless the volume was mounted with the fsc option, which is
+ * refused for encrypted volumes.  The cache index for the volume is keyed by
+ * its uuid, so it survives across mounts.
+ */
+void apfs_cache_get_volume_cookie(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+
+	if (!(sbi->s_flags & APFS_FSCACHE))
+		return;
+	sbi->s_fscache = fscache_acquire_cookie(apfs_cache_netfs.primary_index,
+						&apfs_cache_volume_def,
+						vsb_raw->apfs_vol_uuid,
+						sizeof(vsb_raw->apfs_vol_uuid),
+						NULL, 0, sbi, 0, true);
+}
+
+/**
+ * apfs_cache_put_volume_cookie - Undo apfs_cache_get_volume_cookie()
+ * @sb:		filesystem superblock
+ */
+void apfs_cache_put_volume_cookie(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	fscache_relinquish_cookie(sbi->s_fscache, NULL, false);
+	sbi->s_fscache = NULL;
+}
+
+/**
+ * apfs_cache_aux_init - Set the auxiliary data for the cache object of a file
+ * @inode:	the file
+ * @aux:	structure to fill
+ */
+static void apfs_cache_aux_init(struct inode *inode,
+				struct apfs_cache_aux *aux)
+{
+	aux->ca_mtime = cpu_to_le64(timespec64_to_ns(&inode->i_mtime));
+	aux->ca_size = cpu_to_le64(i_size_read(inode));
+}
+
+static enum fscache_checkaux apfs_cache_inode_check_aux(void *netfs_data,
+							const void *data,
+							uint16_t datalen,
+							loff_t object_size)
+{
+	struct apfs_cache_aux aux;
+
+	if (datalen != sizeof(aux))
+		return FSCACHE_CHECKAUX_OBSOLETE;
+	apfs_cache_aux_init(netfs_data, &aux);
+	if (memcmp(data, &aux, sizeof(aux)))
+		return FSCACHE_CHECKAUX_OBSOLETE;
+	return FSCACHE_CHECKAUX_OKAY;
+}
+
+static const struct fscache_cookie_def apfs_cache_inode_def = {
+	.name		= "APFS.inode",
+	.type		= FSCACHE_COOKIE_TYPE_DATAFILE,
+	.check_aux	= apfs_cache_inode_check_aux,
+};
+
+/**
+ * apfs_cache_get_inode_cookie - Set up caching for a regular file
+ * @inode:	the file, already read from the catalog
+ */
+void apfs_cache_get_inode_cookie(struct inode *inode)
+{
+	struct apfs_sb_info *sbi = APFS_SB(inode->i_sb);
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_cache_key key;
+	struct apfs_cache_aux aux;
+
+	if (!sbi->s_fscache || !S_ISREG(inode->i_mode))
+		return;
+
+	key.ck_cnid = cpu_to_le64(apfs_ino(inode));
+	key.ck_xid = cpu_to_le64(sbi->s_xid);
+	apfs_cache_aux_init(inode, &aux);
+	ai->i_fscache = fscache_acquire_cookie(sbi->s_fscache,
+					       &apfs_cache_inode_def,
+					       &key, sizeof(key),
+					       &aux, sizeof(aux),
+					       inode, i_size_read(inode), true);
+}
+
+/**
+ * apfs_cache_put_inode_cookie - Undo apfs_cache_get_inode_cookie()
+ * @inode:	the file
+ */
+void apfs_cache_put_inode_cookie(struct inode *inode)
+{
+	struct apfs_inode_info *ai = APFS_I(inode);
+
+	fscache_relinquish_cookie(ai->i_fscache, NULL, false);
+	ai->i_fscache = NULL;
+}
+
+/**
+ * apfs_cache_enabled - Check if the data of a file goes through fscache
+ * @inode:	the file
+ */
+bool apfs_cache_enabled(struct inode *inode)
+{
+	return APFS_I(inode)->i_fscache;
+}
+
+static void apfs_cache_read_complete(struct page *page, void *context,
+				     int error)
+{
+	if (!error)
+		SetPageUptodate(page);
+	unlock_page(page);
+}
+
+/**
+ * apfs_readpage_from_cache - Try to read a page from fscache
+ * @inode:	the file
+ * @page:	the locked page
+ *
+ * Returns 0 if the read was submitted to the cache; otherwise the caller must
+ * read the page from the device.
+ */
+int apfs_readpage_from_cache(struct inode *inode, struct page *page)
+{
+	return fscache_read_or_alloc_page(APFS_I(inode)->i_fscache, page,
+					  apfs_cache_read_complete, NULL,
+					  GFP_KERNEL);
+}
+
+/**
+ * apfs_readpages_from_cache - Try to read a list of pages from fscache
+ * @inode:	the file
+ * @mapping:	the address space of the file
+ * @pages:	list of pages, as passed to ->readpages()
+ * @nr_pages:	number of pages in @pages
+ *
+ * The pages found in the cache are submitted and removed from the list, and
+ * @nr_pages is updated.  Returns 0 if they were all found; otherwise the
+ * caller must read the rest from the device.
+ */
+int apfs_readpages_from_cache(struct inode *inode,
+			      struct address_space *mapping,
+			      struct list_head *pages, unsigned int *nr_pages)
+{
+	return fscache_read_or_alloc_pages(APFS_I(inode)->i_fscache, mapping,
+					   pages, nr_pages,
+					   apfs_cache_read_complete, NULL,
+					   mapping_gfp_mask(mapping));
+}
+
+/**
+ * apfs_readpage_to_cache - Store a page read from the device in fscache
+ * @inode:	the file
+ * @page:	the page, up to date
+ */
+void apfs_readpage_to_cache(struct inode *inode, struct page *page)
+{
+	struct fscache_cookie *cookie = APFS_I(inode)->i_fscache;
+
+	if (!PageFsCache(page))
+		return;
+	if (fscache_write_page(cookie, page, i_size_read(inode), GFP_KERNEL))
+		fscache_uncache_page(cookie, page);
+}
+
+int apfs_cache_releasepage(struct page *page, gfp_t gfp)
+{
+	struct inode *inode = page->mapping->host;
+
+	return fscache_maybe_release_page(APFS_I(inode)->i_fscache, page, gfp);
+}
+
+void apfs_cache_invalidatepage(struct page *page, unsigned int offset,
+			       unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct fscache_cookie *cookie = APFS_I(inode)->i_fscache;
+
+	if (offset || length != PAGE_SIZE || !PageFsCache(page))
+		return;
+	fscache_wait_on_page_write(cookie, page);
+	fscache_uncache_page(cookie, page);
+}
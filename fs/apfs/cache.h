@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/cache.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_CACHE_H
+#define _APFS_CACHE_H
+
+#include <linux/fs.h>
+#include <linux/fscache.h>
+#include <linux/types.h>
+
+#ifdef CONFIG_APFS_FSCACHE
+
+extern int apfs_cache_register(void);
+extern void apfs_cache_unregister(void);
+extern void apfs_cache_get_volume_cookie(struct super_block *sb);
+extern void apfs_cache_put_volume_cookie(struct super_block *sb);
+extern void apfs_cache_get_inode_cookie(struct inode *inode);
+extern void apfs_cache_put_inode_cookie(struct inode *inode);
+extern bool apfs_cache_enabled(struct inode *inode);
+extern int apfs_readpage_from_cache(struct inode *inode, struct page *page);
+extern int apfs_readpages_from_cache(struct inode *inode,
+				     struct address_space *mapping,
+				     struct list_head *pages,
+				     unsigned int *nr_pages);
+extern void apfs_readpage_to_cache(struct inode *inode, struct page *page);
+extern int apfs_cache_releasepage(struct page *page, gfp_t gfp);
+extern void apfs_cache_invalidatepage(struct page *page, unsigned int offset,
+				      unsigned int length);
+
+#else /* CONFIG_APFS_FSCACHE */
+
+static inline int apfs_cache_register(void)
+{
+	return 0;
+}
+
+static inline void apfs_cache_unregister(void) {}
+static inline void apfs_cache_get_volume_cookie(struct super_block *sb) {}
+static inline void apfs_cache_put_volume_cookie(struct super_block *sb) {}
+static inline void apfs_cache_get_inode_cookie(struct inode *inode) {}
+static inline void apfs_cache_put_inode_cookie(struct inode *inode) {}
+
+static inline bool apfs_cache_enabled(struct inode *inode)
+{
+	return false;
+}
+
+static inline int apfs_readpage_from_cache(struct inode *inode,
+					   struct page *page)
+{
+	return -ENOBUFS;
+}
+
+static inline int apfs_readpages_from_cache(struct inode *inode,
+					    struct address_space *mapping,
+					    struct list_head *pages,
+					    unsigned int *nr_pages)
+{
+	return -ENOBUFS;
+}
+
+static inline void apfs_readpage_to_cache(struct inode *inode,
+					  struct page *page) {}
+
+#endif /* CONFIG_APFS_FSCACHE */
+
+#endif	/* _APFS_CACHE_H */
@@ -0,0 +1,1046 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/crypto.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <crypto/hash.h>
+#include <crypto/sha.h>
+#include <crypto/skcipher.h>
+#include <keys/user-type.h>
+#include <linux/bio.h>
+#include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/crypto.h>
+#include <linux/key.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "apfs.h"
+#include "crypto.h"
+#include "fusion.h"
+#include "message.h"
+#include "object.h"
+#include "super.h"
+
+/* Tags for the DER fields of the wrapped key blobs */
+#define APFS_DER_SEQUENCE	0x30
+#define APFS_DER_BLOB		0xa3
+#define APFS_DER_FLAGS		0x82
+#define APFS_DER_WRAPPED	0x83
+#define APFS_DER_ITERATIONS	0x84
+#define APFS_DER_SALT		0x85
+
+/* The key is wrapped with AES-128 instead of AES-256 */
+#define APFS_KEY_FLAG_AES128	0x02
+
+/* Initial value for the RFC 3394 key wrapping */
+#define APFS_KEY_WRAP_IV	0xa6a6a6a6a6a6a6a6ULL
+
+/*
+ * Wrapped key, as found in the keybag records for the volume key and for the
+ * key encryption keys
+ */
+struct apfs_key_blob {
+	u8 flags;		/* First byte of the flags field */
+	const u8 *wrapped;	/* The wrapped key */
+	int wrapped_len;
+	u64 iterations;		/* PBKDF2 iterations, only for the KEKs */
+	const u8 *salt;		/* PBKDF2 salt, only for the KEKs */
+	int salt_len;
+};
+
+/**
+ * apfs_xts_alloc - Allocate an AES-XTS transform for a given key
+ * @key:	both XTS keys, APFS_VEK_LEN bytes in total
+ *
+ * Returns the transform on success, or an error pointer in case of failure.
+ */
+static struct crypto_skcipher *apfs_xts_alloc(const u8 *key)
+{
+	struct crypto_skcipher *tfm;
+	int err;
+
+	tfm = crypto_alloc_skcipher("xts(aes)", 0, 0);
+	if (IS_ERR(tfm))
+		return tfm;
+	err = crypto_skcipher_setkey(tfm, key, APFS_VEK_LEN);
+	if (err) {
+		crypto_free_skcipher(tfm);
+		return ERR_PTR(err);
+	}
+	return tfm;
+}
+
+/*
+ * Position and tweak of a single encryption unit in a batch
+ */
+struct apfs_xts_unit {
+	struct scatterlist src;
+	struct scatterlist dst;
+	__le64 iv[2];
+};
+
+/*
+ * Batch of encryption units to decrypt together.  Each unit needs a request of
+ * its own because of the tweak, but they are all kept in flight at once, and
+ * the caller only waits for the last one to complete.
+ */
+struct apfs_xts_batch {
+	struct crypto_skcipher *tfm;
+	unsigned int count;		/* Number of units in the batch */
+	unsigned int req_size;		/* Size of a request with its context */
+	char *reqs;			/* Array of requests */
+	struct apfs_xts_unit *units;	/* Array of units */
+
+	atomic_t pending;		/* Requests still in flight, plus one */
+	int err;			/* First error reported, if any */
+	struct completion done;		/* Signaled when nothing is pending */
+};
+
+/**
+ * apfs_xts_batch_alloc - Allocate a batch of encryption units
+ * @tfm:	AES-XTS transform
+ * @count:	number of units in the batch
+ *
+ * Returns the new batch, or NULL in case of failure.
+ */
+static struct apfs_xts_batch *apfs_xts_batch_alloc(struct crypto_skcipher *tfm,
+						   unsigned int count)
+{
+	struct apfs_xts_batch *batch;
+	unsigned int req_size, hdr_size;
+	unsigned int nofs_flags;
+
+	req_size = ALIGN(sizeof(struct skcipher_request) +
+			 crypto_skcipher_reqsize(tfm), CRYPTO_MINALIGN);
+	hdr_size = ALIGN(sizeof(*batch), CRYPTO_MINALIGN);
+
+	/* A whole bio may need a lot of requests, so allow vmalloc */
+	nofs_flags = memalloc_nofs_save();
+	batch = kvmalloc(hdr_size + (size_t)count * req_size +
+			 (size_t)count * sizeof(*batch->units), GFP_KERNEL);
+	memalloc_nofs_restore(nofs_flags);
+	if (!batch)
+		return NULL;
+
+	batch->tfm = tfm;
+	batch->count = count;
+	batch->req_size = req_size;
+	batch->reqs = (char *)batch + hdr_size;
+	batch->units = (void *)(batch->reqs + (size_t)count * req_size);
+	atomic_set(&batch->pending, 1);
+	batch->err = 0;
+	init_completion(&batch->done);
+	return batch;
+}
+
+/**
+ * apfs_xts_batch_set - Set the source, destination and tweak for a unit
+ * @batch:	the batch
+ * @i:		index of the unit in @batch
+ * @src:	page with the encrypted unit
+ * @src_off:	offset of the unit in @src
+ * @dst:	page for the decrypted unit, which may be @src itself
+ * @dst_off:	offset of the unit in @dst
+ * @unit:	number of the unit, for the tweak
+ */
+static void apfs_xts_batch_set(struct apfs_xts_batch *batch, unsigned int i,
+			       struct page *src, unsigned int src_off,
+			       struct page *dst, unsigned int dst_off, u64 unit)
+{
+	struct apfs_xts_unit *xu = &batch->units[i];
+
+	sg_init_table(&xu->src, 1);
+	sg_set_page(&xu->src, src, APFS_CRYPTO_UNIT_SIZE, src_off);
+	sg_init_table(&xu->dst, 1);
+	sg_set_page(&xu->dst, dst, APFS_CRYPTO_UNIT_SIZE, dst_off);
+	xu->iv[0] = cpu_to_le64(unit);
+	xu->iv[1] = 0;
+}
+
+static void apfs_xts_batch_done(struct crypto_async_request *areq, int err)
+{
+	struct apfs_xts_batch *batch = areq->data;
+
+	/* The request just left the backlog, the result comes later */
+	if (err == -EINPROGRESS)
+		return;
+	if (err)
+		cmpxchg(&batch->err, 0, err);
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/**
+ * apfs_xts_batch_run - Decrypt all the units of a batch
+ * @batch:	the batch
+ *
+ * Every request is submitted before waiting for any of them, so that async
+ * cipher implementations can work on all units in parallel.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+static int apfs_xts_batch_run(struct apfs_xts_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->count; ++i) {
+		struct skcipher_request *req;
+		struct apfs_xts_unit *xu = &batch->units[i];
+		int err;
+
+		req = (void *)(batch->reqs + (size_t)i * batch->req_size);
+		skcipher_request_set_tfm(req, batch->tfm);
+		skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+						   CRYPTO_TFM_REQ_MAY_SLEEP,
+					      apfs_xts_batch_done, batch);
+		skcipher_request_set_crypt(req, &xu->src, &xu->dst,
+					   APFS_CRYPTO_UNIT_SIZE, xu->iv);
+
+		atomic_inc(&batch->pending);
+		err = crypto_skcipher_decrypt(req);
+		if (err != -EINPROGRESS && err != -EBUSY)
+			apfs_xts_batch_done(&req->base, err);
+	}
+
+	/* Drop the initial count, so that the last request can complete */
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion(&batch->done);
+	return batch->err;
+}
+
+/**
+ * apfs_xts_decrypt - Decrypt a run of encryption units
+ * @tfm:	AES-XTS transform
+ * @page:	destination page
+ * @off:	offset of the destination in @page
+ * @src:	source buffer, not in high memory
+ * @len:	length to decrypt, a multiple of the unit size
+ * @unit:	number of the first unit, for the tweak
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_xts_decrypt(struct crypto_skcipher *tfm, struct page *page,
+			    unsigned int off, const void *src,
+			    unsigned int len, u64 unit)
+{
+	struct apfs_xts_batch *batch;
+	unsigned int count = len >> APFS_CRYPTO_UNIT_BITS;
+	unsigned int i;
+	int err;
+
+	batch = apfs_xts_batch_alloc(tfm, count);
+	if (!batch)
+		return -ENOMEM;
+	for (i = 0; i < count; ++i) {
+		unsigned int done = i << APFS_CRYPTO_UNIT_BITS;
+
+		apfs_xts_batch_set(batch, i, virt_to_page(src + done),
+				   offset_in_page(src + done), page,
+				   off + done, unit + i);
+	}
+	err = apfs_xts_batch_run(batch);
+	kvfree(batch);
+	return err;
+}
+
+/**
+ * apfs_decrypt_page - Decrypt data from the volume into a page
+ * @sb:		filesystem superblock
+ * @page:	destination page
+ * @off:	offset of the destination in @page
+ * @src:	encrypted data, not in high memory
+ * @len:	length of the data, a multiple of the unit size
+ * @unit:	number of the first unit, for the tweak
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_decrypt_page(struct super_block *sb, struct page *page,
+		      unsigned int off, const void *src, unsigned int len,
+		      u64 unit)
+{
+	return apfs_xts_decrypt(APFS_SB(sb)->s_vek_tfm, page, off, src, len,
+				unit);
+}
+
+/**
+ * apfs_decrypt_bio - Decrypt in place the file data read by a bio
+ * @sb:		filesystem superblock
+ * @bio:	the completed bio
+ * @unit:	number of the first unit in @bio, for the tweak
+ *
+ * The tweaks of all the units in @bio must be consecutive.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+int apfs_decrypt_bio(struct super_block *sb, struct bio *bio, u64 unit)
+{
+	struct apfs_xts_batch *batch;
+	struct bio_vec *bv;
+	unsigned int count = 0, n = 0;
+	int err, i;
+
+	bio_for_each_segment_all(bv, bio, i)
+		count += bv->bv_len >> APFS_CRYPTO_UNIT_BITS;
+
+	batch = apfs_xts_batch_alloc(APFS_SB(sb)->s_vek_tfm, count);
+	if (!batch)
+		return -ENOMEM;
+	bio_for_each_segment_all(bv, bio, i) {
+		unsigned int off;
+
+		for (off = 0; off < bv->bv_len; off += APFS_CRYPTO_UNIT_SIZE) {
+			apfs_xts_batch_set(batch, n, bv->bv_page,
+					   bv->bv_offset + off, bv->bv_page,
+					   bv->bv_offset + off, unit + n);
+			++n;
+		}
+	}
+	err = apfs_xts_batch_run(batch);
+	kvfree(batch);
+	return err;
+}
+
+/**
+ * apfs_decrypt_buf - Decrypt data from the volume into a buffer
+ * @sb:		filesystem superblock
+ * @dst:	destination buffer, not in high memory and within a single page
+ * @src:	encrypted data, not in high memory
+ * @len:	length of the data, a multiple of the unit size
+ * @unit:	number of the first unit, for the tweak
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_decrypt_buf(struct super_block *sb, void *dst, const void *src,
+		     unsigned int len, u64 unit)
+{
+	return apfs_decrypt_page(sb, virt_to_page(dst), offset_in_page(dst),
+				 src, len, unit);
+}
+
+/**
+ * apfs_node_cache_init - Initialize an empty cache of decrypted blocks
+ * @cache:	the cache
+ */
+void apfs_node_cache_init(struct apfs_node_cache *cache)
+{
+	apfs_slot_cache_init(&cache->base, cache->blocks,
+			     APFS_NODE_CACHE_SLOTS, sizeof(cache->blocks[0]));
+}
+
+static bool apfs_node_cache_match(const void *entry, const void *key,
+				  void *out)
+{
+	struct buffer_head *bh = *(struct buffer_head * const *)entry;
+
+	if (!bh || bh->b_blocknr != *(const u64 *)key)
+		return false;
+	get_bh(bh);
+	*(struct buffer_head **)out = bh;
+	return true;
+}
+
+static void apfs_node_cache_release(void *old)
+{
+	struct buffer_head *bh = *(struct buffer_head **)old;
+
+	if (bh)
+		apfs_put_decrypted_block(bh);
+}
+
+/**
+ * apfs_node_cache_lookup - Look for a decrypted block in the cache
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ *
+ * Returns the buffer head with an extra reference, or NULL if not cached.
+ */
+static struct buffer_head *apfs_node_cache_lookup(struct super_block *sb,
+						  u64 bno)
+{
+	struct apfs_node_cache *cache = &APFS_SB(sb)->s_node_cache;
+	struct buffer_head *bh;
+
+	if (!apfs_slot_cache_find(&cache->base, bno, apfs_node_cache_match,
+				  &bno, &bh))
+		return NULL;
+	return bh;
+}
+
+/**
+ * apfs_node_cache_insert - Add a decrypted block to the cache
+ * @sb:		filesystem superblock
+ * @bh:		buffer head for the block
+ *
+ * The cache takes its own reference to @bh.  Whatever block was in the slot
+ * before loses the cache reference, and gets wiped once its last user is
+ * done with it.
+ */
+static void apfs_node_cache_insert(struct super_block *sb,
+				   struct buffer_head *bh)
+{
+	struct apfs_node_cache *cache = &APFS_SB(sb)->s_node_cache;
+	struct buffer_head *old;
+
+	get_bh(bh);
+	apfs_slot_cache_replace(&cache->base, bh->b_blocknr, &bh, &old);
+	apfs_node_cache_release(&old);
+}
+
+/**
+ * apfs_node_cache_clear - Drop all the decrypted blocks from the cache
+ * @sb:		filesystem superblock
+ */
+static void apfs_node_cache_clear(struct super_block *sb)
+{
+	struct apfs_node_cache *cache = &APFS_SB(sb)->s_node_cache;
+	struct buffer_head *old;
+
+	apfs_slot_cache_clear(&cache->base, &old, apfs_node_cache_release);
+}
+
+/**
+ * apfs_decrypt_block - Read and decrypt a metadata block, bypassing the cache
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @cached:	on return, was the ciphertext already in the buffer cache?
+ *
+ * Returns a new private buffer head for the plaintext, with a single
+ * reference, or an error pointer in case of failure.
+ */
+static struct buffer_head *apfs_decrypt_block(struct super_block *sb, u64 bno,
+					      bool *cached)
+{
+	struct buffer_head *bh, *plain;
+	struct page *page;
+	int err;
+
+	bh = __apfs_sb_bread(sb, bno, cached);
+	if (!bh)
+		return ERR_PTR(-EIO);
+
+	plain = alloc_buffer_head(GFP_NOFS);
+	if (!plain) {
+		brelse(bh);
+		return ERR_PTR(-ENOMEM);
+	}
+	page = alloc_page(GFP_NOFS);
+	if (!page) {
+		free_buffer_head(plain);
+		brelse(bh);
+		return ERR_PTR(-ENOMEM);
+	}
+	set_bh_page(plain, page, 0);
+	plain->b_size = sb->s_blocksize;
+	plain->b_blocknr = bno;
+	atomic_set(&plain->b_count, 1);
+
+	err = apfs_decrypt_page(sb, page, 0, bh->b_data, sb->s_blocksize,
+				apfs_blocks_to_units(sb, bno));
+	brelse(bh);
+	if (err) {
+		apfs_put_decrypted_block(plain);
+		return ERR_PTR(err);
+	}
+	set_buffer_uptodate(plain);
+	return plain;
+}
+
+/**
+ * apfs_read_decrypted_block - Read and decrypt a metadata block
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ * @cached:	on return, was the block found without reading the disk?
+ *
+ * The plaintext goes to a private buffer head, so that it never reaches the
+ * page cache of the block device; recently used blocks are kept decrypted in
+ * the node cache of the volume.  The caller must release the buffer with
+ * apfs_put_decrypted_block().  Returns the buffer head on success, or an
+ * error pointer in case of failure.
+ */
+struct buffer_head *apfs_read_decrypted_block(struct super_block *sb, u64 bno,
+					      bool *cached)
+{
+	struct buffer_head *bh;
+
+	bh = apfs_node_cache_lookup(sb, bno);
+	if (bh) {
+		*cached = true;
+		return bh;
+	}
+
+	bh = apfs_decrypt_block(sb, bno, cached);
+	if (!IS_ERR(bh))
+		apfs_node_cache_insert(sb, bh);
+	return bh;
+}
+
+/**
+ * apfs_put_decrypted_block - Release a block from apfs_read_decrypted_block()
+ * @bh:		buffer head for the block
+ *
+ * The plaintext is wiped and the memory freed once the last reference is gone.
+ */
+void apfs_put_decrypted_block(struct buffer_head *bh)
+{
+	struct page *page = bh->b_page;
+
+	if (!atomic_dec_and_test(&bh->b_count))
+		return;
+
+	memzero_explicit(bh->b_data, bh->b_size);
+	free_buffer_head(bh);
+	__free_page(page);
+}
+
+/**
+ * apfs_der_get - Find a field in a DER-encoded sequence
+ * @data:	contents of the sequence
+ * @len:	length of @data
+ * @tag:	tag for the field
+ * @val:	on return, the contents of the field
+ * @val_len:	on return, the length of @val
+ *
+ * Returns 0 on success, -ENODATA if the field is missing, or -EFSCORRUPTED if
+ * the encoding is invalid.
+ */
+static int apfs_der_get(const u8 *data, int len, u8 tag, const u8 **val,
+			int *val_len)
+{
+	int off = 0;
+
+	while (off + 2 <= len) {
+		u8 curr_tag = data[off++];
+		int curr_len = data[off++];
+
+		/* Long form for the length */
+		if (curr_len & 0x80) {
+			int bytes = curr_len & 0x7f;
+
+			if (bytes > 2 || off + bytes > len)
+				return -EFSCORRUPTED;
+			for (curr_len = 0; bytes; --bytes)
+				curr_len = curr_len << 8 | data[off++];
+		}
+		if (off + curr_len > len)
+			return -EFSCORRUPTED;
+
+		if (curr_tag == tag) {
+			*val = data + off;
+			*val_len = curr_len;
+			return 0;
+		}
+		off += curr_len;
+	}
+	return -ENODATA;
+}
+
+/**
+ * apfs_parse_key_blob - Parse a wrapped key from a keybag entry
+ * @data:	the key data for the entry
+ * @len:	length of @data
+ * @blob:	on return, the parsed key
+ * @kek:	is this a key encryption key, with its PBKDF2 parameters?
+ *
+ * Returns 0 on success, or -EFSCORRUPTED if the blob is invalid.
+ */
+static int apfs_parse_key_blob(const u8 *data, int len,
+			       struct apfs_key_blob *blob, bool kek)
+{
+	const u8 *seq, *inner, *val;
+	int seq_len, inner_len, val_len;
+
+	if (apfs_der_get(data, len, APFS_DER_SEQUENCE, &seq, &seq_len) ||
+	    apfs_der_get(seq, seq_len, APFS_DER_BLOB, &inner, &inner_len))
+		return -EFSCORRUPTED;
+
+	if (apfs_der_get(inner, inner_len, APFS_DER_FLAGS, &val, &val_len) ||
+	    !val_len)
+		return -EFSCORRUPTED;
+	blob->flags = val[0];
+
+	/* The unwrapped key must be 128 or 256 bits long */
+	if (apfs_der_get(inner, inner_len, APFS_DER_WRAPPED, &blob->wrapped,
+			 &blob->wrapped_len))
+		return -EFSCORRUPTED;
+	if (blob->wrapped_len != 24 && blob->wrapped_len != 40)
+		return -EFSCORRUPTED;
+	if (!kek)
+		return 0;
+
+	if (apfs_der_get(inner, inner_len, APFS_DER_ITERATIONS, &val,
+			 &val_len) || !val_len || val_len > 8)
+		return -EFSCORRUPTED;
+	for (blob->iterations = 0; val_len; --val_len)
+		blob->iterations = blob->iterations << 8 | *val++;
+	if (!blob->iterations)
+		return -EFSCORRUPTED;
+
+	if (apfs_der_get(inner, inner_len, APFS_DER_SALT, &blob->salt,
+			 &blob->salt_len) || !blob->salt_len)
+		return -EFSCORRUPTED;
+	return 0;
+}
+
+/**
+ * apfs_pbkdf2 - Derive a key from a passphrase with PBKDF2-HMAC-SHA256
+ * @pass:	the passphrase
+ * @salt:	the salt
+ * @salt_len:	length of @salt
+ * @iterations:	number of iterations
+ * @dk:		on return, the derived key, SHA256_DIGEST_SIZE bytes long
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_pbkdf2(const char *pass, const u8 *salt, int salt_len,
+		       u64 iterations, u8 *dk)
+{
+	struct crypto_shash *tfm;
+	u8 u[SHA256_DIGEST_SIZE];
+	__be32 block = cpu_to_be32(1);
+	u64 i;
+	int j, err;
+
+	tfm = crypto_alloc_shash("hmac(sha256)", 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+	err = crypto_shash_setkey(tfm, pass, strlen(pass));
+	if (err)
+		goto out;
+
+	{
+		SHASH_DESC_ON_STACK(desc, tfm);
+
+		desc->tfm = tfm;
+		desc->flags = CRYPTO_TFM_REQ_MAY_SLEEP;
+
+		/* A single block is enough for the longest key */
+		err = crypto_shash_init(desc) ?:
+		      crypto_shash_update(desc, salt, salt_len) ?:
+		      crypto_shash_update(desc, (u8 *)&block, sizeof(block)) ?:
+		      crypto_shash_final(desc, u);
+		memcpy(dk, u, sizeof(u));
+		for (i = 1; !err && i < iterations; ++i) {
+			err = crypto_shash_digest(desc, u, sizeof(u), u);
+			for (j = 0; j < sizeof(u); ++j)
+				dk[j] ^= u[j];
+			cond_resched();
+		}
+		shash_desc_zero(desc);
+	}
+	memzero_explicit(u, sizeof(u));
+out:
+	crypto_free_shash(tfm);
+	return err;
+}
+
+/**
+ * apfs_aes_unwrap - Unwrap a key with the algorithm from RFC 3394
+ * @kek:	key encryption key
+ * @kek_len:	length of @kek
+ * @wrapped:	the wrapped key
+ * @len:	length of @wrapped, a multiple of eight
+ * @key:	on return, the unwrapped key, eight bytes shorter than @wrapped
+ *
+ * Returns 0 on success, -EKEYREJECTED if the integrity check fails (so @kek
+ * was wrong), or another negative error code in case of failure.
+ */
+static int apfs_aes_unwrap(const u8 *kek, int kek_len, const u8 *wrapped,
+			   int len, u8 *key)
+{
+	struct crypto_cipher *tfm;
+	int n = len / 8 - 1;
+	__be64 block[2];
+	int i, j, err;
+
+	tfm = crypto_alloc_cipher("aes", 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+	err = crypto_cipher_setkey(tfm, kek, kek_len);
+	if (err)
+		goto out;
+
+	memcpy(&block[0], wrapped, 8);
+	memcpy(key, wrapped + 8, n * 8);
+	for (j = 5; j >= 0; --j) {
+		for (i = n; i >= 1; --i) {
+			block[0] ^= cpu_to_be64((u64)n * j + i);
+			memcpy(&block[1], key + (i - 1) * 8, 8);
+			crypto_cipher_decrypt_one(tfm, (u8 *)block,
+						  (u8 *)block);
+			memcpy(key + (i - 1) * 8, &block[1], 8);
+		}
+	}
+	if (be64_to_cpu(block[0]) != APFS_KEY_WRAP_IV) {
+		memzero_explicit(key, n * 8);
+		err = -EKEYREJECTED;
+	}
+	memzero_explicit(block, sizeof(block));
+out:
+	crypto_free_cipher(tfm);
+	return err;
+}
+
+/**
+ * apfs_vek_expand - Build the second XTS key for a 128-bit volume key
+ * @vek:	the volume key; its first half must be set already
+ * @uuid:	uuid of the volume
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_vek_expand(u8 *vek, const char *uuid)
+{
+	struct crypto_shash *tfm;
+	u8 hash[SHA256_DIGEST_SIZE];
+	int err;
+
+	tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+
+	{
+		SHASH_DESC_ON_STACK(desc, tfm);
+
+		desc->tfm = tfm;
+		desc->flags = 0;
+		err = crypto_shash_init(desc) ?:
+		      crypto_shash_update(desc, vek, APFS_VEK_LEN / 2) ?:
+		      crypto_shash_update(desc, uuid, 16) ?:
+		      crypto_shash_final(desc, hash);
+		shash_desc_zero(desc);
+	}
+	memcpy(vek + APFS_VEK_LEN / 2, hash, APFS_VEK_LEN / 2);
+	memzero_explicit(hash, sizeof(hash));
+	crypto_free_shash(tfm);
+	return err;
+}
+
+/**
+ * apfs_read_keybag - Read and decrypt a keybag
+ * @sb:		filesystem superblock
+ * @pr:		location of the keybag
+ * @uuid:	uuid of the container or volume, used as the key
+ * @type:	expected object type for the keybag
+ *
+ * Returns the keybag on success, or an error pointer in case of failure.  The
+ * caller must free it with kzfree().
+ */
+static struct apfs_media_keybag *apfs_read_keybag(struct super_block *sb,
+						  struct apfs_prange *pr,
+						  const char *uuid, u32 type)
+{
+	struct apfs_media_keybag *kb;
+	struct apfs_kb_locker *kl;
+	struct crypto_skcipher *tfm;
+	struct buffer_head *bh;
+	u64 bno = le64_to_cpu(pr->pr_start_paddr);
+	u8 key[APFS_VEK_LEN];
+	int err;
+
+	if (le64_to_cpu(pr->pr_block_count) != 1) {
+		apfs_err(sb, "unsupported keybag size");
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	/* The uuid is used for both XTS keys */
+	memcpy(key, uuid, 16);
+	memcpy(key + 16, uuid, 16);
+	tfm = apfs_xts_alloc(key);
+	if (IS_ERR(tfm))
+		return ERR_CAST(tfm);
+
+	kb = kmalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!kb) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	bh = apfs_sb_bread(sb, bno);
+	if (!bh) {
+		apfs_err(sb, "unable to read keybag");
+		err = -EIO;
+		goto fail;
+	}
+	err = apfs_xts_decrypt(tfm, virt_to_page(kb), offset_in_page(kb),
+			       bh->b_data, sb->s_blocksize,
+			       apfs_blocks_to_units(sb, bno));
+	brelse(bh);
+	if (err)
+		goto fail;
+
+	kl = &kb->mk_locker;
+	if (!apfs_obj_verify_csum(sb, &kb->mk_obj) ||
+	    le32_to_cpu(kb->mk_obj.o_type) != type ||
+	    le16_to_cpu(kl->kl_version) != APFS_KEYBAG_VERSION ||
+	    le32_to_cpu(kl->kl_nbytes) > sb->s_blocksize - sizeof(*kb)) {
+		apfs_err(sb, "bad keybag in block 0x%llx", bno);
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	crypto_free_skcipher(tfm);
+	return kb;
+
+fail:
+	kzfree(kb);
+	crypto_free_skcipher(tfm);
+	return ERR_PTR(err);
+}
+
+/**
+ * apfs_keybag_find - Find an entry in a keybag
+ * @kb:		the keybag
+ * @uuid:	uuid for the entry, or NULL to accept any
+ * @tag:	tag for the entry
+ * @prev:	entry to continue the search after, or NULL to start from the
+ *		beginning
+ *
+ * Returns the entry, or NULL if there is none.
+ */
+static struct apfs_keybag_entry *
+apfs_keybag_find(struct apfs_media_keybag *kb, const char *uuid, u16 tag,
+		 struct apfs_keybag_entry *prev)
+{
+	struct apfs_kb_locker *kl = &kb->mk_locker;
+	char *pos = (char *)kl->kl_entries;
+	char *end = pos + le32_to_cpu(kl->kl_nbytes);
+	int i;
+
+	for (i = 0; i < le16_to_cpu(kl->kl_nkeys); ++i) {
+		struct apfs_keybag_entry *entry = (void *)pos;
+		int len;
+
+		if (pos + sizeof(*entry) > end)
+			break;
+		len = sizeof(*entry) + le16_to_cpu(entry->ke_keylen);
+		if (pos + len > end)
+			break;
+
+		if (prev) {
+			if (entry == prev)
+				prev = NULL;
+		} else if (le16_to_cpu(entry->ke_tag) == tag &&
+			   (!uuid || !memcmp(entry->ke_uuid, uuid, 16))) {
+			return entry;
+		}
+		pos += ALIGN(len, 16);
+	}
+	return NULL;
+}
+
+/**
+ * apfs_get_passphrase - Get the passphrase to unlock the volume
+ * @sb:	filesystem superblock
+ *
+ * The passphrase is taken from the mount options, or else from a logon key
+ * named "apfs:" followed by the volume uuid.  Returns a copy of the
+ * passphrase that the caller must free with kzfree(), or an error pointer in
+ * case of failure.
+ */
+static char *apfs_get_passphrase(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+#ifdef CONFIG_KEYS
+	const struct user_key_payload *payload;
+	struct key *key;
+	char desc[48];
+	char *pass;
+#endif
+
+	if (sbi->s_passphrase)
+		return kstrdup(sbi->s_passphrase, GFP_KERNEL) ?:
+		       ERR_PTR(-ENOMEM);
+
+#ifdef CONFIG_KEYS
+	snprintf(desc, sizeof(desc), "apfs:%pUb",
+		 sbi->s_vsb_raw->apfs_vol_uuid);
+	key = request_key(&key_type_logon, desc, NULL);
+	if (IS_ERR(key))
+		return ERR_CAST(key);
+
+	down_read(&key->sem);
+	payload = user_key_payload_locked(key);
+	if (payload)
+		pass = kmemdup_nul(payload->data, payload->datalen,
+				   GFP_KERNEL) ?: ERR_PTR(-ENOMEM);
+	else /* The key was revoked */
+		pass = ERR_PTR(-EKEYREVOKED);
+	up_read(&key->sem);
+	key_put(key);
+	return pass;
+#else
+	return ERR_PTR(-ENOKEY);
+#endif
+}
+
+/**
+ * apfs_unwrap_vek - Unwrap the volume key with the user's passphrase
+ * @sb:		filesystem superblock
+ * @vol_kb:	keybag of the volume, with the key encryption keys
+ * @entry:	entry from the container keybag with the wrapped volume key
+ * @pass:	the passphrase
+ * @vek:	on return, the volume key
+ *
+ * Each user of the volume has its own key encryption key, so all of them are
+ * tried.  Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_unwrap_vek(struct super_block *sb,
+			   struct apfs_media_keybag *vol_kb,
+			   struct apfs_keybag_entry *entry, const char *pass,
+			   u8 *vek)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_key_blob vek_blob, kek_blob;
+	struct apfs_keybag_entry *kek_entry = NULL;
+	u8 dk[SHA256_DIGEST_SIZE];
+	u8 kek[APFS_VEK_LEN];
+	int err;
+
+	err = apfs_parse_key_blob(entry->ke_keydata,
+				  le16_to_cpu(entry->ke_keylen), &vek_blob,
+				  false /* kek */);
+	if (err) {
+		apfs_err(sb, "bad volume key");
+		return err;
+	}
+
+	err = -EKEYREJECTED;
+	while ((kek_entry = apfs_keybag_find(vol_kb, NULL,
+					     APFS_KB_TAG_VOLUME_UNLOCK_RECORDS,
+					     kek_entry))) {
+		int dk_len, kek_len;
+
+		if (apfs_parse_key_blob(kek_entry->ke_keydata,
+					le16_to_cpu(kek_entry->ke_keylen),
+					&kek_blob, true /* kek */))
+			continue;
+
+		err = apfs_pbkdf2(pass, kek_blob.salt, kek_blob.salt_len,
+				  kek_blob.iterations, dk);
+		if (err)
+			break;
+		dk_len = kek_blob.flags & APFS_KEY_FLAG_AES128 ? 16 : 32;
+		err = apfs_aes_unwrap(dk, dk_len, kek_blob.wrapped,
+				      kek_blob.wrapped_len, kek);
+		if (err == -EKEYREJECTED) /* Not this user's passphrase */
+			continue;
+		if (err)
+			break;
+
+		kek_len = vek_blob.flags & APFS_KEY_FLAG_AES128 ? 16 : 32;
+		err = apfs_aes_unwrap(kek, kek_len, vek_blob.wrapped,
+				      vek_blob.wrapped_len, vek);
+		if (!err && vek_blob.wrapped_len - 8 < APFS_VEK_LEN)
+			err = apfs_vek_expand(vek,
+					      sbi->s_vsb_raw->apfs_vol_uuid);
+		break;
+	}
+
+	if (err == -EKEYREJECTED)
+		apfs_err(sb, "wrong passphrase");
+	memzero_explicit(dk, sizeof(dk));
+	memzero_explicit(kek, sizeof(kek));
+	return err;
+}
+
+/**
+ * apfs_crypto_unlock - Set up the decryption of an encrypted volume
+ * @sb:	filesystem superblock
+ *
+ * Does nothing if the volume is not encrypted.  Otherwise the volume key is
+ * unwrapped with the passphrase, and an AES-XTS transform for it is stored in
+ * APFS_SB(@sb)->s_vek_tfm.  Returns 0 on success, or a negative error code in
+ * case of failure.
+ */
+int apfs_crypto_unlock(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nx_superblock *msb_raw = APFS_NXI(sb)->nx_raw;
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+	struct apfs_media_keybag *nx_kb = NULL, *vol_kb = NULL;
+	struct apfs_keybag_entry *entry;
+	struct crypto_skcipher *tfm;
+	u64 fs_flags = le64_to_cpu(vsb_raw->apfs_fs_flags);
+	u8 vek[APFS_VEK_LEN];
+	char *pass;
+	int err;
+
+	if (fs_flags & APFS_FS_UNENCRYPTED)
+		return 0;
+	if (!(fs_flags & APFS_FS_ONEKEY)) {
+		apfs_err(sb, "per-file encryption is not supported");
+		return -EOPNOTSUPP;
+	}
+
+	pass = apfs_get_passphrase(sb);
+	if (IS_ERR(pass)) {
+		apfs_err(sb, "no passphrase for the encrypted volume");
+		return PTR_ERR(pass);
+	}
+
+	nx_kb = apfs_read_keybag(sb, &msb_raw->nx_keylocker,
+				 msb_raw->nx_uuid,
+				 APFS_OBJECT_TYPE_CONTAINER_KEYBAG);
+	if (IS_ERR(nx_kb)) {
+		err = PTR_ERR(nx_kb);
+		nx_kb = NULL;
+		goto out;
+	}
+
+	/* The container keybag points to the volume keybag */
+	entry = apfs_keybag_find(nx_kb, vsb_raw->apfs_vol_uuid,
+				 APFS_KB_TAG_VOLUME_UNLOCK_RECORDS, NULL);
+	if (!entry || le16_to_cpu(entry->ke_keylen) <
+					sizeof(struct apfs_prange)) {
+		apfs_err(sb, "volume keybag not found");
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	vol_kb = apfs_read_keybag(sb, (struct apfs_prange *)entry->ke_keydata,
+				  vsb_raw->apfs_vol_uuid,
+				  APFS_OBJECT_TYPE_VOLUME_KEYBAG);
+	if (IS_ERR(vol_kb)) {
+		err = PTR_ERR(vol_kb);
+		vol_kb = NULL;
+		goto out;
+	}
+
+	entry = apfs_keybag_find(nx_kb, vsb_raw->apfs_vol_uuid,
+				 APFS_KB_TAG_VOLUME_KEY, NULL);
+	if (!entry) {
+		apfs_err(sb, "volume key not found");
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	err = apfs_unwrap_vek(sb, vol_kb, entry, pass, vek);
+	if (err)
+		goto out;
+
+	tfm = apfs_xts_alloc(vek);
+	if (IS_ERR(tfm)) {
+		err = PTR_ERR(tfm);
+		goto out;
+	}
+	sbi->s_vek_tfm = tfm;
+
+out:
+	memzero_explicit(vek, sizeof(vek));
+	kzfree(vol_kb);
+	kzfree(nx_kb);
+	kzfree(pass);
+	return err;
+}
+
+/**
+ * apfs_crypto_release - Clean up apfs_crypto_unlock()
+ * @sb:	filesystem superblock
+ */
+void apfs_crypto_release(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	apfs_node_cache_clear(sb);
+	if (sbi->s_vek_tfm)
+		crypto_free_skcipher(sbi->s_vek_tfm);
+	sbi->s_vek_tfm = NULL;
+}
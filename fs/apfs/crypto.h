@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/crypto.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_CRYPTO_H
+#define _APFS_CRYPTO_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include "object.h"
+#include "slotcache.h"
+
+struct bio;
+struct buffer_head;
+struct page;
+
+/* Keybag entry tags */
+#define APFS_KB_TAG_UNKNOWN			0
+#define APFS_KB_TAG_RESERVED_1			1
+#define APFS_KB_TAG_VOLUME_KEY			2
+#define APFS_KB_TAG_VOLUME_UNLOCK_RECORDS	3
+#define APFS_KB_TAG_VOLUME_PASSPHRASE_HINT	4
+#define APFS_KB_TAG_WRAPPING_M_KEY		5
+#define APFS_KB_TAG_VOLUME_M_KEY		6
+
+#define APFS_KEYBAG_VERSION			2
+
+/*
+ * Structure of an entry in a keybag
+ */
+struct apfs_keybag_entry {
+	char ke_uuid[16];
+	__le16 ke_tag;
+	__le16 ke_keylen;
+	u8 padding[4];
+	u8 ke_keydata[];
+} __packed;
+
+/*
+ * Structure of the keybag itself
+ */
+struct apfs_kb_locker {
+	__le16 kl_version;
+	__le16 kl_nkeys;
+	__le32 kl_nbytes;
+	u8 padding[8];
+	struct apfs_keybag_entry kl_entries[];
+} __packed;
+
+/*
+ * On-disk representation of a keybag, for a container or a volume
+ */
+struct apfs_media_keybag {
+	struct apfs_obj_phys mk_obj;
+	struct apfs_kb_locker mk_locker;
+} __packed;
+
+/* Size of the units for the AES-XTS tweak, the same for every block size */
+#define APFS_CRYPTO_UNIT_BITS		9
+#define APFS_CRYPTO_UNIT_SIZE		(1 << APFS_CRYPTO_UNIT_BITS)
+
+/**
+ * apfs_blocks_to_units - Convert a block count to encryption units
+ * @sb:		filesystem superblock
+ * @blocks:	number of blocks
+ */
+static inline u64 apfs_blocks_to_units(struct super_block *sb, u64 blocks)
+{
+	return blocks << (sb->s_blocksize_bits - APFS_CRYPTO_UNIT_BITS);
+}
+
+/* Length of the volume encryption key, which holds both XTS keys */
+#define APFS_VEK_LEN			32
+
+/* Number of decrypted metadata blocks cached for each volume */
+#define APFS_NODE_CACHE_SLOTS		64
+
+/*
+ * Direct-mapped cache of decrypted metadata blocks, so that hot nodes of the
+ * catalog only go through the cipher once.  Each slot holds a reference to
+ * the private buffer head for the plaintext; the block number of the buffer
+ * is the key.
+ */
+struct apfs_node_cache {
+	struct apfs_slot_cache base;
+	struct buffer_head *blocks[APFS_NODE_CACHE_SLOTS];
+};
+
+extern void apfs_node_cache_init(struct apfs_node_cache *cache);
+extern int apfs_crypto_unlock(struct super_block *sb);
+extern void apfs_crypto_release(struct super_block *sb);
+extern int apfs_decrypt_page(struct super_block *sb, struct page *page,
+			     unsigned int off, const void *src,
+			     unsigned int len, u64 unit);
+extern int apfs_decrypt_buf(struct super_block *sb, void *dst,
+			    const void *src, unsigned int len, u64 unit);
+extern int apfs_decrypt_bio(struct super_block *sb, struct bio *bio,
+			    u64 unit);
+extern struct buffer_head *apfs_read_decrypted_block(struct super_block *sb,
+						     u64 bno, bool *cached);
+extern void apfs_put_decrypted_block(struct buffer_head *bh);
+
+#endif	/* _APFS_CRYPTO_H */
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/debugfs.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include "apfs.h"
+#include "btree.h"
+#include "debugfs.h"
+#include "iotrace.h"
+#include "key.h"
+#include "node.h"
+#include "scan.h"
+#include "super.h"
+
+/* The apfs directory in debugfs */
+static struct dentry *apfs_debugfs_root;
+
+/**
+ * apfs_shape_add_node - Account for a node in the statistics for its b-tree
+ * @shape:	statistics for the tree
+ * @node:	the node
+ * @depth:	depth of @node in the tree, zero for the root
+ */
+static void apfs_shape_add_node(struct apfs_btree_shape *shape,
+				struct apfs_node *node, int depth)
+{
+	struct apfs_shape_level *level = &shape->levels[depth];
+	struct super_block *sb = node->object.sb;
+
+	level->nodes++;
+	level->records += node->records;
+	level->used += sb->s_blocksize - (node->data - node->free);
+	shape->height = max(shape->height, depth + 1);
+}
+
+/**
+ * apfs_shape_add_extents - Account for the extent count of a file
+ * @shape:	statistics for the catalog
+ * @count:	number of extents for the file
+ */
+static void apfs_shape_add_extents(struct apfs_btree_shape *shape, u64 count)
+{
+	int bucket;
+
+	if (!count)
+		return;
+	bucket = min_t(int, ilog2(count), APFS_SHAPE_EXTENT_BUCKETS - 1);
+	shape->extent_hist[bucket]++;
+	shape->files++;
+	shape->extents += count;
+	shape->max_extents = max(shape->max_extents, count);
+}
+
+/**
+ * apfs_btree_shape_walk - Gather statistics for a whole b-tree
+ * @scan:	scan for the tree, not yet started
+ * @shape:	statistics to fill
+ *
+ * Every node in the tree is read, so this may take a long time on a big
+ * volume; it can be interrupted by a fatal signal.  Returns 0 on success, or
+ * a negative error code in case of failure.
+ */
+static int apfs_btree_shape_walk(struct apfs_scan *scan,
+				 struct apfs_btree_shape *shape)
+{
+	u64 extent_id = 0, extent_count = 0;
+	int err;
+
+	scan->readahead = true;
+	err = apfs_scan_seek(scan, NULL /* key */);
+	if (err)
+		return err;
+	apfs_shape_add_node(shape, scan->root, 0 /* depth */);
+
+	while (1) {
+		err = apfs_scan_advance(scan);
+		if (err)
+			break;
+
+		if (!apfs_scan_at_leaf(scan)) {
+			err = apfs_scan_push_child(scan);
+			if (err)
+				break;
+			apfs_shape_add_node(shape, apfs_scan_leaf(scan)->node,
+					    scan->depth - 1);
+			if (fatal_signal_pending(current)) {
+				err = -EINTR;
+				break;
+			}
+			cond_resched();
+			continue;
+		}
+
+		if (!(scan->flags & APFS_QUERY_CAT) ||
+		    scan->key.type != APFS_TYPE_FILE_EXTENT)
+			continue;
+		/* The extents for each file are all together in the catalog */
+		if (scan->key.id != extent_id) {
+			apfs_shape_add_extents(shape, extent_count);
+			extent_id = scan->key.id;
+			extent_count = 0;
+		}
+		extent_count++;
+	}
+	apfs_shape_add_extents(shape, extent_count);
+
+	return err == -ENODATA ? 0 : err;
+}
+
+/**
+ * apfs_show_btree_info - Print the info footer from the root of a b-tree
+ * @m:		seq_file for the report
+ * @root:	root node
+ */
+static void apfs_show_btree_info(struct seq_file *m, struct apfs_node *root)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_btree_info *info;
+
+	if (!apfs_node_is_root(root)) {
+		seq_puts(m, "  no info footer in the root node\n");
+		return;
+	}
+	info = (void *)root->object.bh->b_data + sb->s_blocksize -
+	       sizeof(*info);
+	seq_printf(m, "  info: %llu keys, %llu nodes, longest key %u, longest value %u\n",
+		   le64_to_cpu(info->bt_key_count),
+		   le64_to_cpu(info->bt_node_count),
+		   le32_to_cpu(info->bt_longest_key),
+		   le32_to_cpu(info->bt_longest_val));
+}
+
+/**
+ * apfs_show_btree_shape - Walk a b-tree and print its statistics
+ * @m:		seq_file for the report
+ * @name:	name of the tree
+ * @scan:	scan for the tree, not yet started
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_show_btree_shape(struct seq_file *m, const char *name,
+				 struct apfs_scan *scan)
+{
+	struct super_block *sb = scan->sb;
+	struct apfs_btree_shape *shape;
+	int depth, i;
+	int err;
+
+	shape = kzalloc(sizeof(*shape), GFP_KERNEL);
+	if (!shape)
+		return -ENOMEM;
+	err = apfs_btree_shape_walk(scan, shape);
+	if (err)
+		goto out;
+
+	seq_printf(m, "%s:\n", name);
+	apfs_show_btree_info(m, scan->root);
+	seq_printf(m, "  height: %d\n", shape->height);
+	for (depth = 0; depth < shape->height; ++depth) {
+		struct apfs_shape_level *level = &shape->levels[depth];
+		u64 fanout_x10, fill;
+
+		if (!level->nodes)
+			continue;
+		fanout_x10 = div64_u64(level->records * 10, level->nodes);
+		fill = div64_u64(level->used * 100,
+				 level->nodes * sb->s_blocksize);
+		seq_printf(m, "  level %d: %llu nodes, %llu.%llu records per node, %llu%% full\n",
+			   shape->height - depth - 1, level->nodes,
+			   fanout_x10 / 10, fanout_x10 % 10, fill);
+	}
+
+	if (!(scan->flags & APFS_QUERY_CAT))
+		goto out;
+	seq_printf(m, "  files with extents: %llu, extents: %llu, most for a file: %llu\n",
+		   shape->files, shape->extents, shape->max_extents);
+	for (i = 0; i < APFS_SHAPE_EXTENT_BUCKETS; ++i) {
+		if (!shape->extent_hist[i])
+			continue;
+		seq_printf(m, "  files with %llu-%llu extents: %llu\n",
+			   1ULL << i, (2ULL << i) - 1, shape->extent_hist[i]);
+	}
+
+out:
+	kfree(shape);
+	return err;
+}
+
+static int apfs_btree_report_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_scan scan;
+	int err;
+
+	apfs_scan_cat_init(&scan, sb);
+	err = apfs_show_btree_shape(m, "catalog", &scan);
+	apfs_scan_release(&scan);
+	if (err)
+		return err;
+
+	apfs_scan_init(&scan, sb, sbi->s_omap_root, NULL /* omap */,
+		       0 /* xid */, APFS_QUERY_OMAP);
+	err = apfs_show_btree_shape(m, "object map", &scan);
+	apfs_scan_release(&scan);
+	return err;
+}
+
+static int apfs_btree_report_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, apfs_btree_report_show, inode->i_private);
+}
+
+static const struct file_operations apfs_btree_report_fops = {
+	.owner		= THIS_MODULE,
+	.open		= apfs_btree_report_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * apfs_debugfs_register - Create the debugfs directory for a mounted volume
+ * @sb:		filesystem superblock
+ *
+ * The directory has the same name as the one in sysfs.  Failure to create it
+ * is not an error, the volume just goes without.
+ */
+void apfs_debugfs_register(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	char name[32];
+
+	snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev),
+		 MINOR(sb->s_dev));
+	sbi->s_debugfs = debugfs_create_dir(name, apfs_debugfs_root);
+	debugfs_create_file("btrees", 0400, sbi->s_debugfs, sb,
+			    &apfs_btree_report_fops);
+	if (sbi->s_iotrace)
+		debugfs_create_file("iotrace", 0400, sbi->s_debugfs, sb,
+				    &apfs_iotrace_fops);
+}
+
+/**
+ * apfs_debugfs_unregister - Undo apfs_debugfs_register()
+ * @sb:		filesystem superblock
+ */
+void apfs_debugfs_unregister(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	debugfs_remove_recursive(sbi->s_debugfs);
+	sbi->s_debugfs = NULL;
+}
+
+/**
+ * apfs_debugfs_init - Create the apfs directory in debugfs
+ */
+void apfs_debugfs_init(void)
+{
+	apfs_debugfs_root = debugfs_create_dir("apfs", NULL);
+}
+
+/**
+ * apfs_debugfs_exit - Undo apfs_debugfs_init()
+ */
+void apfs_debugfs_exit(void)
+{
+	debugfs_remove_recursive(apfs_debugfs_root);
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/debugfs.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_DEBUGFS_H
+#define _APFS_DEBUGFS_H
+
+#include <linux/types.h>
+#include "scan.h"
+
+struct super_block;
+
+/* Files are counted in buckets by their extents: 1, 2-3, 4-7, ... */
+#define APFS_SHAPE_EXTENT_BUCKETS	16
+
+/*
+ * Node statistics for one level of a b-tree
+ */
+struct apfs_shape_level {
+	u64 nodes;			/* Number of nodes */
+	u64 records;			/* Records in all the nodes */
+	u64 used;			/* Bytes not in the free space */
+};
+
+/*
+ * Statistics gathered by a walk over a whole b-tree
+ */
+struct apfs_btree_shape {
+	int height;			/* Levels in the tree */
+	struct apfs_shape_level levels[APFS_SCAN_MAX_DEPTH];
+
+	/* Only for the catalog */
+	u64 files;			/* Files with at least one extent */
+	u64 extents;			/* Extent records for all files */
+	u64 max_extents;		/* Most extents for a single file */
+	u64 extent_hist[APFS_SHAPE_EXTENT_BUCKETS];
+};
+
+extern void apfs_debugfs_init(void);
+extern void apfs_debugfs_exit(void);
+extern void apfs_debugfs_register(struct super_block *sb);
+extern void apfs_debugfs_unregister(struct super_block *sb);
+
+#endif	/* _APFS_DEBUGFS_H */
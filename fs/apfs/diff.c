@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/diff.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/string.h>
+#include "apfs.h"
+#include "btree.h"
+#include "diff.h"
+#include "key.h"
+#include "node.h"
+#include "scan.h"
+#include "super.h"
+
+/**
+ * apfs_diff_init - Prepare to compare two versions of the catalog
+ * @diff:	the diff structure
+ * @sb:		filesystem superblock
+ * @old_root:	root node of the old catalog
+ * @old_xid:	transaction id for the old catalog
+ * @new_root:	root node of the new catalog
+ * @new_xid:	transaction id for the new catalog
+ *
+ * The comparison will only begin after a call to apfs_diff_seek().
+ */
+void apfs_diff_init(struct apfs_diff *diff, struct super_block *sb,
+		    struct apfs_node *old_root, u64 old_xid,
+		    struct apfs_node *new_root, u64 new_xid)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	apfs_scan_init(&diff->old, sb, old_root, sbi->s_omap_root, old_xid,
+		       APFS_QUERY_CAT);
+	apfs_scan_init(&diff->new, sb, new_root, sbi->s_omap_root, new_xid,
+		       APFS_QUERY_CAT);
+	diff->old_done = diff->new_done = true;
+	diff->pending = 0;
+}
+
+/**
+ * apfs_diff_release - Release all nodes held by a diff
+ * @diff:	the diff structure
+ */
+void apfs_diff_release(struct apfs_diff *diff)
+{
+	apfs_scan_release(&diff->old);
+	apfs_scan_release(&diff->new);
+}
+
+/**
+ * apfs_diff_step - Move one of the scans of a diff to its next entry
+ * @scan:	the scan
+ * @done:	set to true if the scan runs out of entries
+ * @descend:	go down into the child of the current entry first?
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_diff_step(struct apfs_scan *scan, bool *done, bool descend)
+{
+	int err;
+
+	if (descend) {
+		err = apfs_scan_push_child(scan);
+		if (err)
+			return err;
+	}
+	err = apfs_scan_advance(scan);
+	if (err == -ENODATA) {
+		*done = true;
+		return 0;
+	}
+	return err;
+}
+
+/**
+ * apfs_diff_seek - Move a diff right before the first record for a key
+ * @diff:	the diff structure
+ * @key:	key to look for; the name is ignored
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_diff_seek(struct apfs_diff *diff, struct apfs_key *key)
+{
+	int err;
+
+	diff->old_done = diff->new_done = false;
+	diff->pending = 0;
+
+	err = apfs_scan_seek(&diff->old, key);
+	if (!err)
+		err = apfs_diff_step(&diff->old, &diff->old_done, false);
+	if (err)
+		return err;
+	err = apfs_scan_seek(&diff->new, key);
+	if (!err)
+		err = apfs_diff_step(&diff->new, &diff->new_done, false);
+	return err;
+}
+
+/**
+ * apfs_diff_same_child - Check if two index entries lead to the same subtree
+ * @diff:	the diff structure, with both scans on an index entry
+ *
+ * The index nodes of the catalog hold virtual ids, so a single physical node
+ * may lead to different children in each transaction.  The subtrees can only
+ * be trusted to match if they are the same physical leaf; otherwise both
+ * must be descended, and their children compared in turn.
+ *
+ * Returns 1 if the subtrees are the same, 0 if they may not be, or a negative
+ * error code in case of failure.
+ */
+static int apfs_diff_same_child(struct apfs_diff *diff)
+{
+	u64 old_bno, new_bno, xid;
+	u32 flags;
+	int err;
+
+	if (diff->old.omap && !apfs_scan_child_is_leaf(&diff->old))
+		return 0;
+	if (diff->new.omap && !apfs_scan_child_is_leaf(&diff->new))
+		return 0;
+
+	err = apfs_scan_child(&diff->old, &old_bno, &xid, &flags);
+	if (err)
+		return err;
+	err = apfs_scan_child(&diff->new, &new_bno, &xid, &flags);
+	if (err)
+		return err;
+	return old_bno == new_bno;
+}
+
+/**
+ * apfs_diff_same_data - Check if the current records have the same value
+ * @diff:	the diff structure, with both scans on a leaf record
+ *
+ * Returns 1 if the values match, 0 if they don't, or a negative error code in
+ * case of failure.
+ */
+static int apfs_diff_same_data(struct apfs_diff *diff)
+{
+	struct apfs_scan *old = &diff->old, *new = &diff->new;
+	char *old_raw, *new_raw;
+	int err;
+
+	err = apfs_scan_read_data(old);
+	if (err)
+		return err;
+	err = apfs_scan_read_data(new);
+	if (err)
+		return err;
+	if (old->len != new->len)
+		return 0;
+
+	old_raw = apfs_scan_leaf(old)->node->object.bh->b_data;
+	new_raw = apfs_scan_leaf(new)->node->object.bh->b_data;
+	return !memcmp(old_raw + old->off, new_raw + new->off, old->len);
+}
+
+/**
+ * apfs_diff_next - Find the next record that differs between the two trees
+ * @diff:	the diff structure
+ *
+ * Both trees are walked in key order, but leaves that are the same physical
+ * node in both versions are skipped without reading them, so the cost of the
+ * comparison depends mostly on the size of the changes, not of the trees.
+ *
+ * Returns the kind of difference found on success; the current record of the
+ * old scan, the new scan or both will be the one that differs, with its data
+ * already located.  Returns -ENODATA if there are no more differences, or
+ * another negative error code in case of failure.
+ */
+int apfs_diff_next(struct apfs_diff *diff)
+{
+	struct super_block *sb = diff->old.sb;
+	struct apfs_scan *old = &diff->old, *new = &diff->new;
+	int err;
+
+	/* Move past the difference reported in the last call */
+	if (diff->pending == APFS_DIFF_OLD ||
+	    diff->pending == APFS_DIFF_CHANGED) {
+		err = apfs_diff_step(old, &diff->old_done, false);
+		if (err)
+			return err;
+	}
+	if (diff->pending == APFS_DIFF_NEW ||
+	    diff->pending == APFS_DIFF_CHANGED) {
+		err = apfs_diff_step(new, &diff->new_done, false);
+		if (err)
+			return err;
+	}
+	diff->pending = 0;
+
+	while (!diff->old_done || !diff->new_done) {
+		bool old_leaf, new_leaf;
+		int cmp, same;
+
+		if (diff->new_done) {
+			if (apfs_scan_at_leaf(old))
+				goto old_only;
+			goto old_descend;
+		}
+		if (diff->old_done) {
+			if (apfs_scan_at_leaf(new))
+				goto new_only;
+			goto new_descend;
+		}
+
+		old_leaf = apfs_scan_at_leaf(old);
+		new_leaf = apfs_scan_at_leaf(new);
+		cmp = apfs_keycmp(sb, &old->key, &new->key);
+
+		if (!old_leaf && !new_leaf) {
+			if (cmp < 0)
+				goto old_descend;
+			if (cmp > 0)
+				goto new_descend;
+
+			/* Skip identical leaves, or else look inside both */
+			same = apfs_diff_same_child(diff);
+			if (same < 0)
+				return same;
+			err = apfs_diff_step(old, &diff->old_done, !same);
+			if (!err)
+				err = apfs_diff_step(new, &diff->new_done,
+						     !same);
+			if (err)
+				return err;
+			continue;
+		}
+
+		/*
+		 * Index keys are never above the records of their subtree, so
+		 * a leaf record that comes before an index key can't be found
+		 * in the other tree.
+		 */
+		if (!old_leaf) {
+			if (cmp <= 0)
+				goto old_descend;
+			goto new_only;
+		}
+		if (!new_leaf) {
+			if (cmp >= 0)
+				goto new_descend;
+			goto old_only;
+		}
+
+		if (cmp < 0)
+			goto old_only;
+		if (cmp > 0)
+			goto new_only;
+
+		same = apfs_diff_same_data(diff);
+		if (same < 0)
+			return same;
+		if (!same) {
+			diff->pending = APFS_DIFF_CHANGED;
+			return APFS_DIFF_CHANGED;
+		}
+		err = apfs_diff_step(old, &diff->old_done, false);
+		if (!err)
+			err = apfs_diff_step(new, &diff->new_done, false);
+		if (err)
+			return err;
+		continue;
+
+old_descend:
+		err = apfs_diff_step(old, &diff->old_done, true);
+		if (err)
+			return err;
+		continue;
+new_descend:
+		err = apfs_diff_step(new, &diff->new_done, true);
+		if (err)
+			return err;
+	}
+	return -ENODATA;
+
+old_only:
+	err = apfs_scan_read_data(old);
+	if (err)
+		return err;
+	diff->pending = APFS_DIFF_OLD;
+	return APFS_DIFF_OLD;
+
+new_only:
+	err = apfs_scan_read_data(new);
+	if (err)
+		return err;
+	diff->pending = APFS_DIFF_NEW;
+	return APFS_DIFF_NEW;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/diff.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_DIFF_H
+#define _APFS_DIFF_H
+
+#include <linux/types.h>
+#include "scan.h"
+
+struct super_block;
+struct apfs_node;
+
+/* Kinds of differences found between two b-trees */
+enum {
+	APFS_DIFF_OLD = 1,	/* The record is only in the old tree */
+	APFS_DIFF_NEW,		/* The record is only in the new tree */
+	APFS_DIFF_CHANGED,	/* The record is in both, with different data */
+};
+
+/*
+ * Structure used to walk two versions of a b-tree in lockstep, to find the
+ * records that differ between them.
+ */
+struct apfs_diff {
+	struct apfs_scan old;		/* Scan of the old tree */
+	struct apfs_scan new;		/* Scan of the new tree */
+	bool old_done;			/* The old scan ran out of entries */
+	bool new_done;			/* The new scan ran out of entries */
+	int pending;			/* Last difference, not yet skipped */
+};
+
+extern void apfs_diff_init(struct apfs_diff *diff, struct super_block *sb,
+			   struct apfs_node *old_root, u64 old_xid,
+			   struct apfs_node *new_root, u64 new_xid);
+extern void apfs_diff_release(struct apfs_diff *diff);
+extern int apfs_diff_seek(struct apfs_diff *diff, struct apfs_key *key);
+extern int apfs_diff_next(struct apfs_diff *diff);
+
+#endif	/* _APFS_DIFF_H */
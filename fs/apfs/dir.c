@@ -7,41 +7,50 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/ctype.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/stringhash.h>
 #include "apfs.h"
 #include "btree.h"
 #include "dir.h"
+#include "inode.h"
 #include "key.h"
 #include "message.h"
 #include "node.h"
 #include "super.h"
+#include "sysfs.h"
+#include "trace.h"
 
 /**
- * apfs_drec_from_query - Read the directory record found by a successful query
- * @query:	the query that found the record
+ * apfs_drec_from_raw - Parse an on-disk directory record
+ * @raw_key:	pointer to the raw key
+ * @key_len:	length of the key
+ * @raw_val:	pointer to the raw value
+ * @val_len:	length of the value
  * @drec:	Return parameter.  The directory record found.
  *
  * Reads the directory record into @drec and performs some basic sanity checks
  * as a protection against crafted filesystems.  Returns 0 on success or
  * -EFSCORRUPTED otherwise.
  *
- * The caller must not free @query while @drec is in use, because @drec->name
- * points to data on disk.
+ * @drec->name points into @raw_key, so the caller must keep the node around
+ * while @drec is in use.
  */
-int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec)
+int apfs_drec_from_raw(void *raw_key, int key_len, void *raw_val, int val_len,
+		       struct apfs_drec *drec)
 {
-	char *raw = query->node->object.bh->b_data;
-	struct apfs_drec_hashed_key *de_key;
-	struct apfs_drec_val *de;
-	int namelen = query->key_len - sizeof(*de_key);
+	struct apfs_drec_hashed_key *de_key = raw_key;
+	struct apfs_drec_val *de = raw_val;
+	int namelen = key_len - sizeof(*de_key);
 
 	if (namelen < 1)
 		return -EFSCORRUPTED;
-	if (query->len < sizeof(*de))
+	if (val_len < sizeof(*de))
 		return -EFSCORRUPTED;
 
-	de = (struct apfs_drec_val *)(raw + query->off);
-	de_key = (struct apfs_drec_hashed_key *)(raw + query->key_off);
-
 	if (namelen != (le32_to_cpu(de_key->name_len_and_hash) &
 			APFS_DREC_LEN_MASK))
 		return -EFSCORRUPTED;
@@ -60,6 +69,285 @@ int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec)
 	return 0;
 }
 
+/**
+ * apfs_drec_from_query - Read the directory record found by a successful query
+ * @query:	the query that found the record
+ * @drec:	Return parameter.  The directory record found.
+ *
+ * Returns 0 on success or -EFSCORRUPTED otherwise.  The caller must not free
+ * @query while @drec is in use, because @drec->name points to data on disk.
+ */
+int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec)
+{
+	char *raw = query->node->object.bh->b_data;
+
+	return apfs_drec_from_raw(raw + query->key_off, query->key_len,
+				  raw + query->off, query->len, drec);
+}
+
+/**
+ * apfs_lookup_cache_init - Initialize an empty filename lookup cache
+ * @cache:	the cache
+ */
+void apfs_lookup_cache_init(struct apfs_lookup_cache *cache)
+{
+	apfs_slot_cache_init(&cache->base, cache->entries,
+			     APFS_LOOKUP_CACHE_SLOTS,
+			     sizeof(cache->entries[0]));
+}
+
+/**
+ * apfs_lookup_cache_key - Set up the key of a cached filename lookup
+ * @entry:	the cache entry
+ * @parent:	inode number of the directory
+ * @name:	the filename
+ *
+ * The name is not normalized, which is the costly part of a lookup; spellings
+ * that only differ in normalization just get entries of their own.  Returns
+ * the hash for the key.  The caller must check that the name is short enough
+ * to be cached.
+ */
+static u64 apfs_lookup_cache_key(struct apfs_lookup_cache_entry *entry,
+				 u64 parent, const struct qstr *name)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->lc_parent = parent;
+	entry->lc_len = name->len;
+	memcpy(entry->lc_name, name->name, name->len);
+	return parent ^ full_name_hash(NULL, name->name, name->len);
+}
+
+static bool apfs_lookup_cache_match(const void *entry, const void *key,
+				    void *out)
+{
+	const struct apfs_lookup_cache_entry *curr = entry, *wanted = key;
+
+	if (curr->lc_parent != wanted->lc_parent ||
+	    curr->lc_len != wanted->lc_len ||
+	    memcmp(curr->lc_name, wanted->lc_name, wanted->lc_len))
+		return false;
+	*(u64 *)out = curr->lc_cnid;
+	return true;
+}
+
+/**
+ * apfs_lookup_cache_find - Look for a filename lookup in the cache
+ * @sb:		filesystem superblock
+ * @parent:	inode number of the directory
+ * @name:	the filename
+ * @ino:	on return, the cached inode number
+ *
+ * Returns true on a cache hit, false otherwise.
+ */
+static bool apfs_lookup_cache_find(struct super_block *sb, u64 parent,
+				   const struct qstr *name, u64 *ino)
+{
+	struct apfs_lookup_cache *cache = &APFS_SB(sb)->s_lookup_cache;
+	struct apfs_lookup_cache_entry key;
+	u64 hash;
+
+	if (name->len > APFS_LOOKUP_CACHE_NAME_LEN)
+		return false;
+	hash = apfs_lookup_cache_key(&key, parent, name);
+	return apfs_slot_cache_find(&cache->base, hash,
+				    apfs_lookup_cache_match, &key, ino);
+}
+
+/**
+ * apfs_lookup_cache_insert - Add a filename lookup to the cache
+ * @sb:		filesystem superblock
+ * @parent:	inode number of the directory
+ * @name:	the filename
+ * @ino:	inode number found
+ *
+ * Replaces whatever lookup was cached in the same slot before.  Names that are
+ * too long are not cached at all.
+ */
+static void apfs_lookup_cache_insert(struct super_block *sb, u64 parent,
+				     const struct qstr *name, u64 ino)
+{
+	struct apfs_lookup_cache *cache = &APFS_SB(sb)->s_lookup_cache;
+	struct apfs_lookup_cache_entry entry;
+	u64 hash;
+
+	if (name->len > APFS_LOOKUP_CACHE_NAME_LEN)
+		return;
+	hash = apfs_lookup_cache_key(&entry, parent, name);
+	entry.lc_cnid = ino;
+	apfs_slot_cache_replace(&cache->base, hash, &entry, NULL /* old */);
+}
+
+/**
+ * apfs_name_is_ascii - Check if a filename is plain ascii
+ * @name:	the filename
+ * @len:	length of @name
+ */
+static bool apfs_name_is_ascii(const u8 *name, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (!isascii(name[i]))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * apfs_drec_name_cmp - Check if a directory record matches a filename
+ * @sb:		filesystem superblock
+ * @child:	filename being looked up
+ * @ascii:	is @child plain ascii?
+ * @drec:	directory record with the same hash as @child
+ *
+ * Normalization is the expensive part of the comparison, and it has no effect
+ * on ascii names other than the case folding; so the lengths and the raw bytes
+ * are enough to decide in the common cases.  Returns 0 if the names match.
+ */
+static int apfs_drec_name_cmp(struct super_block *sb, const struct qstr *child,
+			      bool ascii, struct apfs_drec *drec)
+{
+	if (child->len == drec->name_len &&
+	    !memcmp(child->name, drec->name, child->len))
+		return 0;
+
+	if (ascii && apfs_name_is_ascii(drec->name, drec->name_len)) {
+		if (child->len != drec->name_len)
+			return 1;
+		if (!apfs_is_case_insensitive(sb))
+			return 1;
+		return strncasecmp(child->name, drec->name, child->len);
+	}
+
+	return apfs_filename_cmp(sb, child->name, drec->name);
+}
+
+/**
+ * apfs_bloom_pos - Find the bit for a name hash in a Bloom filter
+ * @bloom:	the filter
+ * @hash:	name hash, masked as in the catalog keys
+ * @i:		number of the hash function
+ */
+static inline unsigned int apfs_bloom_pos(struct apfs_bloom *bloom, u32 hash,
+					  int i)
+{
+	u32 h1 = hash_32(hash, 32);
+	u32 h2 = hash_32(hash ^ 0x9e3779b9, 32) | 1;
+
+	return (h1 + i * h2) & ((1U << bloom->b_bits) - 1);
+}
+
+static void apfs_bloom_add(struct apfs_bloom *bloom, u32 hash)
+{
+	int i;
+
+	for (i = 0; i < APFS_BLOOM_HASHES; ++i)
+		__set_bit(apfs_bloom_pos(bloom, hash, i), bloom->b_map);
+}
+
+static bool apfs_bloom_test(struct apfs_bloom *bloom, u32 hash)
+{
+	int i;
+
+	for (i = 0; i < APFS_BLOOM_HASHES; ++i) {
+		if (!test_bit(apfs_bloom_pos(bloom, hash, i), bloom->b_map))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * apfs_dir_build_bloom - Build the Bloom filter for a directory
+ * @dir:	the directory
+ *
+ * Reads the name hashes of all the children into a new filter.  Failure is not
+ * an error, lookups will just keep querying the catalog.
+ */
+static void apfs_dir_build_bloom(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_inode_info *ai = APFS_I(dir);
+	struct apfs_bloom *bloom;
+	struct apfs_key key;
+	struct apfs_query *query;
+	unsigned int bits;
+	int err;
+
+	bits = min_t(u64, (u64)ai->i_nchildren * APFS_BLOOM_BITS_PER_CHILD,
+		     APFS_BLOOM_MAX_BITS);
+	bits = ilog2(roundup_pow_of_two(bits));
+	bloom = kvzalloc(sizeof(*bloom) + BITS_TO_LONGS(1U << bits) *
+			 sizeof(unsigned long), GFP_KERNEL);
+	if (!bloom)
+		return;
+	bloom->b_bits = bits;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		goto fail;
+	apfs_init_drec_hashed_key(sb, dir->i_ino, NULL /* name */, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+
+	while (1) {
+		struct apfs_drec_hashed_key *raw_key;
+		char *raw;
+
+		err = apfs_btree_query(sb, &query);
+		if (err)
+			break;
+		if (query->key_len < sizeof(*raw_key)) {
+			err = -EFSCORRUPTED;
+			break;
+		}
+		raw = query->node->object.bh->b_data;
+		raw_key = (struct apfs_drec_hashed_key *)(raw + query->key_off);
+		apfs_bloom_add(bloom, le32_to_cpu(raw_key->name_len_and_hash) &
+				      APFS_DREC_HASH_MASK);
+	}
+	apfs_free_query(sb, query);
+	if (err != -ENODATA)
+		goto fail;
+
+	/* Lookups run in parallel, so someone else may have built it first */
+	if (cmpxchg_release(&ai->i_bloom, NULL, bloom) == NULL)
+		return;
+fail:
+	kvfree(bloom);
+}
+
+/**
+ * apfs_dir_release_bloom - Free the Bloom filter for a directory, if any
+ * @dir:	the inode, being evicted
+ */
+void apfs_dir_release_bloom(struct inode *dir)
+{
+	struct apfs_inode_info *ai = APFS_I(dir);
+
+	kvfree(ai->i_bloom);
+	ai->i_bloom = NULL;
+}
+
+/**
+ * apfs_dir_lookup_miss - Account for a failed lookup in a directory
+ * @dir:	the directory
+ *
+ * With the bloom mount option, the filter is built once a large directory has
+ * seen a few failed lookups.
+ */
+static void apfs_dir_lookup_miss(struct inode *dir)
+{
+	struct apfs_inode_info *ai = APFS_I(dir);
+
+	if (!(APFS_SB(dir->i_sb)->s_flags & APFS_BLOOM))
+		return;
+	if (ai->i_nchildren < APFS_BLOOM_MIN_CHILDREN)
+		return;
+	if (atomic_inc_return(&ai->i_lookup_misses) == APFS_BLOOM_MISSES)
+		apfs_dir_build_bloom(dir);
+}
+
 /**
  * apfs_inode_by_name - Find the cnid for a given filename
  * @dir:	parent directory
@@ -76,11 +364,22 @@ int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
 	struct apfs_key key;
 	struct apfs_query *query;
 	struct apfs_drec drec;
+	struct apfs_bloom *bloom;
 	u64 cnid = dir->i_ino;
+	bool ascii;
+	int candidates = 0;
 	int err;
 
+	if (apfs_lookup_cache_find(sb, cnid, child, ino))
+		return 0;
+
 	apfs_init_drec_hashed_key(sb, cnid, child->name, &key);
 
+	/* The hash alone may be enough to tell that the name is missing */
+	bloom = smp_load_acquire(&APFS_I(dir)->i_bloom);
+	if (bloom && !apfs_bloom_test(bloom, key.number))
+		return -ENODATA;
+
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
@@ -90,25 +389,217 @@ int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
 	 * Distinct filenames in the same directory may (rarely) share the same
 	 * hash.  The query code cannot handle that because their order in the
 	 * b-tree would	depend on their unnormalized original names.  Just get
-	 * all the candidates and check them one by one.
+	 * all the candidates and check them one by one.  A crafted image could
+	 * have huge numbers of them, so put a limit on the work.
 	 */
 	query->flags |= APFS_QUERY_CAT | APFS_QUERY_ANY_NAME | APFS_QUERY_EXACT;
+	ascii = apfs_name_is_ascii(child->name, child->len);
 	do {
 		err = apfs_btree_query(sb, &query);
 		if (err)
 			goto out;
+		if (unlikely(++candidates > APFS_MAX_HASH_COLLISIONS)) {
+			apfs_alert(sb, "too many hash collisions in dir 0x%llx",
+				   cnid);
+			err = -EFSCORRUPTED;
+			goto out;
+		}
 		err = apfs_drec_from_query(query, &drec);
 		if (err)
 			goto out;
-	} while (unlikely(apfs_filename_cmp(sb, child->name, drec.name)));
+	} while (unlikely(apfs_drec_name_cmp(sb, child, ascii, &drec)));
 
 	*ino = drec.ino;
+	apfs_lookup_cache_insert(sb, cnid, child, drec.ino);
 out:
 	apfs_free_query(sb, query);
+	if (err == -ENODATA && !bloom)
+		apfs_dir_lookup_miss(dir);
 	return err;
 }
 
-static int apfs_readdir(struct file *file, struct dir_context *ctx)
+/**
+ * apfs_readdir_cache_flush - Add a page to the readdir cache of a directory
+ * @dir:	the directory
+ * @index:	index of the page in the mapping of @dir
+ * @buf:	page contents
+ *
+ * A concurrent build may have added the page already; its contents will be
+ * the same, since the filesystem is read-only.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_readdir_cache_flush(struct inode *dir, pgoff_t index,
+				    void *buf)
+{
+	struct address_space *mapping = dir->i_mapping;
+	struct page *page;
+
+	page = find_or_create_page(mapping, index, mapping_gfp_mask(mapping));
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page)) {
+		memcpy(kmap(page), buf, PAGE_SIZE);
+		kunmap(page);
+		SetPageUptodate(page);
+	}
+	unlock_page(page);
+	put_page(page);
+	return 0;
+}
+
+/**
+ * apfs_readdir_cache_build - Pack all entries of a directory in its page cache
+ * @dir:	the directory
+ *
+ * The cache is not published unless it was built in full.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+static int apfs_readdir_cache_build(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_dirent_cache_page *hdr;
+	struct apfs_key key;
+	struct apfs_query *query;
+	u64 cnid = dir->i_ino;
+	pgoff_t index = 0;
+	loff_t pos = 0;
+	int off;
+	int err;
+
+	hdr = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+	off = ALIGN(sizeof(*hdr), 8);
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query) {
+		err = -ENOMEM;
+		goto out;
+	}
+	apfs_init_drec_hashed_key(sb, cnid, NULL /* name */, &key);
+	query->key = &key;
+	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+
+	while (1) {
+		struct apfs_dirent_cache_entry *de;
+		struct apfs_drec drec;
+		int len;
+
+		err = apfs_btree_query(sb, &query);
+		if (err)
+			break;
+		err = apfs_drec_from_query(query, &drec);
+		if (err) {
+			apfs_alert(sb, "bad dentry record in directory 0x%llx",
+				   cnid);
+			break;
+		}
+
+		len = ALIGN(sizeof(*de) + drec.name_len, 8);
+		if (off + len > PAGE_SIZE) {
+			err = apfs_readdir_cache_flush(dir, index++, hdr);
+			if (err)
+				break;
+			memset(hdr, 0, PAGE_SIZE);
+			hdr->dp_first = pos;
+			off = ALIGN(sizeof(*hdr), 8);
+		}
+
+		de = (void *)hdr + off;
+		de->de_ino = drec.ino;
+		de->de_name_len = drec.name_len;
+		de->de_type = drec.type;
+		memcpy(de->de_name, drec.name, drec.name_len);
+		off += len;
+		hdr->dp_count++;
+		pos++;
+	}
+	apfs_free_query(sb, query);
+	if (err != -ENODATA)
+		goto out;
+
+	err = apfs_readdir_cache_flush(dir, index++, hdr);
+	if (err)
+		goto out;
+	/* Readers must see the pages before the cache becomes visible */
+	smp_store_release(&APFS_I(dir)->i_readdir_pages, index);
+
+out:
+	kfree(hdr);
+	return err;
+}
+
+/**
+ * apfs_readdir_cached - Emit directory entries from the readdir cache
+ * @file:	the directory
+ * @ctx:	directory context, past the dot entries
+ *
+ * Returns 0 on success, or -EAGAIN if the cache is missing or some of its
+ * pages got reclaimed; the caller should then read the catalog instead.
+ */
+static int apfs_readdir_cached(struct file *file, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(file);
+	struct apfs_inode_info *ai = APFS_I(dir);
+	pgoff_t npages, index;
+
+	/* Pairs with the release in apfs_readdir_cache_build() */
+	npages = smp_load_acquire(&ai->i_readdir_pages);
+
+	if (!npages)
+		return -EAGAIN;
+
+	for (index = 0; index < npages; ++index) {
+		struct apfs_dirent_cache_page *hdr;
+		struct page *page;
+		loff_t pos = ctx->pos - 2;
+		bool done = false;
+		int off, i;
+
+		page = find_get_page(dir->i_mapping, index);
+		if (!page || !PageUptodate(page)) {
+			if (page)
+				put_page(page);
+			/* Let the next full listing rebuild it */
+			cmpxchg(&ai->i_readdir_pages, npages, 0);
+			atomic_set(&ai->i_readdir_scans, 0);
+			return -EAGAIN;
+		}
+
+		hdr = kmap(page);
+		if (hdr->dp_first + hdr->dp_count <= pos)
+			goto next;
+		off = ALIGN(sizeof(*hdr), 8);
+		for (i = 0; i < hdr->dp_count && !done; ++i) {
+			struct apfs_dirent_cache_entry *de = (void *)hdr + off;
+
+			off += ALIGN(sizeof(*de) + de->de_name_len, 8);
+			if (hdr->dp_first + i < pos)
+				continue;
+			if (!dir_emit(ctx, de->de_name, de->de_name_len,
+				      de->de_ino, de->de_type))
+				done = true;
+			else
+				ctx->pos++;
+		}
+next:
+		kunmap(page);
+		put_page(page);
+		if (done)
+			break;
+	}
+	return 0;
+}
+
+/**
+ * apfs_readdir_catalog - Emit directory entries from the catalog
+ * @file:	the directory
+ * @ctx:	directory context, past the dot entries
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_readdir_catalog(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
@@ -119,17 +610,6 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 	loff_t pos;
 	int err = 0;
 
-	if (ctx->pos == 0) {
-		if (!dir_emit_dot(file, ctx))
-			return 0;
-		ctx->pos++;
-	}
-	if (ctx->pos == 1) {
-		if (!dir_emit_dotdot(file, ctx))
-			return 0;
-		ctx->pos++;
-	}
-
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return -ENOMEM;
@@ -145,8 +625,6 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 		/*
 		 * We query for the matching records, one by one. After we
 		 * pass ctx->pos we begin to emit them.
-		 *
-		 * TODO: Faster approach for large directories?
 		 */
 
 		err = apfs_btree_query(sb, &query);
@@ -180,8 +658,56 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 	return err;
 }
 
+static int apfs_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct apfs_inode_info *ai = APFS_I(file_inode(file));
+	u64 start = ktime_get_ns();
+	int err;
+
+	trace_apfs_readdir_enter(file_inode(file), ctx->pos, 0);
+	if (ctx->pos == 0) {
+		if (!dir_emit_dot(file, ctx)) {
+			err = 0;
+			goto out;
+		}
+		ctx->pos++;
+	}
+	if (ctx->pos == 1) {
+		if (!dir_emit_dotdot(file, ctx)) {
+			err = 0;
+			goto out;
+		}
+		ctx->pos++;
+	}
+
+	/*
+	 * Directories that get listed over and over are packed into their
+	 * page cache, so that later listings don't need the catalog.  The
+	 * pages are reclaimable like any other.  If the build fails, wait for
+	 * as many listings again before the next attempt.
+	 */
+	err = 0;
+	if (ctx->pos == 2 && !READ_ONCE(ai->i_readdir_pages) &&
+	    atomic_inc_return(&ai->i_readdir_scans) >= APFS_READDIR_CACHE_SCANS)
+		err = apfs_readdir_cache_build(file_inode(file));
+	if (err)
+		atomic_set(&ai->i_readdir_scans, 0);
+
+	err = apfs_readdir_cached(file, ctx);
+	if (err == -EAGAIN)
+		err = apfs_readdir_catalog(file, ctx);
+out:
+	trace_apfs_readdir_exit(file_inode(file), ctx->pos, err);
+	apfs_lat_add(file_inode(file)->i_sb, APFS_LAT_READDIR, start);
+	return err;
+}
+
 const struct file_operations apfs_dir_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
 	.iterate_shared	= apfs_readdir,
+	.unlocked_ioctl	= apfs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= apfs_compat_ioctl,
+#endif
 };
@@ -9,6 +9,7 @@
 #define _APFS_DIR_H
 
 #include <linux/types.h>
+#include "slotcache.h"
 
 struct inode;
 struct qstr;
@@ -35,6 +36,83 @@ struct apfs_drec {
 	unsigned int type;
 };
 
+/*
+ * Directory entry as packed in the readdir cache pages.  Entries are aligned
+ * to 8 bytes and never cross a page boundary.
+ */
+struct apfs_dirent_cache_entry {
+	u64 de_ino;
+	u16 de_name_len;
+	u8 de_type;
+	char de_name[];
+};
+
+/*
+ * Header at the start of each readdir cache page
+ */
+struct apfs_dirent_cache_page {
+	loff_t dp_first;	/* Position of the first entry, minus two */
+	u32 dp_count;		/* Number of entries in the page */
+};
+
+/* Full listings of a directory before its readdir cache is built */
+#define APFS_READDIR_CACHE_SCANS	2
+
+/*
+ * Most records with the same name hash that a lookup will check before giving
+ * up.  With 22-bit hashes, legitimate directories never get close to this.
+ */
+#define APFS_MAX_HASH_COLLISIONS	64
+
+/* Number of filename lookups cached for each volume */
+#define APFS_LOOKUP_CACHE_SLOTS	512
+/* Longest filename that gets cached, so that an entry takes 64 bytes */
+#define APFS_LOOKUP_CACHE_NAME_LEN	46
+
+/*
+ * A cached filename lookup.  The name is kept as given by the caller, before
+ * normalization; hits must match it byte by byte.
+ */
+struct apfs_lookup_cache_entry {
+	u64 lc_parent;			/* Inode number of the directory */
+	u64 lc_cnid;			/* Inode number found */
+	u16 lc_len;			/* Length of the filename */
+	char lc_name[APFS_LOOKUP_CACHE_NAME_LEN];
+};
+
+/*
+ * Direct-mapped cache of filename lookups, so that paths can be resolved again
+ * without the catalog after their dentries are evicted.  A zero parent marks
+ * an unused slot.
+ */
+struct apfs_lookup_cache {
+	struct apfs_slot_cache base;
+	struct apfs_lookup_cache_entry entries[APFS_LOOKUP_CACHE_SLOTS];
+};
+
+/* Failed lookups in a directory before a Bloom filter is built for it */
+#define APFS_BLOOM_MISSES		4
+/* Directories with fewer children are small enough to search directly */
+#define APFS_BLOOM_MIN_CHILDREN		256
+/* Largest Bloom filter for a directory, in bits */
+#define APFS_BLOOM_MAX_BITS		(1U << 23)
+/* Bits in the filter for each child, and bits set for each one */
+#define APFS_BLOOM_BITS_PER_CHILD	10
+#define APFS_BLOOM_HASHES		6
+
+/*
+ * Bloom filter over the name hashes of the children of a directory.  Lookups
+ * for names whose hash is not in the filter are known to fail.
+ */
+struct apfs_bloom {
+	unsigned int b_bits;		/* Log2 of the filter size */
+	unsigned long b_map[];
+};
+
+extern void apfs_dir_release_bloom(struct inode *dir);
+extern void apfs_lookup_cache_init(struct apfs_lookup_cache *cache);
+extern int apfs_drec_from_raw(void *raw_key, int key_len, void *raw_val,
+			      int val_len, struct apfs_drec *drec);
 extern int apfs_drec_from_query(struct apfs_query *query,
 				struct apfs_drec *drec);
 extern int apfs_inode_by_name(struct inode *dir, const struct qstr *child,
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/export.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/exportfs.h>
+#include <linux/fs.h>
+#include "apfs.h"
+#include "inode.h"
+
+/*
+ * File handle for an inode, with or without its parent
+ */
+struct apfs_fid {
+	u64 cnid;
+	u32 gen;
+	u64 parent_cnid;
+	u32 parent_gen;
+} __packed;
+
+/* Lengths of the file handles, in 32-bit words */
+#define APFS_FID_LEN		3
+#define APFS_FID_LEN_PARENT	6
+
+/**
+ * apfs_encode_fh - Build the file handle for an inode
+ * @inode:	the inode
+ * @fh:		buffer for the handle
+ * @max_len:	size of the buffer, in 32-bit words; set to the used length on
+ *		return
+ * @parent:	parent inode, or NULL if not needed
+ *
+ * Returns the type of the file handle, or FILEID_INVALID if it doesn't fit.
+ */
+static int apfs_encode_fh(struct inode *inode, __u32 *fh, int *max_len,
+			  struct inode *parent)
+{
+	struct apfs_fid *fid = (struct apfs_fid *)fh;
+	int len = parent ? APFS_FID_LEN_PARENT : APFS_FID_LEN;
+
+	if (*max_len < len) {
+		*max_len = len;
+		return FILEID_INVALID;
+	}
+	*max_len = len;
+
+	fid->cnid = apfs_ino(inode);
+	fid->gen = inode->i_generation;
+	if (!parent)
+		return FILEID_APFS_WITHOUT_PARENT;
+
+	fid->parent_cnid = apfs_ino(parent);
+	fid->parent_gen = parent->i_generation;
+	return FILEID_APFS_WITH_PARENT;
+}
+
+/**
+ * apfs_get_dentry - Get a dentry for an inode in a file handle
+ * @sb:		filesystem superblock
+ * @cnid:	inode number
+ * @gen:	generation number expected for the inode
+ *
+ * Returns the dentry on success, or an error pointer in case of failure.
+ */
+static struct dentry *apfs_get_dentry(struct super_block *sb, u64 cnid,
+				      u32 gen)
+{
+	struct inode *inode;
+
+	if (cnid < APFS_ROOT_DIR_INO_NUM)
+		return ERR_PTR(-ESTALE);
+
+	inode = apfs_iget(sb, cnid);
+	if (IS_ERR(inode)) {
+		if (PTR_ERR(inode) == -ENODATA)
+			return ERR_PTR(-ESTALE);
+		return ERR_CAST(inode);
+	}
+	if (inode->i_generation != gen) {
+		iput(inode);
+		return ERR_PTR(-ESTALE);
+	}
+	return d_obtain_alias(inode);
+}
+
+static struct dentry *apfs_fh_to_dentry(struct super_block *sb,
+					struct fid *fh, int fh_len, int fh_type)
+{
+	struct apfs_fid *fid = (struct apfs_fid *)fh;
+
+	if (fh_type != FILEID_APFS_WITHOUT_PARENT &&
+	    fh_type != FILEID_APFS_WITH_PARENT)
+		return NULL;
+	if (fh_len < APFS_FID_LEN)
+		return NULL;
+	return apfs_get_dentry(sb, fid->cnid, fid->gen);
+}
+
+static struct dentry *apfs_fh_to_parent(struct super_block *sb,
+					struct fid *fh, int fh_len, int fh_type)
+{
+	struct apfs_fid *fid = (struct apfs_fid *)fh;
+
+	if (fh_type != FILEID_APFS_WITH_PARENT)
+		return NULL;
+	if (fh_len < APFS_FID_LEN_PARENT)
+		return NULL;
+	return apfs_get_dentry(sb, fid->parent_cnid, fid->parent_gen);
+}
+
+/**
+ * apfs_get_parent - Get the parent dentry for a directory
+ * @child:	dentry for the directory
+ *
+ * Directories can't have hard links, so the parent id in the inode record is
+ * always right for them.  Returns the dentry on success, or an error pointer
+ * in case of failure.
+ */
+static struct dentry *apfs_get_parent(struct dentry *child)
+{
+	struct inode *inode = d_inode(child);
+	u64 parent_id = APFS_I(inode)->i_parent_id;
+	struct inode *parent;
+
+	if (parent_id < APFS_ROOT_DIR_INO_NUM)
+		return ERR_PTR(-ESTALE);
+
+	parent = apfs_iget(inode->i_sb, parent_id);
+	if (IS_ERR(parent) && PTR_ERR(parent) == -ENODATA)
+		return ERR_PTR(-ESTALE);
+	return d_obtain_alias(parent);
+}
+
+const struct export_operations apfs_export_ops = {
+	.encode_fh	= apfs_encode_fh,
+	.fh_to_dentry	= apfs_fh_to_dentry,
+	.fh_to_parent	= apfs_fh_to_parent,
+	.get_parent	= apfs_get_parent,
+};
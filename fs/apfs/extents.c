@@ -10,11 +10,14 @@
 #include "apfs.h"
 #include "btree.h"
 #include "extents.h"
+#include "fusion.h"
 #include "inode.h"
 #include "key.h"
 #include "message.h"
 #include "node.h"
 #include "super.h"
+#include "sysfs.h"
+#include "trace.h"
 
 /**
  * apfs_extent_from_query - Read the extent found by a successful query
@@ -48,6 +51,7 @@ int apfs_extent_from_query(struct apfs_query *query,
 	extent->logical_addr = le64_to_cpu(ext_key->logical_addr);
 	extent->phys_block_num = le64_to_cpu(ext->phys_block_num);
 	extent->len = ext_len;
+	extent->crypto_id = le64_to_cpu(ext->crypto_id);
 	return 0;
 }
 
@@ -60,8 +64,8 @@ int apfs_extent_from_query(struct apfs_query *query,
  * Finds and caches the extent record.  On success, returns a pointer to the
  * cache record; on failure, returns an error code.
  */
-static int apfs_extent_read(struct inode *inode, sector_t iblock,
-			    struct apfs_file_extent *extent)
+int apfs_extent_read(struct inode *inode, sector_t iblock,
+		     struct apfs_file_extent *extent)
 {
 	struct super_block *sb = inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
@@ -72,11 +76,13 @@ static int apfs_extent_read(struct inode *inode, sector_t iblock,
 	u64 iaddr = iblock << inode->i_blkbits;
 	int ret = 0;
 
+	apfs_stat_inc(sb, APFS_STAT_EXTENT_LOOKUPS);
 	spin_lock(&ai->i_extent_lock);
 	if (iaddr >= cache->logical_addr &&
 	    iaddr < cache->logical_addr + cache->len) {
 		*extent = *cache;
 		spin_unlock(&ai->i_extent_lock);
+		apfs_stat_inc(sb, APFS_STAT_EXTENT_HITS);
 		return 0;
 	}
 	spin_unlock(&ai->i_extent_lock);
@@ -115,7 +121,8 @@ int apfs_get_block(struct inode *inode, sector_t iblock,
 {
 	struct super_block *sb = inode->i_sb;
 	struct apfs_file_extent ext;
-	u64 blk_off, bno, map_len;
+	struct block_device *bdev;
+	u64 blk_off, bno, pbno, map_len, count;
 	int ret;
 
 	ret = apfs_extent_read(inode, iblock, &ext);
@@ -139,9 +146,21 @@ int apfs_get_block(struct inode *inode, sector_t iblock,
 	if (ext.phys_block_num != 0) {
 		/* Find the block number of iblock within the disk */
 		bno = ext.phys_block_num + blk_off;
-		map_bh(bh_result, sb, bno);
+
+		/* On fusion containers, the run may be split between devices */
+		count = map_len >> inode->i_blkbits;
+		ret = apfs_fusion_map(sb, bno, &count, &bdev, &pbno);
+		if (ret)
+			return ret;
+		map_len = min(map_len, count << inode->i_blkbits);
+
+		map_bh(bh_result, sb, pbno);
+		bh_result->b_bdev = bdev;
+		apfs_stat_add(sb, APFS_STAT_DATA_BYTES, map_len);
 	}
 
 	bh_result->b_size = map_len;
+	trace_apfs_get_block(inode, iblock, ext.logical_addr,
+			     ext.phys_block_num, ext.len, map_len);
 	return 0;
 }
@@ -35,10 +35,13 @@ struct apfs_file_extent {
 	u64 logical_addr;
 	u64 phys_block_num;
 	u64 len;
+	u64 crypto_id;		/* Tweak for the first block, if encrypted */
 };
 
 extern int apfs_extent_from_query(struct apfs_query *query,
 				  struct apfs_file_extent *extent);
+extern int apfs_extent_read(struct inode *inode, sector_t iblock,
+			    struct apfs_file_extent *extent);
 extern int apfs_get_block(struct inode *inode, sector_t iblock,
 			  struct buffer_head *bh_result, int create);
 
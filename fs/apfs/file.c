@@ -14,6 +14,10 @@ const struct file_operations apfs_file_operations = {
 	.read_iter	= generic_file_read_iter,
 	.mmap		= generic_file_readonly_mmap,
 	.open		= generic_file_open,
+	.unlocked_ioctl	= apfs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= apfs_compat_ioctl,
+#endif
 };
 
 const struct inode_operations apfs_file_inode_operations = {
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/fusion.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <linux/slab.h>
+#include "apfs.h"
+#include "btree.h"
+#include "fusion.h"
+#include "iotrace.h"
+#include "key.h"
+#include "message.h"
+#include "node.h"
+#include "super.h"
+
+/**
+ * apfs_fusion_init - Set up the tier 2 device of a fusion container
+ * @sb:		filesystem superblock
+ * @tier2_path:	path to the tier 2 device, or NULL if none was given
+ *
+ * Does nothing if the container is not a fusion set.  Otherwise the tier 2
+ * device is opened and checked, and the root of the middle tree is stored in
+ * APFS_NXI(@sb) along with a cache for its runs.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+int apfs_fusion_init(struct super_block *sb, const char *tier2_path)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
+	struct apfs_nx_superblock *tier2_raw;
+	struct apfs_fusion_cache *cache;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	fmode_t mode = FMODE_READ | FMODE_EXCL;
+	u64 features = le64_to_cpu(msb_raw->nx_incompatible_features);
+	u64 mt_root;
+	int err = 0;
+
+	if (!(features & APFS_NX_INCOMPAT_FUSION)) {
+		if (tier2_path)
+			apfs_notice(sb, "not a fusion container, tier2 ignored");
+		return 0;
+	}
+	if (!tier2_path) {
+		apfs_err(sb, "fusion container needs the tier2 mount option");
+		return -EINVAL;
+	}
+
+	/* Middle tree nodes on tier 2 would need the tree itself to be read */
+	mt_root = le64_to_cpu(msb_raw->nx_fusion_mt_oid);
+	if (!mt_root || apfs_is_tier2(sb, mt_root)) {
+		apfs_err(sb, "bad fusion middle tree");
+		return -EFSCORRUPTED;
+	}
+
+	bdev = blkdev_get_by_path(tier2_path, mode, sb->s_type);
+	if (IS_ERR(bdev)) {
+		apfs_err(sb, "unable to open the tier 2 device");
+		return PTR_ERR(bdev);
+	}
+	if (set_blocksize(bdev, sb->s_blocksize)) {
+		apfs_err(sb, "bad blocksize for the tier 2 device");
+		err = -EINVAL;
+		goto fail;
+	}
+
+	bh = __bread(bdev, APFS_NX_BLOCK_NUM, sb->s_blocksize);
+	if (!bh) {
+		apfs_err(sb, "unable to read the tier 2 device");
+		err = -EIO;
+		goto fail;
+	}
+	tier2_raw = (struct apfs_nx_superblock *)bh->b_data;
+	if (le32_to_cpu(tier2_raw->nx_magic) != APFS_NX_MAGIC ||
+	    memcmp(tier2_raw->nx_uuid, msb_raw->nx_uuid,
+		   sizeof(msb_raw->nx_uuid))) {
+		apfs_err(sb, "tier 2 device is not part of the container");
+		err = -EINVAL;
+	}
+	brelse(bh);
+	if (err)
+		goto fail;
+
+	cache = kmalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	apfs_slot_cache_init(&cache->base, cache->runs,
+			     APFS_FUSION_CACHE_SLOTS, sizeof(cache->runs[0]));
+
+	nxi->nx_tier2_bdev = bdev;
+	nxi->nx_fusion_mt_root = mt_root;
+	nxi->nx_fusion_cache = cache;
+	return 0;
+
+fail:
+	blkdev_put(bdev, mode);
+	return err;
+}
+
+/**
+ * apfs_fusion_exit - Clean up apfs_fusion_init()
+ * @nxi:	container info
+ */
+void apfs_fusion_exit(struct apfs_nxsb_info *nxi)
+{
+	if (nxi->nx_tier2_bdev)
+		blkdev_put(nxi->nx_tier2_bdev, FMODE_READ | FMODE_EXCL);
+	nxi->nx_tier2_bdev = NULL;
+	nxi->nx_fusion_mt_root = 0;
+	kfree(nxi->nx_fusion_cache);
+	nxi->nx_fusion_cache = NULL;
+}
+
+/**
+ * apfs_fusion_read_run - Find the middle tree run for a tier 2 block
+ * @sb:		filesystem superblock
+ * @bno:	block number on tier 2
+ * @run:	on return, the run that holds @bno
+ *
+ * If @bno is not cached on the main device, @run is the gap between the
+ * middle tree records around it, as far as the leaf node tells.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+static int apfs_fusion_read_run(struct super_block *sb, u64 bno,
+				struct apfs_fusion_run *run)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_node *root;
+	struct apfs_query *query;
+	struct apfs_fusion_mt_val *val;
+	struct apfs_key key;
+	char *raw;
+	u64 start, len, lba;
+	int off, key_len;
+	int ret;
+
+	root = apfs_read_node(sb, nxi->nx_fusion_mt_root);
+	if (IS_ERR(root)) {
+		apfs_err(sb, "unable to read the fusion middle tree");
+		return PTR_ERR(root);
+	}
+	query = apfs_alloc_query(root, NULL /* parent */);
+	apfs_node_put(root);
+	if (!query)
+		return -ENOMEM;
+
+	apfs_init_fusion_key(bno, &key);
+	query->key = &key;
+	query->flags |= APFS_QUERY_FUSION;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret == -ENODATA) {
+		/* All the cached runs are after this block */
+		run->fr_start = apfs_tier2_base(sb);
+		run->fr_len = bno + 1 - run->fr_start;
+		run->fr_lba = 0;
+		ret = 0;
+		goto out;
+	}
+	if (ret)
+		goto out;
+
+	raw = query->node->object.bh->b_data;
+	ret = apfs_read_fusion_key(raw + query->key_off, query->key_len, &key);
+	if (ret)
+		goto out;
+	if (query->len != sizeof(*val)) {
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	val = (struct apfs_fusion_mt_val *)(raw + query->off);
+	start = key.id;
+	len = le32_to_cpu(val->fmv_length) >> sb->s_blocksize_bits;
+	lba = le64_to_cpu(val->fmv_lba);
+
+	if (bno < start + len) {
+		/* Block zero is the container superblock, never a copy */
+		if (!lba || apfs_is_tier2(sb, lba + len - 1)) {
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+		run->fr_start = start;
+		run->fr_len = len;
+		run->fr_lba = lba;
+		goto out;
+	}
+
+	/* The run to read from tier 2 ends where the next cached one starts */
+	run->fr_start = start + len;
+	run->fr_len = bno + 1 - run->fr_start;
+	run->fr_lba = 0;
+	if (query->index + 1 >= query->node->records)
+		goto out;
+	key_len = apfs_node_locate_key(query->node, query->index + 1, &off);
+	if (apfs_read_fusion_key(raw + off, key_len, &key) || key.id <= bno)
+		goto out;
+	run->fr_len = key.id - run->fr_start;
+
+out:
+	apfs_free_query(sb, query);
+	return ret;
+}
+
+static bool apfs_fusion_run_match(const void *entry, const void *key,
+				  void *out)
+{
+	const struct apfs_fusion_run *run = entry;
+	u64 bno = *(const u64 *)key;
+
+	if (bno < run->fr_start || bno - run->fr_start >= run->fr_len)
+		return false;
+	memcpy(out, run, sizeof(*run));
+	return true;
+}
+
+/**
+ * apfs_fusion_lookup - Look for the cached copy of a tier 2 block
+ * @sb:		filesystem superblock
+ * @bno:	block number on tier 2
+ * @count:	number of blocks wanted; on return, the number of blocks that
+ *		can be mapped as a single run
+ * @lba:	on return, the block number of the copy on the main device
+ *
+ * The runs found in the middle tree are remembered, so that hot data doesn't
+ * pay for a descent of the tree on every read.  Returns 0 on success, -ENODATA
+ * if the block is not cached on the main device, or another negative error
+ * code in case of failure.
+ */
+static int apfs_fusion_lookup(struct super_block *sb, u64 bno, u64 *count,
+			      u64 *lba)
+{
+	struct apfs_fusion_cache *cache = APFS_NXI(sb)->nx_fusion_cache;
+	struct apfs_fusion_run run;
+	u64 hash = bno >> APFS_FUSION_CACHE_SHIFT;
+	int err;
+
+	if (!apfs_slot_cache_find(&cache->base, hash, apfs_fusion_run_match,
+				  &bno, &run)) {
+		err = apfs_fusion_read_run(sb, bno, &run);
+		if (err)
+			return err;
+		apfs_slot_cache_replace(&cache->base, hash, &run,
+					NULL /* old */);
+	}
+
+	*count = min(*count, run.fr_start + run.fr_len - bno);
+	if (!run.fr_lba)
+		return -ENODATA;
+	*lba = run.fr_lba + bno - run.fr_start;
+	return 0;
+}
+
+/**
+ * apfs_fusion_map - Find the device and block number for a container block
+ * @sb:		filesystem superblock
+ * @bno:	block number in the container
+ * @count:	number of blocks wanted; on return, the number of blocks that
+ *		can be read as a single run
+ * @bdev:	on return, the device to read from
+ * @pbno:	on return, the block number in @bdev
+ *
+ * Blocks from the tier 2 device are read from the main device instead if
+ * the middle tree has a copy for them.  Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+int apfs_fusion_map(struct super_block *sb, u64 bno, u64 *count,
+		    struct block_device **bdev, u64 *pbno)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	u64 lba;
+	int err;
+
+	if (!apfs_is_tier2(sb, bno)) {
+		*count = min(*count, apfs_tier2_base(sb) - bno);
+		*bdev = sb->s_bdev;
+		*pbno = bno;
+		return 0;
+	}
+	if (!nxi->nx_tier2_bdev) {
+		apfs_err(sb, "block 0x%llx is not in the container", bno);
+		return -EFSCORRUPTED;
+	}
+
+	err = apfs_fusion_lookup(sb, bno, count, &lba);
+	if (!err) {
+		*bdev = sb->s_bdev;
+		*pbno = lba;
+		return 0;
+	}
+	if (err != -ENODATA)
+		return err;
+
+	*bdev = nxi->nx_tier2_bdev;
+	*pbno = bno - apfs_tier2_base(sb);
+	return 0;
+}
+
+/**
+ * __apfs_sb_bread - Read a block from the container
+ * @sb:		filesystem superblock
+ * @bno:	block number in the container
+ * @cached:	on return, was the block already up to date in the buffer cache?
+ *
+ * Like sb_bread(), but for fusion containers the block may come from either
+ * of the two devices.  Returns the buffer head, or NULL in case of failure.
+ */
+struct buffer_head *__apfs_sb_bread(struct super_block *sb, u64 bno,
+				    bool *cached)
+{
+	struct block_device *bdev = sb->s_bdev;
+	struct buffer_head *bh;
+	u64 count = 1, pbno = bno;
+
+	if (apfs_is_tier2(sb, bno) &&
+	    apfs_fusion_map(sb, bno, &count, &bdev, &pbno))
+		return NULL;
+
+	bh = __getblk(bdev, pbno, sb->s_blocksize);
+	if (!bh)
+		return NULL;
+	*cached = buffer_uptodate(bh);
+	if (*cached)
+		return bh;
+
+	lock_buffer(bh);
+	if (bh_submit_read(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/**
+ * apfs_sb_bread - Read a metadata block from the container
+ * @sb:		filesystem superblock
+ * @bno:	block number in the container
+ *
+ * The read is recorded in the metadata read trace, if enabled; file data must
+ * be read with __apfs_sb_bread() instead.  Returns the buffer head, or NULL in
+ * case of failure.
+ */
+struct buffer_head *apfs_sb_bread(struct super_block *sb, u64 bno)
+{
+	struct buffer_head *bh;
+	bool cached;
+
+	bh = __apfs_sb_bread(sb, bno, &cached);
+	if (bh)
+		apfs_iotrace_add(sb, bno, (struct apfs_obj_phys *)bh->b_data,
+				 cached, _RET_IP_);
+	return bh;
+}
+
+/**
+ * apfs_sb_breadahead - Start reading a block from the container
+ * @sb:		filesystem superblock
+ * @bno:	block number in the container
+ */
+void apfs_sb_breadahead(struct super_block *sb, u64 bno)
+{
+	struct block_device *bdev;
+	u64 count = 1, pbno;
+
+	if (!apfs_is_tier2(sb, bno)) {
+		sb_breadahead(sb, bno);
+		return;
+	}
+	if (apfs_fusion_map(sb, bno, &count, &bdev, &pbno))
+		return;
+	__breadahead(bdev, pbno, sb->s_blocksize);
+}
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/fusion.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_FUSION_H
+#define _APFS_FUSION_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include "slotcache.h"
+#include "super.h"
+
+/*
+ * Byte address where the tier 2 device (the hard drive) starts in a fusion
+ * container.  Lower addresses belong to the main device (the solid state
+ * drive).
+ */
+#define APFS_FUSION_TIER2_DEVICE_BYTE_ADDR	0x4000000000000000ULL
+
+/*
+ * Structure of a value in the fusion middle tree, which maps blocks of the
+ * tier 2 device to their copies cached on the main device
+ */
+struct apfs_fusion_mt_val {
+	__le64 fmv_lba;		/* Address of the copy on the main device */
+	__le32 fmv_length;	/* Length of the mapping, in bytes */
+	__le32 fmv_flags;
+} __packed;
+
+/* Fusion middle tree value flags */
+#define APFS_FUSION_MT_DIRTY	0x00000001
+#define APFS_FUSION_MT_TENANT	0x00000002
+
+/* Number of middle tree runs cached for each fusion container */
+#define APFS_FUSION_CACHE_SLOTS	128
+
+/* Log2 of the number of tier 2 blocks that share a slot in the run cache */
+#define APFS_FUSION_CACHE_SHIFT	4
+
+/*
+ * A run of tier 2 blocks as found in the middle tree, either with a copy on
+ * the main device or with none
+ */
+struct apfs_fusion_run {
+	u64 fr_start;			/* First tier 2 block of the run */
+	u64 fr_len;			/* Number of blocks in the run */
+	u64 fr_lba;			/* Start of the copy, or 0 if none */
+};
+
+/*
+ * Direct-mapped cache of middle tree runs.  Each run goes in the slot of the
+ * block group where it was needed, so a long run may take several slots.  A
+ * zero length marks an unused slot.
+ */
+struct apfs_fusion_cache {
+	struct apfs_slot_cache base;
+	struct apfs_fusion_run runs[APFS_FUSION_CACHE_SLOTS];
+};
+
+/**
+ * apfs_tier2_base - Find the first block number on the tier 2 device
+ * @sb:		filesystem superblock
+ */
+static inline u64 apfs_tier2_base(struct super_block *sb)
+{
+	return APFS_FUSION_TIER2_DEVICE_BYTE_ADDR >> sb->s_blocksize_bits;
+}
+
+/**
+ * apfs_is_tier2 - Check if a block is on the tier 2 device
+ * @sb:		filesystem superblock
+ * @bno:	block number
+ */
+static inline bool apfs_is_tier2(struct super_block *sb, u64 bno)
+{
+	return bno >= apfs_tier2_base(sb);
+}
+
+extern int apfs_fusion_init(struct super_block *sb, const char *tier2_path);
+extern void apfs_fusion_exit(struct apfs_nxsb_info *nxi);
+extern int apfs_fusion_map(struct super_block *sb, u64 bno, u64 *count,
+			   struct block_device **bdev, u64 *pbno);
+extern struct buffer_head *__apfs_sb_bread(struct super_block *sb, u64 bno,
+					   bool *cached);
+extern struct buffer_head *apfs_sb_bread(struct super_block *sb, u64 bno);
+extern void apfs_sb_breadahead(struct super_block *sb, u64 bno);
+
+#endif	/* _APFS_FUSION_H */
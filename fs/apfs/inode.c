@@ -7,28 +7,43 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/hashtable.h>
 #include <linux/mpage.h>
+#include <linux/pagemap.h>
 #include <asm/div64.h>
 #include "apfs.h"
 #include "btree.h"
+#include "cache.h"
 #include "dir.h"
 #include "extents.h"
 #include "inode.h"
 #include "key.h"
 #include "message.h"
 #include "node.h"
+#include "readpage.h"
 #include "super.h"
+#include "sysfs.h"
 #include "xattr.h"
 
 static int apfs_readpage(struct file *file, struct page *page)
 {
-	return mpage_readpage(page, apfs_get_block);
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = mpage_readpage(page, apfs_get_block);
+	apfs_lat_add(page->mapping->host->i_sb, APFS_LAT_READPAGE, start);
+	return ret;
 }
 
 static int apfs_readpages(struct file *file, struct address_space *mapping,
 			  struct list_head *pages, unsigned int nr_pages)
 {
-	return mpage_readpages(mapping, pages, nr_pages, apfs_get_block);
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = mpage_readpages(mapping, pages, nr_pages, apfs_get_block);
+	apfs_lat_add(mapping->host->i_sb, APFS_LAT_READPAGES, start);
+	return ret;
 }
 
 static sector_t apfs_bmap(struct address_space *mapping, sector_t block)
@@ -42,32 +57,138 @@ static const struct address_space_operations apfs_aops = {
 	.bmap		= apfs_bmap,
 };
 
+static int apfs_crypt_readpage(struct file *file, struct page *page)
+{
+	u64 start = ktime_get_ns();
+
+	apfs_mpage_readpages(page->mapping, NULL /* pages */, page, 1);
+	apfs_lat_add(page->mapping->host->i_sb, APFS_LAT_READPAGE, start);
+	return 0;
+}
+
+static int apfs_crypt_readpages(struct file *file,
+				struct address_space *mapping,
+				struct list_head *pages, unsigned int nr_pages)
+{
+	u64 start = ktime_get_ns();
+
+	apfs_mpage_readpages(mapping, pages, NULL /* page */, nr_pages);
+	apfs_lat_add(mapping->host->i_sb, APFS_LAT_READPAGES, start);
+	return 0;
+}
+
+/*
+ * Encrypted files are read with large bios like the rest, and each bio gets
+ * decrypted in place from a workqueue once complete
+ */
+static const struct address_space_operations apfs_crypt_aops = {
+	.readpage	= apfs_crypt_readpage,
+	.readpages	= apfs_crypt_readpages,
+};
+
+static int apfs_cache_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	u64 start = ktime_get_ns();
+
+	if (apfs_readpage_from_cache(inode, page))
+		apfs_mpage_readpages(page->mapping, NULL /* pages */, page, 1);
+	apfs_lat_add(inode->i_sb, APFS_LAT_READPAGE, start);
+	return 0;
+}
+
+static int apfs_cache_readpages(struct file *file,
+				struct address_space *mapping,
+				struct list_head *pages, unsigned int nr_pages)
+{
+	struct inode *inode = mapping->host;
+	u64 start = ktime_get_ns();
+
+	if (apfs_readpages_from_cache(inode, mapping, pages, &nr_pages))
+		apfs_mpage_readpages(mapping, pages, NULL /* page */,
+				     nr_pages);
+	apfs_lat_add(inode->i_sb, APFS_LAT_READPAGES, start);
+	return 0;
+}
+
+/*
+ * Pages missing from fscache are read with large bios like the rest, and get
+ * stored in the cache from a workqueue once the bio is complete
+ */
+static const struct address_space_operations apfs_cache_aops = {
+	.readpage	= apfs_cache_readpage,
+	.readpages	= apfs_cache_readpages,
+#ifdef CONFIG_APFS_FSCACHE
+	.releasepage	= apfs_cache_releasepage,
+	.invalidatepage	= apfs_cache_invalidatepage,
+#endif
+};
+
 /**
- * apfs_inode_from_query - Read the inode found by a successful query
- * @query:	the query that found the record
+ * apfs_inode_xfield - Find an extended field in an inode record
+ * @inode_val:	the raw inode record
+ * @len:	length of the record
+ * @type:	type of the extended field
+ * @xval:	on return, a pointer to the data for the extended field
+ *
+ * Returns the length of the data for the extended field, or 0 if the inode
+ * doesn't have one of type @type.  Returns -EFSCORRUPTED if the record is too
+ * small for the extended field headers it claims to have.
+ */
+int apfs_inode_xfield(struct apfs_inode_val *inode_val, int len, u8 type,
+		      char **xval)
+{
+	struct apfs_xf_blob *xblob;
+	struct apfs_x_field *xfield;
+	int rest, i;
+
+	xblob = (struct apfs_xf_blob *) inode_val->xfields;
+	xfield = (struct apfs_x_field *) xblob->xf_data;
+	rest = len - (sizeof(*inode_val) + sizeof(*xblob));
+	rest -= le16_to_cpu(xblob->xf_num_exts) * sizeof(xfield[0]);
+	if (rest < 0)
+		return -EFSCORRUPTED;
+	for (i = 0; i < le16_to_cpu(xblob->xf_num_exts); ++i) {
+		int attrlen;
+
+		/* Attribute length is padded to a multiple of 8 */
+		attrlen = round_up(le16_to_cpu(xfield[i].x_size), 8);
+		if (attrlen > rest)
+			break;
+		if (xfield[i].x_type == type) {
+			*xval = (char *)inode_val + len - rest;
+			return le16_to_cpu(xfield[i].x_size);
+		}
+		rest -= attrlen;
+	}
+	return 0;
+}
+
+/**
+ * apfs_inode_from_raw - Read an on-disk inode record
  * @inode:	vfs inode to be filled with the read data
+ * @inode_val:	the raw inode record
+ * @len:	length of the record
  *
  * Reads the inode record into @inode and performs some basic sanity checks,
  * mostly as a protection against crafted filesystems.  Returns 0 on success
- * or a negative error code otherwise.
+ * or a negative error code otherwise.  Doesn't sleep.
  */
-static int apfs_inode_from_query(struct apfs_query *query, struct inode *inode)
+static int apfs_inode_from_raw(struct inode *inode,
+			       struct apfs_inode_val *inode_val, int len)
 {
 	struct apfs_inode_info *ai = APFS_I(inode);
-	struct apfs_inode_val *inode_val;
 	struct apfs_dstream *dstream = NULL;
-	struct apfs_xf_blob *xblob;
-	struct apfs_x_field *xfield;
-	char *raw = query->node->object.bh->b_data;
-	int rest, i;
+	char *xval;
+	int xlen;
 	u64 secs;
 
-	if (query->len < sizeof(*inode_val))
+	if (len < sizeof(*inode_val))
 		return -EFSCORRUPTED;
 
-	inode_val = (struct apfs_inode_val *)(raw + query->off);
-
 	ai->i_extent_id = le64_to_cpu(inode_val->private_id);
+	ai->i_parent_id = le64_to_cpu(inode_val->parent_id);
+	inode->i_generation = le32_to_cpu(inode_val->write_generation_counter);
 	inode->i_mode = le16_to_cpu(inode_val->mode);
 	i_uid_write(inode, (uid_t)le32_to_cpu(inode_val->owner));
 	i_gid_write(inode, (gid_t)le32_to_cpu(inode_val->group));
@@ -82,6 +203,8 @@ static int apfs_inode_from_query(struct apfs_query *query, struct inode *inode)
 		 * HFS/HFS+ modules just leave it at 1, and so do we, for now.
 		 */
 		set_nlink(inode, le32_to_cpu(inode_val->nlink));
+	} else if (S_ISDIR(inode->i_mode)) {
+		ai->i_nchildren = le32_to_cpu(inode_val->nchildren);
 	}
 
 	/* APFS stores the time as unsigned nanoseconds since the epoch */
@@ -98,27 +221,13 @@ static int apfs_inode_from_query(struct apfs_query *query, struct inode *inode)
 	ai->i_crtime.tv_nsec = do_div(secs, NSEC_PER_SEC);
 	ai->i_crtime.tv_sec = secs;
 
-	xblob = (struct apfs_xf_blob *) inode_val->xfields;
-	xfield = (struct apfs_x_field *) xblob->xf_data;
-	rest = query->len - (sizeof(*inode_val) + sizeof(*xblob));
-	rest -= le16_to_cpu(xblob->xf_num_exts) * sizeof(xfield[0]);
-	if (rest < 0)
-		return -EFSCORRUPTED;
-	for (i = 0; i < le16_to_cpu(xblob->xf_num_exts); ++i) {
-		int attrlen;
-
-		/* Attribute length is padded to a multiple of 8 */
-		attrlen = round_up(le16_to_cpu(xfield[i].x_size), 8);
-		if (attrlen > rest)
-			break;
-		if (xfield[i].x_type == APFS_INO_EXT_TYPE_DSTREAM) {
-			/* The only optional attr we care about, for now */
-			dstream = (struct apfs_dstream *)
-					((char *)inode_val + query->len - rest);
-			break;
-		}
-		rest -= attrlen;
-	}
+	/* The only optional attr we care about, for now */
+	xlen = apfs_inode_xfield(inode_val, len, APFS_INO_EXT_TYPE_DSTREAM,
+				 &xval);
+	if (xlen < 0)
+		return xlen;
+	if (xlen >= sizeof(*dstream))
+		dstream = (struct apfs_dstream *)xval;
 
 	if (dstream) {
 		inode->i_size = le64_to_cpu(dstream->size);
@@ -135,12 +244,273 @@ static int apfs_inode_from_query(struct apfs_query *query, struct inode *inode)
 	return 0;
 }
 
+/**
+ * apfs_name_cache_init - Initialize an empty inode name cache
+ * @cache:	the cache
+ */
+void apfs_name_cache_init(struct apfs_name_cache *cache)
+{
+	apfs_slot_cache_init(&cache->base, cache->entries,
+			     APFS_NAME_CACHE_SLOTS, sizeof(cache->entries[0]));
+}
+
+static bool apfs_name_cache_match(const void *entry, const void *key,
+				  void *out)
+{
+	const struct apfs_name_cache_entry *curr = entry;
+
+	if (curr->nc_cnid != *(const u64 *)key)
+		return false;
+	memcpy(out, curr, sizeof(*curr));
+	return true;
+}
+
+/**
+ * apfs_name_cache_lookup - Look for an inode name in the name cache
+ * @sb:		filesystem superblock
+ * @cnid:	inode number
+ * @parent:	on return, the cached inode number of the parent
+ * @name:	buffer for the cached name
+ * @size:	size of the buffer
+ *
+ * Returns the length of the name on a cache hit, or a negative number if the
+ * name isn't cached.
+ */
+static int apfs_name_cache_lookup(struct super_block *sb, u64 cnid,
+				  u64 *parent, char *name, int size)
+{
+	struct apfs_name_cache *cache = &APFS_SB(sb)->s_name_cache;
+	struct apfs_name_cache_entry entry;
+
+	if (!apfs_slot_cache_find(&cache->base, cnid, apfs_name_cache_match,
+				  &cnid, &entry))
+		return -1;
+	if (entry.nc_len >= size)
+		return -1;
+	*parent = entry.nc_parent;
+	memcpy(name, entry.nc_name, entry.nc_len + 1);
+	return entry.nc_len;
+}
+
+/**
+ * apfs_name_cache_insert - Add an inode name to the name cache
+ * @sb:		filesystem superblock
+ * @cnid:	inode number
+ * @parent:	inode number of the parent
+ * @name:	null-terminated name of the inode
+ * @len:	length of the name
+ *
+ * Replaces whatever name was cached in the same slot before.  Names that are
+ * too long are not cached at all.
+ */
+static void apfs_name_cache_insert(struct super_block *sb, u64 cnid,
+				   u64 parent, const char *name, int len)
+{
+	struct apfs_name_cache *cache = &APFS_SB(sb)->s_name_cache;
+	struct apfs_name_cache_entry entry;
+
+	if (len >= APFS_NAME_CACHE_LEN)
+		return;
+	memset(&entry, 0, sizeof(entry));
+	entry.nc_cnid = cnid;
+	entry.nc_parent = parent;
+	entry.nc_len = len;
+	memcpy(entry.nc_name, name, len + 1);
+	apfs_slot_cache_replace(&cache->base, cnid, &entry, NULL /* old */);
+}
+
+/**
+ * apfs_inode_name - Find the name and parent of an inode
+ * @sb:		filesystem superblock
+ * @cnid:	inode number
+ * @parent:	on return, the inode number of the parent
+ * @name:	buffer for the null-terminated name
+ * @size:	size of the buffer
+ *
+ * The name is the one stored in the inode record, so for hard links it's the
+ * name of the first link only.  Returns the length of the name on success, or
+ * a negative error code in case of failure.
+ */
+int apfs_inode_name(struct super_block *sb, u64 cnid, u64 *parent,
+		    char *name, int size)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_inode_val *inode_val;
+	struct apfs_query *query;
+	struct apfs_key key;
+	char *raw, *xval;
+	int xlen, len;
+
+	len = apfs_name_cache_lookup(sb, cnid, parent, name, size);
+	if (len >= 0)
+		return len;
+
+	apfs_init_inode_key(cnid, &key);
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = &key;
+	query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
+
+	len = apfs_btree_query(sb, &query);
+	if (len)
+		goto done;
+
+	raw = query->node->object.bh->b_data;
+	inode_val = (struct apfs_inode_val *)(raw + query->off);
+	len = -EFSCORRUPTED;
+	if (query->len < sizeof(*inode_val))
+		goto corrupted;
+	xlen = apfs_inode_xfield(inode_val, query->len,
+				 APFS_INO_EXT_TYPE_NAME, &xval);
+	/* The name is null-terminated, and the null is counted */
+	if (xlen <= 1 || xval[xlen - 1] || !xval[0])
+		goto corrupted;
+
+	len = strlen(xval);
+	if (len >= size) {
+		len = -ENAMETOOLONG;
+		goto done;
+	}
+	memcpy(name, xval, len + 1);
+	*parent = le64_to_cpu(inode_val->parent_id);
+	apfs_name_cache_insert(sb, cnid, *parent, name, len);
+	goto done;
+
+corrupted:
+	apfs_alert(sb, "bad inode record for inode 0x%llx", cnid);
+done:
+	apfs_free_query(sb, query);
+	return len;
+}
+
+/**
+ * apfs_inode_cache_init - Initialize an empty cache of inode records
+ * @cache:	the cache
+ */
+void apfs_inode_cache_init(struct apfs_inode_cache *cache)
+{
+	spin_lock_init(&cache->lock);
+	hash_init(cache->buckets);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->count = 0;
+	cache->bytes = 0;
+}
+
+/**
+ * apfs_inode_cache_evict - Drop the least recently used inode record
+ * @cache:	the cache, with the lock held
+ */
+static void apfs_inode_cache_evict(struct apfs_inode_cache *cache)
+{
+	struct apfs_inode_cache_entry *entry;
+
+	entry = list_last_entry(&cache->lru, struct apfs_inode_cache_entry,
+				ic_lru);
+	hash_del(&entry->ic_hash);
+	list_del(&entry->ic_lru);
+	cache->count--;
+	cache->bytes -= sizeof(*entry) + entry->ic_len;
+	kfree(entry);
+}
+
+/**
+ * apfs_inode_cache_shrink - Drop inode records from the cache
+ * @cache:	the cache
+ * @nr:		number of records to drop
+ *
+ * The least recently used records go first.  Returns the number of records
+ * that were dropped.
+ */
+unsigned long apfs_inode_cache_shrink(struct apfs_inode_cache *cache,
+				      unsigned long nr)
+{
+	unsigned long freed = 0;
+
+	spin_lock(&cache->lock);
+	while (freed < nr && cache->count) {
+		apfs_inode_cache_evict(cache);
+		freed++;
+	}
+	spin_unlock(&cache->lock);
+	return freed;
+}
+
+/**
+ * apfs_inode_cache_read - Read an inode from the cache of inode records
+ * @inode:	vfs inode to fill
+ *
+ * Returns 0 on success, -ENODATA if the record is not cached, or another
+ * negative error code in case of failure.
+ */
+static int apfs_inode_cache_read(struct inode *inode)
+{
+	struct apfs_inode_cache *cache = &APFS_SB(inode->i_sb)->s_inode_cache;
+	struct apfs_inode_cache_entry *entry;
+	u64 cnid = apfs_ino(inode);
+	int ret = -ENODATA;
+
+	spin_lock(&cache->lock);
+	hash_for_each_possible(cache->buckets, entry, ic_hash, cnid) {
+		if (entry->ic_cnid != cnid)
+			continue;
+		list_move(&entry->ic_lru, &cache->lru);
+		ret = apfs_inode_from_raw(inode, entry->ic_val, entry->ic_len);
+		break;
+	}
+	spin_unlock(&cache->lock);
+	return ret;
+}
+
+/**
+ * apfs_inode_cache_insert - Add an inode record to the cache
+ * @sb:		filesystem superblock
+ * @cnid:	inode number
+ * @inode_val:	the raw inode record
+ * @len:	length of the record
+ *
+ * The least recently used records are dropped to make room if needed.  Failure
+ * to allocate memory is not an error, the record just doesn't get cached.
+ */
+static void apfs_inode_cache_insert(struct super_block *sb, u64 cnid,
+				    struct apfs_inode_val *inode_val, int len)
+{
+	struct apfs_inode_cache *cache = &APFS_SB(sb)->s_inode_cache;
+	struct apfs_inode_cache_entry *entry, *old;
+
+	entry = kmalloc(sizeof(*entry) + len, GFP_NOFS | __GFP_NOWARN);
+	if (!entry)
+		return;
+	entry->ic_cnid = cnid;
+	entry->ic_len = len;
+	memcpy(entry->ic_val, inode_val, len);
+
+	spin_lock(&cache->lock);
+	hash_for_each_possible(cache->buckets, old, ic_hash, cnid) {
+		if (old->ic_cnid == cnid) {
+			/* Someone else got here first */
+			spin_unlock(&cache->lock);
+			kfree(entry);
+			return;
+		}
+	}
+	hash_add(cache->buckets, &entry->ic_hash, cnid);
+	list_add(&entry->ic_lru, &cache->lru);
+	cache->count++;
+	cache->bytes += sizeof(*entry) + len;
+	while (cache->bytes > APFS_INODE_CACHE_MAX_BYTES)
+		apfs_inode_cache_evict(cache);
+	spin_unlock(&cache->lock);
+}
+
 /**
  * apfs_inode_lookup - Lookup an inode record in the b-tree and read its data
  * @inode:	vfs inode to lookup and fill
  *
  * Queries the b-tree for the @inode->i_ino inode record and reads its data to
- * @inode.  Returns 0 on success or a negative error code otherwise.
+ * @inode.  Records of recently evicted inodes are kept in a cache, so that
+ * the catalog is only queried on a miss.  Returns 0 on success or a negative
+ * error code otherwise.
  */
 static int apfs_inode_lookup(struct inode *inode)
 {
@@ -148,9 +518,14 @@ static int apfs_inode_lookup(struct inode *inode)
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_key key;
 	struct apfs_query *query;
+	struct apfs_inode_val *inode_val;
 	u64 cnid = inode->i_ino;
 	int ret;
 
+	ret = apfs_inode_cache_read(inode);
+	if (ret != -ENODATA)
+		return ret;
+
 	apfs_init_inode_key(cnid, &key);
 
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
@@ -163,9 +538,13 @@ static int apfs_inode_lookup(struct inode *inode)
 	if (ret)
 		goto done;
 
-	ret = apfs_inode_from_query(query, inode);
+	inode_val = (void *)query->node->object.bh->b_data + query->off;
+	ret = apfs_inode_from_raw(inode, inode_val, query->len);
 	if (ret)
 		apfs_alert(sb, "bad inode record for inode 0x%llx", cnid);
+	else
+		apfs_inode_cache_insert(sb, apfs_ino(inode), inode_val,
+					query->len);
 
 done:
 	apfs_free_query(sb, query);
@@ -255,7 +634,13 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &apfs_file_inode_operations;
 		inode->i_fop = &apfs_file_operations;
-		inode->i_mapping->a_ops = &apfs_aops;
+		apfs_cache_get_inode_cookie(inode);
+		if (sbi->s_vek_tfm)
+			inode->i_mapping->a_ops = &apfs_crypt_aops;
+		else if (apfs_cache_enabled(inode))
+			inode->i_mapping->a_ops = &apfs_cache_aops;
+		else
+			inode->i_mapping->a_ops = &apfs_aops;
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &apfs_dir_inode_operations;
 		inode->i_fop = &apfs_dir_operations;
@@ -275,6 +660,7 @@ int apfs_getattr(const struct path *path, struct kstat *stat,
 {
 	struct inode *inode = d_inode(path->dentry);
 	struct apfs_inode_info *ai = APFS_I(inode);
+	u64 start = ktime_get_ns();
 
 	stat->result_mask |= STATX_BTIME;
 	stat->btime = ai->i_crtime;
@@ -288,5 +674,6 @@ int apfs_getattr(const struct path *path, struct kstat *stat,
 #if BITS_PER_LONG == 32
 	stat->ino = ai->i_ino;
 #endif
+	apfs_lat_add(inode->i_sb, APFS_LAT_GETATTR, start);
 	return 0;
 }
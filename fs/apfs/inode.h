@@ -9,8 +9,10 @@
 #define _APFS_INODE_H
 
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/types.h>
 #include "extents.h"
+#include "slotcache.h"
 
 /* Inode numbers for special inodes */
 #define APFS_INVALID_INO_NUM		0
@@ -103,6 +105,59 @@ struct apfs_dstream {
 	__le64 total_bytes_read;
 } __packed;
 
+/* Number of inode names cached for each volume, for path lookups */
+#define APFS_NAME_CACHE_SLOTS	64
+/* Longest name that gets cached, counting the null termination */
+#define APFS_NAME_CACHE_LEN	48
+
+/*
+ * A cached inode name, with the parent of the inode
+ */
+struct apfs_name_cache_entry {
+	u64 nc_cnid;			/* Inode number */
+	u64 nc_parent;			/* Inode number of the parent */
+	int nc_len;			/* Length of the name */
+	char nc_name[APFS_NAME_CACHE_LEN];
+};
+
+/*
+ * Direct-mapped cache of inode names.  A zero inode number marks an unused
+ * slot.
+ */
+struct apfs_name_cache {
+	struct apfs_slot_cache base;
+	struct apfs_name_cache_entry entries[APFS_NAME_CACHE_SLOTS];
+};
+
+/* Memory limit for the inode records cached for each volume */
+#define APFS_INODE_CACHE_MAX_BYTES	(256 * 1024)
+/* Number of hash buckets for the cached inode records, as a power of two */
+#define APFS_INODE_CACHE_BITS		8
+
+/*
+ * A cached inode record, with all its extended fields
+ */
+struct apfs_inode_cache_entry {
+	struct hlist_node ic_hash;	/* Entry in the hash table */
+	struct list_head ic_lru;	/* Entry in the lru list */
+	u64 ic_cnid;			/* Inode number */
+	int ic_len;			/* Length of the record */
+	struct apfs_inode_val ic_val[]; /* The raw record */
+};
+
+/*
+ * Cache of the raw records of recently read inodes, so that inodes evicted
+ * from the icache can be read again without the catalog.  Like the slot
+ * caches, it's never invalidated; see slotcache.h.
+ */
+struct apfs_inode_cache {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(buckets, APFS_INODE_CACHE_BITS);
+	struct list_head lru;		/* Most recently used first */
+	unsigned long count;		/* Number of cached records */
+	size_t bytes;			/* Memory used by the records */
+};
+
 /*
  * APFS inode data in memory
  */
@@ -111,6 +166,15 @@ struct apfs_inode_info {
 	struct apfs_file_extent	i_cached_extent; /* Latest extent record */
 	spinlock_t		i_extent_lock;	 /* Protects i_cached_extent */
 	struct timespec64	i_crtime;	 /* Time of creation */
+	u64			i_parent_id;	 /* ID of the primary parent */
+	u32			i_nchildren;	 /* Children of a directory */
+	struct apfs_bloom	*i_bloom;	 /* Filter for failed lookups */
+	atomic_t		i_lookup_misses; /* Failed lookups so far */
+	pgoff_t			i_readdir_pages; /* Size of readdir cache */
+	atomic_t		i_readdir_scans; /* Full listings so far */
+#ifdef CONFIG_APFS_FSCACHE
+	struct fscache_cookie	*i_fscache;	 /* Cookie for the file data */
+#endif
 
 #if BITS_PER_LONG == 32
 	/* This is the actual inode number; vfs_inode.i_ino could overflow */
@@ -124,6 +188,27 @@ static inline struct apfs_inode_info *APFS_I(struct inode *inode)
 	return container_of(inode, struct apfs_inode_info, vfs_inode);
 }
 
+/**
+ * apfs_ino - Get the full 64-bit inode number of an inode
+ * @inode:	the vfs inode
+ */
+static inline u64 apfs_ino(struct inode *inode)
+{
+#if BITS_PER_LONG == 32
+	return APFS_I(inode)->i_ino;
+#else
+	return inode->i_ino;
+#endif
+}
+
+extern int apfs_inode_xfield(struct apfs_inode_val *inode_val, int len,
+			     u8 type, char **xval);
+extern void apfs_inode_cache_init(struct apfs_inode_cache *cache);
+extern unsigned long apfs_inode_cache_shrink(struct apfs_inode_cache *cache,
+					     unsigned long nr);
+extern void apfs_name_cache_init(struct apfs_name_cache *cache);
+extern int apfs_inode_name(struct super_block *sb, u64 cnid, u64 *parent,
+			   char *name, int size);
 extern struct inode *apfs_iget(struct super_block *sb, u64 cnid);
 extern int apfs_getattr(const struct path *path, struct kstat *stat,
 			u32 request_mask, unsigned int query_flags);
@@ -0,0 +1,786 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/ioctl.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/compat.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include "apfs.h"
+#include "diff.h"
+#include "dir.h"
+#include "inode.h"
+#include "ioctl.h"
+#include "key.h"
+#include "message.h"
+#include "node.h"
+#include "scan.h"
+#include "snapshot.h"
+#include "super.h"
+
+/**
+ * apfs_cookie_seek - Resume a catalog scan from a cookie
+ * @scan:	the scan
+ * @cookie:	the cookie
+ *
+ * Returns 0 on success, or a negative error code in case of failure.  On
+ * success, the next call to apfs_cookie_next() will return the first record
+ * that wasn't reported yet.
+ */
+static int apfs_cookie_seek(struct apfs_scan *scan,
+			    struct apfs_ioc_cookie *cookie)
+{
+	struct apfs_key key;
+
+	key.id = cookie->id_and_type & APFS_OBJ_ID_MASK;
+	key.type = cookie->id_and_type >> APFS_OBJ_TYPE_SHIFT;
+	key.number = cookie->number;
+	key.name = NULL;
+	return apfs_scan_seek(scan, &key);
+}
+
+/**
+ * apfs_cookie_match - Check if the current record has the key of a cookie
+ * @scan:	the scan
+ * @cookie:	the cookie
+ */
+static inline bool apfs_cookie_match(struct apfs_scan *scan,
+				     struct apfs_ioc_cookie *cookie)
+{
+	u64 id_and_type;
+
+	id_and_type = scan->key.id | (u64)scan->key.type << APFS_OBJ_TYPE_SHIFT;
+	return id_and_type == cookie->id_and_type &&
+	       scan->key.number == cookie->number;
+}
+
+/**
+ * apfs_cookie_past_end - Check if the current record is past a cookie's range
+ * @scan:	the scan
+ * @cookie:	the cookie
+ */
+static bool apfs_cookie_past_end(struct apfs_scan *scan,
+				 struct apfs_ioc_cookie *cookie)
+{
+	struct apfs_key end;
+
+	if (!cookie->end_id_and_type)
+		return false;
+	end.id = cookie->end_id_and_type & APFS_OBJ_ID_MASK;
+	end.type = cookie->end_id_and_type >> APFS_OBJ_TYPE_SHIFT;
+	end.number = cookie->end_number;
+	end.name = NULL;
+	/* The names are ignored, as they are for apfs_cookie_seek() */
+	return apfs_keycmp(scan->sb, &end, &scan->key) <= 0;
+}
+
+/**
+ * apfs_cookie_next - Move a resumed catalog scan to the next new record
+ * @scan:	the scan
+ * @cookie:	cookie used to resume the scan
+ *
+ * Skips the records that were reported before the cookie was handed out.
+ * Returns 0 on success, -ENODATA when the scan is over (and flags the cookie
+ * as done), or another negative error code in case of failure.
+ */
+static int apfs_cookie_next(struct apfs_scan *scan,
+			    struct apfs_ioc_cookie *cookie)
+{
+	u32 skip = cookie->skip;
+	int err;
+
+	while (1) {
+		err = apfs_scan_next(scan);
+		if (!err && apfs_cookie_past_end(scan, cookie))
+			err = -ENODATA;
+		if (err) {
+			if (err == -ENODATA)
+				cookie->flags |= APFS_COOKIE_DONE;
+			return err;
+		}
+		if (!skip || !apfs_cookie_match(scan, cookie))
+			return 0;
+		--skip;
+	}
+}
+
+/**
+ * apfs_cookie_update - Record in the cookie that a record was reported
+ * @scan:	the scan, with the reported record as the current one
+ * @cookie:	the cookie
+ */
+static void apfs_cookie_update(struct apfs_scan *scan,
+			       struct apfs_ioc_cookie *cookie)
+{
+	if (apfs_cookie_match(scan, cookie)) {
+		cookie->skip++;
+		return;
+	}
+	cookie->id_and_type = scan->key.id |
+			      (u64)scan->key.type << APFS_OBJ_TYPE_SHIFT;
+	cookie->number = scan->key.number;
+	cookie->skip = 1;
+}
+
+/**
+ * apfs_copy_rec_to_user - Copy the current record of a scan to a user buffer
+ * @scan:	the scan
+ * @ubuf:	the user buffer
+ * @room:	space left in the buffer
+ *
+ * Returns the length of the copied record, 0 if it doesn't fit in @room, or a
+ * negative error code in case of failure.
+ */
+static int apfs_copy_rec_to_user(struct apfs_scan *scan, char __user *ubuf,
+				 u32 room)
+{
+	struct apfs_node *leaf = apfs_scan_leaf(scan)->node;
+	char *raw = leaf->object.bh->b_data;
+	struct apfs_ioc_rec rec;
+	u32 len;
+
+	len = ALIGN(sizeof(rec) + scan->key_len + scan->len, 8);
+	if (len > room)
+		return 0;
+
+	rec.xid = apfs_scan_leaf(scan)->xid;
+	rec.key_len = scan->key_len;
+	rec.val_len = scan->len;
+	rec.rec_len = len;
+
+	if (copy_to_user(ubuf, &rec, sizeof(rec)))
+		return -EFAULT;
+	ubuf += sizeof(rec);
+	if (copy_to_user(ubuf, raw + scan->key_off, scan->key_len))
+		return -EFAULT;
+	ubuf += scan->key_len;
+	if (copy_to_user(ubuf, raw + scan->off, scan->len))
+		return -EFAULT;
+	return len;
+}
+
+/**
+ * apfs_ioc_changes - Report the catalog records changed after a transaction
+ * @file:	file the ioctl was called on
+ * @arg:	user pointer to a struct apfs_ioc_changes
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_ioc_changes(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_ioc_changes args;
+	struct apfs_scan scan;
+	char __user *ubuf;
+	u32 used = 0;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	args.count = 0;
+	if (args.cookie.flags & APFS_COOKIE_DONE)
+		goto out;
+	ubuf = u64_to_user_ptr(args.buf);
+
+	apfs_scan_cat_init(&scan, sb);
+	scan.min_xid = args.since_xid;
+	scan.readahead = true;
+	err = apfs_cookie_seek(&scan, &args.cookie);
+	if (err)
+		goto fail;
+
+	while (1) {
+		err = apfs_cookie_next(&scan, &args.cookie);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			goto fail;
+
+		err = apfs_copy_rec_to_user(&scan, ubuf + used,
+					    args.buf_len - used);
+		if (err < 0)
+			goto fail;
+		if (!err) {
+			/* The buffer must fit at least one record */
+			if (!args.count) {
+				err = -EOVERFLOW;
+				goto fail;
+			}
+			break;
+		}
+		used += err;
+		args.count++;
+		apfs_cookie_update(&scan, &args.cookie);
+	}
+	apfs_scan_release(&scan);
+
+out:
+	if (copy_to_user(arg, &args, sizeof(args)))
+		return -EFAULT;
+	return 0;
+
+fail:
+	apfs_scan_release(&scan);
+	return err;
+}
+
+/**
+ * apfs_diff_rec_update - Add a difference to the diff record for its cnid
+ * @diff:	the diff structure
+ * @kind:	kind of difference found
+ * @rec:	diff record for the cnid
+ */
+static void apfs_diff_rec_update(struct apfs_diff *diff, int kind,
+				 struct apfs_ioc_diff_rec *rec)
+{
+	struct apfs_key *key;
+
+	key = kind == APFS_DIFF_NEW ? &diff->new.key : &diff->old.key;
+	rec->types |= 1 << key->type;
+	if (key->type != APFS_TYPE_INODE)
+		rec->flags |= APFS_DIFF_MODIFIED;
+	else if (kind == APFS_DIFF_NEW)
+		rec->flags |= APFS_DIFF_CREATED;
+	else if (kind == APFS_DIFF_OLD)
+		rec->flags |= APFS_DIFF_DELETED;
+	else
+		rec->flags |= APFS_DIFF_MODIFIED;
+}
+
+/**
+ * apfs_ioc_diff - Report the catalog objects that differ between snapshots
+ * @file:	file the ioctl was called on
+ * @arg:	user pointer to a struct apfs_ioc_diff
+ *
+ * The records for each cnid are contiguous in the catalog, so the changes
+ * can be reported one cnid at a time.  The cookie always points to the first
+ * cnid not yet reported, and only the cnid of its end key is considered, so
+ * the ranges from APFS_IOC_PARTITION are rounded to whole cnids.  Returns 0
+ * on success, or a negative error code in case of failure.
+ */
+static int apfs_ioc_diff(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_ioc_diff args;
+	struct apfs_ioc_diff_rec rec = {0};
+	struct apfs_ioc_diff_rec __user *ubuf;
+	struct apfs_node *old_root, *new_root;
+	struct apfs_diff diff;
+	struct apfs_key key;
+	u64 end_cnid;
+	u32 max;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	end_cnid = args.cookie.end_id_and_type & APFS_OBJ_ID_MASK;
+	max = args.buf_len / sizeof(rec);
+	if (!max)
+		return -EOVERFLOW;
+	args.count = 0;
+	if (args.cookie.flags & APFS_COOKIE_DONE)
+		goto out;
+	ubuf = u64_to_user_ptr(args.buf);
+
+	old_root = apfs_snap_read_catalog(sb, args.old_xid);
+	if (IS_ERR(old_root))
+		return PTR_ERR(old_root);
+	new_root = apfs_snap_read_catalog(sb, args.new_xid);
+	if (IS_ERR(new_root)) {
+		apfs_node_put(old_root);
+		return PTR_ERR(new_root);
+	}
+	apfs_diff_init(&diff, sb, old_root, args.old_xid,
+		       new_root, args.new_xid);
+	apfs_node_put(old_root);
+	apfs_node_put(new_root);
+
+	key.id = args.cookie.id_and_type & APFS_OBJ_ID_MASK;
+	key.type = 0;
+	key.number = 0;
+	key.name = NULL;
+	err = apfs_diff_seek(&diff, &key);
+	if (err)
+		goto fail;
+
+	while (1) {
+		int kind = apfs_diff_next(&diff);
+		u64 cnid;
+
+		if (kind < 0 && kind != -ENODATA) {
+			err = kind;
+			goto fail;
+		}
+		if (kind > 0) {
+			cnid = kind == APFS_DIFF_NEW ? diff.new.key.id :
+						       diff.old.key.id;
+			if (end_cnid && cnid >= end_cnid) {
+				kind = -ENODATA;
+			} else if (rec.flags && cnid == rec.cnid) {
+				apfs_diff_rec_update(&diff, kind, &rec);
+				continue;
+			}
+		}
+
+		/* Report the previous cnid, now that it's complete */
+		if (rec.flags) {
+			if (args.count == max)
+				break;
+			if (rec.flags & (APFS_DIFF_CREATED | APFS_DIFF_DELETED))
+				rec.flags &= ~APFS_DIFF_MODIFIED;
+			if (copy_to_user(ubuf + args.count, &rec,
+					 sizeof(rec))) {
+				err = -EFAULT;
+				goto fail;
+			}
+			args.count++;
+		}
+		if (kind == -ENODATA) {
+			args.cookie.flags |= APFS_COOKIE_DONE;
+			break;
+		}
+
+		memset(&rec, 0, sizeof(rec));
+		rec.cnid = cnid;
+		args.cookie.id_and_type = cnid;
+		apfs_diff_rec_update(&diff, kind, &rec);
+	}
+	apfs_diff_release(&diff);
+
+out:
+	if (copy_to_user(arg, &args, sizeof(args)))
+		return -EFAULT;
+	return 0;
+
+fail:
+	apfs_diff_release(&diff);
+	return err;
+}
+
+/**
+ * apfs_stat_from_scan - Read the attributes of the inode found by a scan
+ * @scan:	the scan, with an inode record as the current one
+ * @stat:	on return, the inode attributes
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_stat_from_scan(struct apfs_scan *scan,
+			       struct apfs_ioc_stat *stat)
+{
+	struct apfs_sb_info *sbi = APFS_SB(scan->sb);
+	struct apfs_node *leaf = apfs_scan_leaf(scan)->node;
+	struct apfs_inode_val *inode_val;
+	struct apfs_dstream *dstream;
+	char *xval;
+	int xlen;
+
+	if (scan->len < sizeof(*inode_val))
+		return -EFSCORRUPTED;
+	inode_val = (struct apfs_inode_val *)(leaf->object.bh->b_data +
+					      scan->off);
+
+	memset(stat, 0, sizeof(*stat));
+	stat->cnid = scan->key.id;
+	stat->parent_id = le64_to_cpu(inode_val->parent_id);
+	stat->create_time = le64_to_cpu(inode_val->create_time);
+	stat->mod_time = le64_to_cpu(inode_val->mod_time);
+	stat->change_time = le64_to_cpu(inode_val->change_time);
+	stat->access_time = le64_to_cpu(inode_val->access_time);
+	stat->internal_flags = le64_to_cpu(inode_val->internal_flags);
+	stat->nlink = le32_to_cpu(inode_val->nlink);
+	stat->bsd_flags = le32_to_cpu(inode_val->bsd_flags);
+	stat->generation = le32_to_cpu(inode_val->write_generation_counter);
+	stat->mode = le16_to_cpu(inode_val->mode);
+
+	/* Report the same ownership as stat() */
+	if (sbi->s_flags & APFS_UID_OVERRIDE)
+		stat->owner = from_kuid(&init_user_ns, sbi->s_uid);
+	else
+		stat->owner = le32_to_cpu(inode_val->owner);
+	if (sbi->s_flags & APFS_GID_OVERRIDE)
+		stat->group = from_kgid(&init_user_ns, sbi->s_gid);
+	else
+		stat->group = le32_to_cpu(inode_val->group);
+
+	xlen = apfs_inode_xfield(inode_val, scan->len,
+				 APFS_INO_EXT_TYPE_DSTREAM, &xval);
+	if (xlen < 0)
+		return xlen;
+	if (xlen >= sizeof(*dstream)) {
+		dstream = (struct apfs_dstream *)xval;
+		stat->size = le64_to_cpu(dstream->size);
+		stat->alloced_size = le64_to_cpu(dstream->alloced_size);
+	}
+	return 0;
+}
+
+/**
+ * apfs_ioc_bulkstat - Report the attributes of all inodes in cnid order
+ * @file:	file the ioctl was called on
+ * @arg:	user pointer to a struct apfs_ioc_bulkstat
+ *
+ * The inode records are read straight from the leaves of the catalog, without
+ * any directory lookups or inode allocations.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_ioc_bulkstat(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_ioc_bulkstat args;
+	struct apfs_ioc_stat stat;
+	struct apfs_ioc_stat __user *ubuf;
+	struct apfs_scan scan;
+	u32 max;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	max = args.buf_len / sizeof(stat);
+	if (!max)
+		return -EOVERFLOW;
+	args.count = 0;
+	if (args.cookie.flags & APFS_COOKIE_DONE)
+		goto out;
+	ubuf = u64_to_user_ptr(args.buf);
+
+	apfs_scan_cat_init(&scan, sb);
+	scan.readahead = true;
+	err = apfs_cookie_seek(&scan, &args.cookie);
+	if (err)
+		goto fail;
+
+	while (args.count < max) {
+		err = apfs_cookie_next(&scan, &args.cookie);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			goto fail;
+		if (scan.key.type != APFS_TYPE_INODE)
+			continue;
+
+		err = apfs_stat_from_scan(&scan, &stat);
+		if (err) {
+			apfs_alert(sb, "bad inode record for inode 0x%llx",
+				   scan.key.id);
+			goto fail;
+		}
+		if (copy_to_user(ubuf + args.count, &stat, sizeof(stat))) {
+			err = -EFAULT;
+			goto fail;
+		}
+		args.count++;
+		apfs_cookie_update(&scan, &args.cookie);
+	}
+	apfs_scan_release(&scan);
+
+out:
+	if (copy_to_user(arg, &args, sizeof(args)))
+		return -EFAULT;
+	return 0;
+
+fail:
+	apfs_scan_release(&scan);
+	return err;
+}
+
+/**
+ * apfs_copy_dirent_to_user - Copy the current directory record of a scan to a
+ *			      user buffer
+ * @scan:	the scan, with a directory record as the current one
+ * @ubuf:	the user buffer
+ * @room:	space left in the buffer
+ *
+ * Returns the length of the copied entry, 0 if it doesn't fit in @room, or a
+ * negative error code in case of failure.
+ */
+static int apfs_copy_dirent_to_user(struct apfs_scan *scan, char __user *ubuf,
+				    u32 room)
+{
+	struct apfs_node *leaf = apfs_scan_leaf(scan)->node;
+	char *raw = leaf->object.bh->b_data;
+	struct apfs_ioc_dirent dirent;
+	struct apfs_drec drec;
+	u32 len;
+	int err;
+
+	err = apfs_drec_from_raw(raw + scan->key_off, scan->key_len,
+				 raw + scan->off, scan->len, &drec);
+	if (err) {
+		apfs_alert(scan->sb, "bad dentry record in directory 0x%llx",
+			   scan->key.id);
+		return err;
+	}
+
+	len = ALIGN(sizeof(dirent) + drec.name_len + 1, 8);
+	if (len > room)
+		return 0;
+
+	dirent.parent_id = scan->key.id;
+	dirent.ino = drec.ino;
+	dirent.rec_len = len;
+	dirent.name_len = drec.name_len;
+	dirent.type = drec.type;
+	dirent.pad = 0;
+
+	if (copy_to_user(ubuf, &dirent, sizeof(dirent)))
+		return -EFAULT;
+	/* The name on disk is null-terminated already */
+	if (copy_to_user(ubuf + sizeof(dirent), drec.name, drec.name_len + 1))
+		return -EFAULT;
+	return len;
+}
+
+/**
+ * apfs_ioc_dirents - Report all the directory entries of the volume
+ * @file:	file the ioctl was called on
+ * @arg:	user pointer to a struct apfs_ioc_dirents
+ *
+ * The whole namespace is read in a single pass over the catalog leaves, which
+ * is much faster than a recursive readdir.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_ioc_dirents(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_ioc_dirents args;
+	struct apfs_scan scan;
+	char __user *ubuf;
+	u32 used = 0;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	args.count = 0;
+	if (args.cookie.flags & APFS_COOKIE_DONE)
+		goto out;
+	ubuf = u64_to_user_ptr(args.buf);
+
+	apfs_scan_cat_init(&scan, sb);
+	scan.readahead = true;
+	err = apfs_cookie_seek(&scan, &args.cookie);
+	if (err)
+		goto fail;
+
+	while (1) {
+		err = apfs_cookie_next(&scan, &args.cookie);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			goto fail;
+		if (scan.key.type != APFS_TYPE_DIR_REC)
+			continue;
+
+		err = apfs_copy_dirent_to_user(&scan, ubuf + used,
+					       args.buf_len - used);
+		if (err < 0)
+			goto fail;
+		if (!err) {
+			/* The buffer must fit at least one entry */
+			if (!args.count) {
+				err = -EOVERFLOW;
+				goto fail;
+			}
+			break;
+		}
+		used += err;
+		args.count++;
+		apfs_cookie_update(&scan, &args.cookie);
+	}
+	apfs_scan_release(&scan);
+
+out:
+	if (copy_to_user(arg, &args, sizeof(args)))
+		return -EFAULT;
+	return 0;
+
+fail:
+	apfs_scan_release(&scan);
+	return err;
+}
+
+/**
+ * apfs_ioc_partition - Split the catalog into ranges for a parallel scan
+ * @file:	file the ioctl was called on
+ * @arg:	user pointer to a struct apfs_ioc_partition
+ *
+ * The boundaries are taken from the index nodes near the root, so they are
+ * cheap to find and the ranges hold a similar number of leaves.  The cookies
+ * returned can be passed to the other scan ioctls from separate threads or
+ * processes.  Returns 0 on success, or a negative error code in case of
+ * failure.
+ */
+static int apfs_ioc_partition(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_ioc_partition args;
+	struct apfs_ioc_cookie cookie = {0};
+	struct apfs_ioc_cookie __user *ubuf;
+	struct apfs_key *bounds;
+	struct apfs_scan scan;
+	int nbounds, i;
+	int err = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (!args.count)
+		return -EINVAL;
+	if (args.count > APFS_SCAN_MAX_SEPARATORS)
+		args.count = APFS_SCAN_MAX_SEPARATORS;
+	ubuf = u64_to_user_ptr(args.buf);
+
+	bounds = kvmalloc_array(args.count, sizeof(*bounds), GFP_KERNEL);
+	if (!bounds)
+		return -ENOMEM;
+	apfs_scan_cat_init(&scan, sb);
+	nbounds = apfs_scan_partition(&scan, bounds, args.count);
+	apfs_scan_release(&scan);
+	if (nbounds < 0) {
+		err = nbounds;
+		goto out;
+	}
+
+	/* Each range ends where the next one begins; the last one never ends */
+	for (i = 0; i <= nbounds; ++i) {
+		if (i < nbounds) {
+			cookie.end_id_and_type = bounds[i].id |
+				(u64)bounds[i].type << APFS_OBJ_TYPE_SHIFT;
+			cookie.end_number = bounds[i].number;
+		} else {
+			cookie.end_id_and_type = 0;
+			cookie.end_number = 0;
+		}
+		if (copy_to_user(ubuf + i, &cookie, sizeof(cookie))) {
+			err = -EFAULT;
+			goto out;
+		}
+		cookie.id_and_type = cookie.end_id_and_type;
+		cookie.number = cookie.end_number;
+	}
+
+	args.count = nbounds + 1;
+	if (copy_to_user(arg, &args, sizeof(args)))
+		err = -EFAULT;
+out:
+	kvfree(bounds);
+	return err;
+}
+
+/**
+ * apfs_ioc_ino_path - Find the path to an inode, given its number
+ * @file:	file the ioctl was called on
+ * @arg:	user pointer to a struct apfs_ioc_ino_path
+ *
+ * The path is built backwards by following the parent ids of the inode
+ * records, so the cost depends only on its depth.  Returns 0 on success, or a
+ * negative error code in case of failure.
+ */
+static int apfs_ioc_ino_path(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_ioc_ino_path args;
+	char *path, *name;
+	char *start;
+	u64 cnid;
+	int err = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (args.cnid == APFS_INVALID_INO_NUM)
+		return -EINVAL;
+
+	path = __getname();
+	if (!path)
+		return -ENOMEM;
+	name = kmalloc(APFS_NAME_LEN + 1, GFP_KERNEL);
+	if (!name) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	start = path + PATH_MAX - 1;
+	*start = 0;
+	/* Each component takes at least two bytes, so loops can't go on */
+	for (cnid = args.cnid; cnid != APFS_ROOT_DIR_INO_NUM;) {
+		int len;
+
+		/* The private directory and its contents are not reachable */
+		if (cnid == APFS_ROOT_DIR_PARENT) {
+			err = -ENOENT;
+			goto out;
+		}
+		len = apfs_inode_name(sb, cnid, &cnid, name, APFS_NAME_LEN + 1);
+		if (len < 0) {
+			err = len == -ENODATA ? -ENOENT : len;
+			goto out;
+		}
+		if (start - path < len + 1) {
+			err = -ENAMETOOLONG;
+			goto out;
+		}
+		if (*start)
+			*--start = '/';
+		start -= len;
+		memcpy(start, name, len);
+	}
+
+	args.len = path + PATH_MAX - 1 - start;
+	if (args.len >= args.buf_len) {
+		err = -EOVERFLOW;
+		goto out;
+	}
+	if (copy_to_user(u64_to_user_ptr(args.buf), start, args.len + 1) ||
+	    copy_to_user(arg, &args, sizeof(args)))
+		err = -EFAULT;
+out:
+	kfree(name);
+	__putname(path);
+	return err;
+}
+
+long apfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case APFS_IOC_CHANGES:
+		return apfs_ioc_changes(file, argp);
+	case APFS_IOC_DIFF:
+		return apfs_ioc_diff(file, argp);
+	case APFS_IOC_BULKSTAT:
+		return apfs_ioc_bulkstat(file, argp);
+	case APFS_IOC_DIRENTS:
+		return apfs_ioc_dirents(file, argp);
+	case APFS_IOC_PARTITION:
+		return apfs_ioc_partition(file, argp);
+	case APFS_IOC_INO_PATH:
+		return apfs_ioc_ino_path(file, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+long apfs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	/* All the ioctl arguments have the same layout for compat tasks */
+	return apfs_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
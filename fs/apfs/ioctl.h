@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/ioctl.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_IOCTL_H
+#define _APFS_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Position of a catalog scan, to be passed back to the kernel unchanged to
+ * resume the scan with the following record.  A zeroed cookie starts a scan
+ * from the beginning of the catalog and runs until its end; the cookies from
+ * APFS_IOC_PARTITION cover a single range of keys instead.
+ */
+struct apfs_ioc_cookie {
+	__u64 id_and_type;	/* Header of the last key returned */
+	__u64 number;		/* Hash or offset for the last key */
+	__u32 skip;		/* Records already returned for that key */
+	__u32 flags;
+	__u64 end_id_and_type;	/* Header of the first key past the range */
+	__u64 end_number;	/* Hash or offset for that key */
+};
+
+/* Flags for the scan cookie */
+#define APFS_COOKIE_DONE	0x00000001	/* No records left to scan */
+
+/*
+ * Header for each raw catalog record returned by APFS_IOC_CHANGES.  It's
+ * followed by the on-disk key and value; the whole record is padded to
+ * eight bytes.
+ */
+struct apfs_ioc_rec {
+	__u64 xid;		/* Transaction that last wrote the leaf */
+	__u16 key_len;
+	__u16 val_len;
+	__u32 rec_len;		/* Length of the record with the header */
+};
+
+/*
+ * Argument for APFS_IOC_CHANGES.  The scan skips every leaf of the catalog
+ * that wasn't written after @since_xid, so the records returned are those
+ * that were modified after it, along with their unmodified neighbours.
+ */
+struct apfs_ioc_changes {
+	__u64 since_xid;	/* Only report changes after this transaction */
+	__u64 buf;		/* User buffer for the records */
+	__u32 buf_len;		/* Size of the user buffer */
+	__u32 count;		/* Number of records returned */
+	struct apfs_ioc_cookie cookie;
+};
+
+/*
+ * Changes to a single catalog object between two snapshots, as returned by
+ * APFS_IOC_DIFF.  Directory entries belong to the parent's cnid.
+ */
+struct apfs_ioc_diff_rec {
+	__u64 cnid;
+	__u32 flags;
+	__u32 types;		/* Bitmap of the record types that changed */
+};
+
+/* Flags for the diff records */
+#define APFS_DIFF_CREATED	0x00000001	/* Inode only in the new tree */
+#define APFS_DIFF_DELETED	0x00000002	/* Inode only in the old tree */
+#define APFS_DIFF_MODIFIED	0x00000004	/* Other records changed */
+
+/*
+ * Argument for APFS_IOC_DIFF.  Each transaction id must belong to a snapshot
+ * of the volume, or be that of the mount itself.
+ */
+struct apfs_ioc_diff {
+	__u64 old_xid;		/* Transaction for the old snapshot */
+	__u64 new_xid;		/* Transaction for the new snapshot */
+	__u64 buf;		/* User buffer for the diff records */
+	__u32 buf_len;		/* Size of the user buffer */
+	__u32 count;		/* Number of diff records returned */
+	struct apfs_ioc_cookie cookie;
+};
+
+/*
+ * Attributes of an inode, as returned by APFS_IOC_BULKSTAT.  The times are in
+ * nanoseconds since the epoch.
+ */
+struct apfs_ioc_stat {
+	__u64 cnid;
+	__u64 parent_id;
+	__u64 size;		/* Size of the default data stream */
+	__u64 alloced_size;	/* Allocated size of the data stream */
+	__u64 create_time;
+	__u64 mod_time;
+	__u64 change_time;
+	__u64 access_time;
+	__u64 internal_flags;
+	__u32 nlink;		/* Child count for directories */
+	__u32 bsd_flags;
+	__u32 owner;
+	__u32 group;
+	__u32 generation;	/* Write generation counter */
+	__u16 mode;
+	__u16 pad;
+};
+
+/*
+ * Argument for APFS_IOC_BULKSTAT.  The inodes are returned in cnid order.
+ */
+struct apfs_ioc_bulkstat {
+	__u64 buf;		/* User buffer for the inode attributes */
+	__u32 buf_len;		/* Size of the user buffer */
+	__u32 count;		/* Number of inodes returned */
+	struct apfs_ioc_cookie cookie;
+};
+
+/*
+ * Directory entry, as returned by APFS_IOC_DIRENTS.  It's followed by the
+ * null-terminated name, and the whole record is padded to eight bytes.
+ */
+struct apfs_ioc_dirent {
+	__u64 parent_id;
+	__u64 ino;
+	__u32 rec_len;		/* Length of the record with the name */
+	__u16 name_len;		/* Length of the name, without the null */
+	__u8 type;		/* File type, as in readdir() */
+	__u8 pad;
+};
+
+/*
+ * Argument for APFS_IOC_DIRENTS.  The entries are returned in catalog order,
+ * so all entries for a given directory are contiguous.
+ */
+struct apfs_ioc_dirents {
+	__u64 buf;		/* User buffer for the directory entries */
+	__u32 buf_len;		/* Size of the user buffer */
+	__u32 count;		/* Number of entries returned */
+	struct apfs_ioc_cookie cookie;
+};
+
+/*
+ * Argument for APFS_IOC_PARTITION.  The catalog is split into key ranges of
+ * similar size, and a cookie is returned for each of them, so that they can
+ * be scanned in parallel.  There may be fewer ranges than requested, if the
+ * catalog is small.
+ */
+struct apfs_ioc_partition {
+	__u64 buf;		/* User buffer for the array of cookies */
+	__u32 count;		/* Ranges wanted; on return, ranges created */
+	__u32 pad;
+};
+
+/*
+ * Argument for APFS_IOC_INO_PATH.  The path is relative to the root of the
+ * volume, so it's empty for the root itself.  For hard links, only the path
+ * to the first link is returned.
+ */
+struct apfs_ioc_ino_path {
+	__u64 cnid;		/* Inode to look up */
+	__u64 buf;		/* User buffer for the null-terminated path */
+	__u32 buf_len;		/* Size of the user buffer */
+	__u32 len;		/* Length of the path, without the null */
+};
+
+#define APFS_IOCTL_MAGIC	0xA5
+
+#define APFS_IOC_CHANGES	_IOWR(APFS_IOCTL_MAGIC, 1, \
+				      struct apfs_ioc_changes)
+#define APFS_IOC_DIFF		_IOWR(APFS_IOCTL_MAGIC, 2, struct apfs_ioc_diff)
+#define APFS_IOC_BULKSTAT	_IOWR(APFS_IOCTL_MAGIC, 3, \
+				      struct apfs_ioc_bulkstat)
+#define APFS_IOC_DIRENTS	_IOWR(APFS_IOCTL_MAGIC, 4, \
+				      struct apfs_ioc_dirents)
+#define APFS_IOC_PARTITION	_IOWR(APFS_IOCTL_MAGIC, 5, \
+				      struct apfs_ioc_partition)
+#define APFS_IOC_INO_PATH	_IOWR(APFS_IOCTL_MAGIC, 6, \
+				      struct apfs_ioc_ino_path)
+
+#endif	/* _APFS_IOCTL_H */
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/iotrace.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/timekeeping.h>
+#include "apfs.h"
+#include "iotrace.h"
+#include "object.h"
+#include "super.h"
+
+/**
+ * apfs_iotrace_alloc - Set up the metadata read trace for a volume
+ * @sb:		filesystem superblock
+ *
+ * Does nothing unless the volume was mounted with the iotrace option.  Returns
+ * 0 on success, or a negative error code in case of failure.
+ */
+int apfs_iotrace_alloc(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_iotrace *trace;
+
+	if (!(sbi->s_flags & APFS_IOTRACE))
+		return 0;
+	trace = kvzalloc(sizeof(*trace), GFP_KERNEL);
+	if (!trace)
+		return -ENOMEM;
+	spin_lock_init(&trace->lock);
+	sbi->s_iotrace = trace;
+	return 0;
+}
+
+/**
+ * apfs_iotrace_free - Undo apfs_iotrace_alloc()
+ * @sbi:	superblock info for the volume
+ */
+void apfs_iotrace_free(struct apfs_sb_info *sbi)
+{
+	kvfree(sbi->s_iotrace);
+	sbi->s_iotrace = NULL;
+}
+
+/**
+ * __apfs_iotrace_add - Record a metadata read in the trace for a volume
+ * @sb:		filesystem superblock
+ * @block:	block number
+ * @obj:	header of the object in the block
+ * @cached:	was the block in memory already?
+ * @caller:	return address of the function that asked for the block
+ *
+ * The oldest entry is overwritten once the ring is full.
+ */
+void __apfs_iotrace_add(struct super_block *sb, u64 block,
+			struct apfs_obj_phys *obj, bool cached,
+			unsigned long caller)
+{
+	struct apfs_iotrace *trace = APFS_SB(sb)->s_iotrace;
+	struct apfs_iotrace_entry *entry;
+	u64 time = ktime_get_ns();
+
+	spin_lock(&trace->lock);
+	entry = &trace->entries[trace->next++ & (APFS_IOTRACE_ENTRIES - 1)];
+	entry->it_time = time;
+	entry->it_block = block;
+	entry->it_caller = caller;
+	entry->it_type = le32_to_cpu(obj->o_type);
+	entry->it_subtype = le32_to_cpu(obj->o_subtype);
+	entry->it_cached = cached;
+	spin_unlock(&trace->lock);
+}
+
+/*
+ * Copy of a metadata read trace, taken when the debugfs file is opened so
+ * that the reader doesn't hold up the filesystem
+ */
+struct apfs_iotrace_snap {
+	u64 count;
+	struct apfs_iotrace_entry entries[APFS_IOTRACE_ENTRIES];
+};
+
+static void *apfs_iotrace_start(struct seq_file *m, loff_t *pos)
+{
+	struct apfs_iotrace_snap *snap = m->private;
+
+	if (*pos >= snap->count)
+		return NULL;
+	return &snap->entries[*pos];
+}
+
+static void *apfs_iotrace_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return apfs_iotrace_start(m, pos);
+}
+
+static void apfs_iotrace_stop(struct seq_file *m, void *v)
+{
+}
+
+/*
+ * Each line has the time in nanoseconds, the block number, the object type
+ * and subtype, whether the block was cached, and the caller.
+ */
+static int apfs_iotrace_show(struct seq_file *m, void *v)
+{
+	struct apfs_iotrace_entry *entry = v;
+
+	seq_printf(m, "%llu 0x%llx 0x%x 0x%x %s %pS\n", entry->it_time,
+		   entry->it_block, entry->it_type, entry->it_subtype,
+		   entry->it_cached ? "hit" : "miss",
+		   (void *)entry->it_caller);
+	return 0;
+}
+
+static const struct seq_operations apfs_iotrace_seq_ops = {
+	.start	= apfs_iotrace_start,
+	.next	= apfs_iotrace_next,
+	.stop	= apfs_iotrace_stop,
+	.show	= apfs_iotrace_show,
+};
+
+static int apfs_iotrace_open(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = inode->i_private;
+	struct apfs_iotrace *trace = APFS_SB(sb)->s_iotrace;
+	struct apfs_iotrace_snap *snap;
+	u64 first, i;
+	int err;
+
+	snap = kvmalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	/* Copy the entries from the oldest to the newest */
+	spin_lock(&trace->lock);
+	first = trace->next > APFS_IOTRACE_ENTRIES ?
+		trace->next - APFS_IOTRACE_ENTRIES : 0;
+	snap->count = trace->next - first;
+	for (i = 0; i < snap->count; ++i) {
+		snap->entries[i] = trace->entries[(first + i) &
+						  (APFS_IOTRACE_ENTRIES - 1)];
+	}
+	spin_unlock(&trace->lock);
+
+	err = seq_open(file, &apfs_iotrace_seq_ops);
+	if (err) {
+		kvfree(snap);
+		return err;
+	}
+	((struct seq_file *)file->private_data)->private = snap;
+	return 0;
+}
+
+static int apfs_iotrace_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	kvfree(m->private);
+	return seq_release(inode, file);
+}
+
+const struct file_operations apfs_iotrace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= apfs_iotrace_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= apfs_iotrace_release,
+};
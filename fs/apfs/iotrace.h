@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/iotrace.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_IOTRACE_H
+#define _APFS_IOTRACE_H
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include "super.h"
+
+struct apfs_obj_phys;
+
+/* Metadata reads remembered for each volume; must be a power of two */
+#define APFS_IOTRACE_ENTRIES	16384
+
+/*
+ * A metadata block read, as recorded in the trace
+ */
+struct apfs_iotrace_entry {
+	u64 it_time;			/* ktime_get_ns() at the read */
+	u64 it_block;			/* Block number in the container */
+	unsigned long it_caller;	/* Function that asked for the block */
+	u32 it_type;			/* Object type from the header */
+	u32 it_subtype;			/* Object subtype, the tree for nodes */
+	bool it_cached;			/* Was it in memory already? */
+};
+
+/*
+ * Ring buffer with the most recent metadata reads for a volume
+ */
+struct apfs_iotrace {
+	spinlock_t lock;
+	u64 next;			/* Number of reads recorded so far */
+	struct apfs_iotrace_entry entries[APFS_IOTRACE_ENTRIES];
+};
+
+extern int apfs_iotrace_alloc(struct super_block *sb);
+extern void apfs_iotrace_free(struct apfs_sb_info *sbi);
+extern void __apfs_iotrace_add(struct super_block *sb, u64 block,
+			       struct apfs_obj_phys *obj, bool cached,
+			       unsigned long caller);
+
+/**
+ * apfs_iotrace_add - Record a metadata read, if the volume is being traced
+ * @sb:		filesystem superblock
+ * @block:	block number
+ * @obj:	header of the object in the block
+ * @cached:	was the block in memory already?
+ * @caller:	return address of the function that asked for the block
+ */
+static inline void apfs_iotrace_add(struct super_block *sb, u64 block,
+				    struct apfs_obj_phys *obj, bool cached,
+				    unsigned long caller)
+{
+	if (unlikely(APFS_SB(sb)->s_iotrace))
+		__apfs_iotrace_add(sb, block, obj, cached, caller);
+}
+
+extern const struct file_operations apfs_iotrace_fops;
+
+#endif	/* _APFS_IOTRACE_H */
@@ -9,6 +9,7 @@
 #include "apfs.h"
 #include "key.h"
 #include "super.h"
+#include "sysfs.h"
 #include "unicode.h"
 
 /**
@@ -51,6 +52,7 @@ int apfs_filename_cmp(struct super_block *sb,
 	struct apfs_unicursor cursor1, cursor2;
 	bool case_fold = apfs_is_case_insensitive(sb);
 
+	apfs_stat_add(sb, APFS_STAT_NORMALIZATIONS, 2);
 	apfs_init_unicursor(&cursor1, name1);
 	apfs_init_unicursor(&cursor2, name2);
 
@@ -131,6 +133,15 @@ int apfs_read_cat_key(void *raw, int size, struct apfs_key *key)
 		key->number = 0;
 		key->name = ((struct apfs_xattr_key *)raw)->name;
 		break;
+	case APFS_TYPE_SNAP_NAME:
+		if (size < sizeof(struct apfs_snap_name_key) + 1 ||
+		    *((char *)raw + size - 1) != 0) {
+			/* Snapshot name must have NULL-termination */
+			return -EFSCORRUPTED;
+		}
+		key->number = 0;
+		key->name = ((struct apfs_snap_name_key *)raw)->name;
+		break;
 	case APFS_TYPE_FILE_EXTENT:
 		if (size != sizeof(struct apfs_file_extent_key))
 			return -EFSCORRUPTED;
@@ -168,6 +179,27 @@ int apfs_read_omap_key(void *raw, int size, struct apfs_key *key)
 	return 0;
 }
 
+/**
+ * apfs_read_fusion_key - Parse an on-disk fusion middle tree key
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @key:	apfs_key structure to store the result
+ *
+ * Returns 0 on success, or a negative error code otherwise.
+ */
+int apfs_read_fusion_key(void *raw, int size, struct apfs_key *key)
+{
+	if (size < sizeof(struct apfs_fusion_mt_key))
+		return -EFSCORRUPTED;
+
+	key->id = le64_to_cpu(((struct apfs_fusion_mt_key *)raw)->fmk_paddr);
+	key->type = 0;
+	key->number = 0;
+	key->name = NULL;
+
+	return 0;
+}
+
 /**
  * apfs_init_drec_hashed_key - Initialize an in-memory key for a dentry query
  * @sb:		filesystem superblock
@@ -193,6 +225,7 @@ void apfs_init_drec_hashed_key(struct super_block *sb, u64 ino,
 		return;
 	}
 
+	apfs_stat_inc(sb, APFS_STAT_NORMALIZATIONS);
 	apfs_init_unicursor(&cursor, name);
 
 	while (1) {
@@ -20,6 +20,13 @@ struct apfs_omap_key {
 	__le64 ok_xid;
 } __packed;
 
+/*
+ * Structure of a key in the fusion middle tree
+ */
+struct apfs_fusion_mt_key {
+	__le64 fmk_paddr;	/* Block address on the tier 2 device */
+} __packed;
+
 /* Catalog records types */
 enum {
 	APFS_TYPE_ANY			= 0,
@@ -105,6 +112,25 @@ struct apfs_xattr_key {
 	u8 name[0];
 } __packed;
 
+/*
+ * Structure of the key for a snapshot metadata record
+ */
+struct apfs_snap_metadata_key {
+	struct apfs_key_header hdr;
+} __packed;
+
+/* The snapshot name headers always have this placeholder object id */
+#define APFS_SNAP_NAME_OBJ_ID	(~0ULL & APFS_OBJ_ID_MASK)
+
+/*
+ * Structure of the key for a snapshot name record
+ */
+struct apfs_snap_name_key {
+	struct apfs_key_header hdr;
+	__le16 name_len;
+	u8 name[0];
+} __packed;
+
 /*
  * In-memory representation of a key, as relevant for a b-tree query.
  */
@@ -129,6 +155,19 @@ static inline void apfs_init_omap_key(u64 oid, u64 xid, struct apfs_key *key)
 	key->name = NULL;
 }
 
+/**
+ * apfs_init_fusion_key - Initialize an in-memory key for a middle tree query
+ * @bno:	block address on the tier 2 device
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_fusion_key(u64 bno, struct apfs_key *key)
+{
+	key->id = bno;
+	key->type = 0;
+	key->number = 0;
+	key->name = NULL;
+}
+
 /**
  * apfs_init_inode_key - Initialize an in-memory key for an inode query
  * @ino:	inode number
@@ -175,11 +214,41 @@ static inline void apfs_init_xattr_key(u64 ino, const char *name,
 	key->name = name;
 }
 
+/**
+ * apfs_init_snap_metadata_key - Initialize an in-memory key for a snapshot
+ *				 metadata query
+ * @xid:	transaction id for the snapshot
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_snap_metadata_key(u64 xid, struct apfs_key *key)
+{
+	key->id = xid;
+	key->type = APFS_TYPE_SNAP_METADATA;
+	key->number = 0;
+	key->name = NULL;
+}
+
+/**
+ * apfs_init_snap_name_key - Initialize an in-memory key for a snapshot name
+ *			     query
+ * @name:	snapshot name
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_snap_name_key(const char *name,
+					   struct apfs_key *key)
+{
+	key->id = APFS_SNAP_NAME_OBJ_ID;
+	key->type = APFS_TYPE_SNAP_NAME;
+	key->number = 0;
+	key->name = name;
+}
+
 extern int apfs_filename_cmp(struct super_block *sb,
 			     const char *name1, const char *name2);
 extern int apfs_keycmp(struct super_block *sb,
 		       struct apfs_key *k1, struct apfs_key *k2);
 extern int apfs_read_cat_key(void *raw, int size, struct apfs_key *key);
 extern int apfs_read_omap_key(void *raw, int size, struct apfs_key *key);
+extern int apfs_read_fusion_key(void *raw, int size, struct apfs_key *key);
 
 #endif	/* _APFS_KEY_H */
@@ -10,11 +10,13 @@
 #include "inode.h"
 #include "key.h"
 #include "super.h"
+#include "sysfs.h"
+#include "trace.h"
 #include "unicode.h"
 #include "xattr.h"
 
-static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
-				  unsigned int flags)
+static struct dentry *__apfs_lookup(struct inode *dir, struct dentry *dentry,
+				    unsigned int flags)
 {
 	struct inode *inode = NULL;
 	u64 ino = 0;
@@ -23,7 +25,9 @@ static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
 	if (dentry->d_name.len > APFS_NAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
+	trace_apfs_lookup_enter(dir, &dentry->d_name);
 	err = apfs_inode_by_name(dir, &dentry->d_name, &ino);
+	trace_apfs_lookup_exit(dir, &dentry->d_name, ino, err);
 	if (err && err != -ENODATA)
 		return ERR_PTR(err);
 
@@ -36,6 +40,17 @@ static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
 	return d_splice_alias(inode, dentry);
 }
 
+static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
+				  unsigned int flags)
+{
+	u64 start = ktime_get_ns();
+	struct dentry *ret;
+
+	ret = __apfs_lookup(dir, dentry, flags);
+	apfs_lat_add(dir->i_sb, APFS_LAT_LOOKUP, start);
+	return ret;
+}
+
 const struct inode_operations apfs_dir_inode_operations = {
 	.lookup		= apfs_lookup,
 	.getattr	= apfs_getattr,
@@ -53,6 +68,7 @@ static int apfs_dentry_hash(const struct dentry *dir, struct qstr *child)
 	unsigned long hash;
 	bool case_fold = apfs_is_case_insensitive(dir->d_sb);
 
+	apfs_stat_inc(dir->d_sb, APFS_STAT_NORMALIZATIONS);
 	apfs_init_unicursor(&cursor, child->name);
 	hash = init_name_hash(dir);
 
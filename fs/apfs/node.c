@@ -7,13 +7,19 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/timekeeping.h>
 #include "apfs.h"
 #include "btree.h"
+#include "crypto.h"
+#include "fusion.h"
+#include "iotrace.h"
 #include "key.h"
 #include "message.h"
 #include "node.h"
 #include "object.h"
 #include "super.h"
+#include "sysfs.h"
+#include "trace.h"
 
 /**
  * apfs_node_is_valid - Check basic sanity of the node index
@@ -49,7 +55,10 @@ static void apfs_node_release(struct kref *kref)
 	struct apfs_node *node =
 		container_of(kref, struct apfs_node, refcount);
 
-	brelse(node->object.bh);
+	if (node->decrypted)
+		apfs_put_decrypted_block(node->object.bh);
+	else
+		brelse(node->object.bh);
 	kfree(node);
 }
 
@@ -64,34 +73,57 @@ void apfs_node_put(struct apfs_node *node)
 }
 
 /**
- * apfs_read_node - Read a node header from disk
+ * __apfs_read_vnode - Read a node header from disk, given its omap mapping
  * @sb:		filesystem superblock
  * @block:	number of the block where the node is stored
+ * @omap_flags:	flags for the object map record of the node, or 0 for a
+ *		physical node
+ * @caller:	return address of the function that wants the node, for the
+ *		metadata read trace
  *
  * Returns ERR_PTR in case of failure, otherwise return a pointer to the
  * resulting apfs_node structure with the initial reference taken.
  *
  * For now we assume the node has not been read before.
  */
-struct apfs_node *apfs_read_node(struct super_block *sb, u64 block)
+struct apfs_node *__apfs_read_vnode(struct super_block *sb, u64 block,
+				    u32 omap_flags, unsigned long caller)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct buffer_head *bh;
 	struct apfs_btree_node_phys *raw;
 	struct apfs_node *node;
+	bool decrypted = omap_flags & APFS_OMAP_VAL_ENCRYPTED;
+	bool cached;
+	u64 csum_ns = 0;
 
-	bh = sb_bread(sb, block);
-	if (!bh) {
+	if (decrypted && !sbi->s_vek_tfm) {
+		apfs_err(sb, "encrypted node in block 0x%llx", block);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	bh = decrypted ? apfs_read_decrypted_block(sb, block, &cached) :
+			 __apfs_sb_bread(sb, block, &cached);
+	if (IS_ERR_OR_NULL(bh)) {
 		apfs_err(sb, "unable to read node");
-		return ERR_PTR(-EINVAL);
+		return bh ? ERR_CAST(bh) : ERR_PTR(-EINVAL);
+	}
+	if (cached) {
+		apfs_stat_inc(sb, APFS_STAT_NODE_HITS);
+	} else {
+		apfs_stat_inc(sb, APFS_STAT_NODE_READS);
+		apfs_stat_add(sb, APFS_STAT_META_BYTES, sb->s_blocksize);
 	}
 	raw = (struct apfs_btree_node_phys *) bh->b_data;
 
 	node = kmalloc(sizeof(*node), GFP_KERNEL);
 	if (!node) {
-		brelse(bh);
+		if (decrypted)
+			apfs_put_decrypted_block(bh);
+		else
+			brelse(bh);
 		return ERR_PTR(-ENOMEM);
 	}
+	node->decrypted = decrypted;
 
 	node->flags = le16_to_cpu(raw->btn_flags);
 	node->records = le32_to_cpu(raw->btn_nkeys);
@@ -107,11 +139,16 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 block)
 
 	kref_init(&node->refcount);
 
-	if (sbi->s_flags & APFS_CHECK_NODES &&
-	    !apfs_obj_verify_csum(sb, &raw->btn_o)) {
-		apfs_alert(sb, "bad checksum for node in block 0x%llx", block);
-		apfs_node_put(node);
-		return ERR_PTR(-EFSBADCRC);
+	if (sbi->s_flags & APFS_CHECK_NODES) {
+		u64 start = ktime_get_ns();
+
+		if (!apfs_obj_verify_csum(sb, &raw->btn_o)) {
+			apfs_alert(sb, "bad checksum for node in block 0x%llx",
+				   block);
+			apfs_node_put(node);
+			return ERR_PTR(-EFSBADCRC);
+		}
+		csum_ns = ktime_get_ns() - start;
 	}
 	if (!apfs_node_is_valid(sb, node)) {
 		apfs_alert(sb, "bad node in block 0x%llx", block);
@@ -119,9 +156,38 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 block)
 		return ERR_PTR(-EFSCORRUPTED);
 	}
 
+	trace_apfs_read_node(sb, block, cached, csum_ns);
+	apfs_iotrace_add(sb, block, &raw->btn_o, cached, caller);
 	return node;
 }
 
+/**
+ * apfs_read_vnode - Read a node header from disk, given its omap mapping
+ * @sb:		filesystem superblock
+ * @block:	number of the block where the node is stored
+ * @omap_flags:	flags for the object map record of the node, or 0 for a
+ *		physical node
+ *
+ * Same as __apfs_read_vnode(), with the caller as the cause for the trace.
+ */
+struct apfs_node *apfs_read_vnode(struct super_block *sb, u64 block,
+				  u32 omap_flags)
+{
+	return __apfs_read_vnode(sb, block, omap_flags, _RET_IP_);
+}
+
+/**
+ * apfs_read_node - Read a node header from disk
+ * @sb:		filesystem superblock
+ * @block:	number of the block where the node is stored
+ *
+ * Same as apfs_read_vnode(), for nodes that are never encrypted.
+ */
+struct apfs_node *apfs_read_node(struct super_block *sb, u64 block)
+{
+	return __apfs_read_vnode(sb, block, 0 /* omap_flags */, _RET_IP_);
+}
+
 /**
  * apfs_node_locate_key - Locate the key of a node record
  * @node:	node to be searched
@@ -132,7 +198,7 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 block)
  * that this length fits within the block; callers must use the returned value
  * to make sure they never operate outside its bounds.
  */
-static int apfs_node_locate_key(struct apfs_node *node, int index, int *off)
+int apfs_node_locate_key(struct apfs_node *node, int index, int *off)
 {
 	struct super_block *sb = node->object.sb;
 	struct apfs_btree_node_phys *raw;
@@ -176,7 +242,7 @@ static int apfs_node_locate_key(struct apfs_node *node, int index, int *off)
  * that this length fits within the block; callers must use the returned value
  * to make sure they never operate outside its bounds.
  */
-static int apfs_node_locate_data(struct apfs_node *node, int index, int *off)
+int apfs_node_locate_data(struct apfs_node *node, int index, int *off)
 {
 	struct super_block *sb = node->object.sb;
 	struct apfs_btree_node_phys *raw;
@@ -244,11 +310,15 @@ static int apfs_key_from_query(struct apfs_query *query, struct apfs_key *key)
 
 	switch (query->flags & APFS_QUERY_TREE_MASK) {
 	case APFS_QUERY_CAT:
+	case APFS_QUERY_SNAP_META:
 		err = apfs_read_cat_key(raw_key, query->key_len, key);
 		break;
 	case APFS_QUERY_OMAP:
 		err = apfs_read_omap_key(raw_key, query->key_len, key);
 		break;
+	case APFS_QUERY_FUSION:
+		err = apfs_read_fusion_key(raw_key, query->key_len, key);
+		break;
 	default:
 		/* Not implemented yet */
 		err = -EINVAL;
@@ -39,6 +39,13 @@ struct apfs_omap_val {
 	__le64 ov_paddr;
 } __packed;
 
+/* Object map value flags */
+#define APFS_OMAP_VAL_DELETED		0x00000001
+#define APFS_OMAP_VAL_SAVED		0x00000002
+#define APFS_OMAP_VAL_ENCRYPTED		0x00000004
+#define APFS_OMAP_VAL_NOHEADER		0x00000008
+#define APFS_OMAP_VAL_CRYPTO_GENERATION	0x00000010
+
 /* B-tree node flags */
 #define APFS_BTNODE_ROOT		0x0001
 #define APFS_BTNODE_LEAF		0x0002
@@ -123,6 +130,7 @@ struct apfs_node {
 	int data;		/* Offset of the data area in the block */
 
 	struct apfs_object object; /* Object holding the node */
+	bool decrypted;		/* Is the buffer a private decrypted copy? */
 
 	struct kref refcount;
 };
@@ -155,7 +163,13 @@ static inline bool apfs_node_has_fixed_kv_size(struct apfs_node *node)
 	return (node->flags & APFS_BTNODE_FIXED_KV_SIZE) != 0;
 }
 
+extern struct apfs_node *__apfs_read_vnode(struct super_block *sb, u64 block,
+					  u32 omap_flags, unsigned long caller);
+extern struct apfs_node *apfs_read_vnode(struct super_block *sb, u64 block,
+					u32 omap_flags);
 extern struct apfs_node *apfs_read_node(struct super_block *sb, u64 block);
+extern int apfs_node_locate_key(struct apfs_node *node, int index, int *off);
+extern int apfs_node_locate_data(struct apfs_node *node, int index, int *off);
 extern int apfs_node_query(struct super_block *sb, struct apfs_query *query);
 extern int apfs_bno_from_query(struct apfs_query *query, u64 *bno);
 
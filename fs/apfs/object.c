@@ -5,27 +5,36 @@
  * Checksum routines for an APFS object
  */
 
+#include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include "apfs.h"
 #include "object.h"
+#include "sysfs.h"
 
 /*
  * Note that this is not a generic implementation of fletcher64, as it assumes
  * a message length that doesn't overflow sum1 and sum2.  This constraint is ok
- * for apfs, though, since the block size is limited to 2^16.  For a more
- * generic optimized implementation, see Nakassis (1988).
+ * for apfs, though, since the block size is limited to 2^16, and the sums are
+ * reduced after each block.  For a more generic optimized implementation, see
+ * Nakassis (1988).
  */
-static u64 apfs_fletcher64(void *addr, size_t len)
+static void apfs_fletcher64_update(u64 *sum1, u64 *sum2, void *addr,
+				   size_t len)
 {
 	__le32 *buff = addr;
-	u64 sum1 = 0;
-	u64 sum2 = 0;
-	u64 c1, c2;
 	int i;
 
 	for (i = 0; i < len/sizeof(u32); i++) {
-		sum1 += le32_to_cpu(buff[i]);
-		sum2 += sum1;
+		*sum1 += le32_to_cpu(buff[i]);
+		*sum2 += *sum1;
 	}
+	*sum1 = do_div(*sum1, 0xFFFFFFFF);
+	*sum2 = do_div(*sum2, 0xFFFFFFFF);
+}
+
+static u64 apfs_fletcher64_final(u64 sum1, u64 sum2)
+{
+	u64 c1, c2;
 
 	c1 = sum1 + sum2;
 	c1 = 0xFFFFFFFF - do_div(c1, 0xFFFFFFFF);
@@ -35,9 +44,68 @@ static u64 apfs_fletcher64(void *addr, size_t len)
 	return (c2 << 32) | c1;
 }
 
+/**
+ * apfs_csum_result - Account for a checksum verification
+ * @sb:		filesystem superblock
+ * @ok:		did the checksum match?
+ */
+static int apfs_csum_result(struct super_block *sb, int ok)
+{
+	apfs_stat_inc(sb, APFS_STAT_CSUM_CHECKS);
+	if (!ok)
+		apfs_stat_inc(sb, APFS_STAT_CSUM_FAILURES);
+	return ok;
+}
+
 int apfs_obj_verify_csum(struct super_block *sb, struct apfs_obj_phys *obj)
 {
-	return  (le64_to_cpu(obj->o_cksum) ==
-		 apfs_fletcher64((char *) obj + APFS_MAX_CKSUM_SIZE,
-				 sb->s_blocksize - APFS_MAX_CKSUM_SIZE));
+	u64 sum1 = 0, sum2 = 0;
+
+	apfs_fletcher64_update(&sum1, &sum2, (char *) obj + APFS_MAX_CKSUM_SIZE,
+			       sb->s_blocksize - APFS_MAX_CKSUM_SIZE);
+	return apfs_csum_result(sb, le64_to_cpu(obj->o_cksum) ==
+				    apfs_fletcher64_final(sum1, sum2));
+}
+
+/**
+ * apfs_multiblock_verify_csum - Verify the checksum of an object that spans
+ * several consecutive blocks
+ * @sb:		filesystem superblock
+ * @bno:	first block of the object
+ * @count:	number of blocks in the object
+ *
+ * Returns 0 if the checksum matches, -EFSBADCRC if it doesn't, or -EIO if the
+ * object can't be read.
+ */
+int apfs_multiblock_verify_csum(struct super_block *sb, u64 bno, u32 count)
+{
+	struct apfs_obj_phys *obj;
+	struct buffer_head *bh;
+	u64 sum1 = 0, sum2 = 0;
+	__le64 cksum = 0;
+	u32 i;
+
+	for (i = 0; i < count; ++i) {
+		char *data;
+		size_t len = sb->s_blocksize;
+
+		bh = sb_bread(sb, bno + i);
+		if (!bh)
+			return -EIO;
+		data = bh->b_data;
+		if (i == 0) {
+			/* The checksum field itself is left out */
+			obj = (struct apfs_obj_phys *)data;
+			cksum = obj->o_cksum;
+			data += APFS_MAX_CKSUM_SIZE;
+			len -= APFS_MAX_CKSUM_SIZE;
+		}
+		apfs_fletcher64_update(&sum1, &sum2, data, len);
+		brelse(bh);
+	}
+
+	if (!apfs_csum_result(sb, le64_to_cpu(cksum) ==
+				  apfs_fletcher64_final(sum1, sum2)))
+		return -EFSBADCRC;
+	return 0;
 }
@@ -50,6 +50,8 @@
 #define APFS_OBJECT_TYPE_GBITMAP_BLOCK		0x0000001b
 #define APFS_OBJECT_TYPE_INVALID		0x00000000
 #define APFS_OBJECT_TYPE_TEST			0x000000ff
+#define APFS_OBJECT_TYPE_CONTAINER_KEYBAG	0x6b657973 /* 'keys' */
+#define APFS_OBJECT_TYPE_VOLUME_KEYBAG		0x72656373 /* 'recs' */
 
 /* Object type flags */
 #define APFS_OBJ_VIRTUAL			0x00000000
@@ -89,5 +91,7 @@ struct apfs_object {
 
 extern int apfs_obj_verify_csum(struct super_block *sb,
 				struct apfs_obj_phys *obj);
+extern int apfs_multiblock_verify_csum(struct super_block *sb, u64 bno,
+				       u32 count);
 
 #endif	/* _APFS_OBJECT_H */
@@ -0,0 +1,435 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/readpage.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * A copy of the read path of fs/mpage.c, like the one in ext4, so that the
+ * data read by each bio can be decrypted, or stored in fscache, in process
+ * context before the pages are unlocked.
+ */
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "apfs.h"
+#include "cache.h"
+#include "crypto.h"
+#include "extents.h"
+#include "readpage.h"
+#include "super.h"
+
+/*
+ * Work left for a bio of file data once the read is done
+ */
+struct apfs_read_ctx {
+	struct bio *bio;		/* The bio */
+	struct work_struct work;	/* Runs the work in process context */
+	bool decrypt;			/* Is the data encrypted? */
+	u64 unit;			/* Tweak for the first unit */
+};
+
+static struct workqueue_struct *apfs_read_workqueue;
+static struct kmem_cache *apfs_read_ctx_cachep;
+static mempool_t *apfs_read_ctx_pool;
+
+/*
+ * Last block mapping found for a file, which often covers the next pages too
+ */
+struct apfs_read_map {
+	struct buffer_head bh;		/* Result of apfs_get_block() */
+	sector_t lblk;			/* First block covered by @bh */
+	u64 unit;			/* Tweak for @lblk, if encrypted */
+};
+
+/*
+ * State of a read of several pages
+ */
+struct apfs_read_state {
+	struct bio *bio;		/* Bio being built, or NULL */
+	struct block_device *bdev;	/* Device for @bio */
+	sector_t last_block;		/* Last device block added to @bio */
+	u64 next_unit;			/* Tweak for the next block in @bio */
+	struct apfs_read_map map;	/* Last block mapping */
+};
+
+/**
+ * apfs_read_end_pages - Finish the read of all the pages in a bio
+ * @bio:	the bio, which gets released
+ * @to_cache:	store the pages in fscache? Only allowed in process context.
+ */
+static void apfs_read_end_pages(struct bio *bio, bool to_cache)
+{
+	struct bio_vec *bv;
+	int i;
+
+	bio_for_each_segment_all(bv, bio, i) {
+		struct page *page = bv->bv_page;
+
+		if (!bio->bi_status) {
+			SetPageUptodate(page);
+			if (to_cache)
+				apfs_readpage_to_cache(page->mapping->host,
+						       page);
+		} else {
+			ClearPageUptodate(page);
+			SetPageError(page);
+		}
+		unlock_page(page);
+	}
+	bio_put(bio);
+}
+
+static void apfs_read_work(struct work_struct *work)
+{
+	struct apfs_read_ctx *ctx;
+	struct bio *bio;
+	struct super_block *sb;
+
+	ctx = container_of(work, struct apfs_read_ctx, work);
+	bio = ctx->bio;
+	sb = bio_first_page_all(bio)->mapping->host->i_sb;
+
+	if (ctx->decrypt && apfs_decrypt_bio(sb, bio, ctx->unit))
+		bio->bi_status = BLK_STS_IOERR;
+	mempool_free(ctx, apfs_read_ctx_pool);
+	apfs_read_end_pages(bio, true /* to_cache */);
+}
+
+static void apfs_read_end_io(struct bio *bio)
+{
+	struct apfs_read_ctx *ctx = bio->bi_private;
+
+	if (ctx && !bio->bi_status) {
+		/* The cipher and fscache may sleep, so use the workqueue */
+		INIT_WORK(&ctx->work, apfs_read_work);
+		queue_work(apfs_read_workqueue, &ctx->work);
+		return;
+	}
+	if (ctx)
+		mempool_free(ctx, apfs_read_ctx_pool);
+	apfs_read_end_pages(bio, false /* to_cache */);
+}
+
+/**
+ * apfs_read_map_block - Map a run of file blocks, starting at a given block
+ * @inode:	the file
+ * @iblock:	logical number of the first block
+ * @last_block:	logical number of the block after the last one wanted
+ * @map:	on return, the mapping found
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_read_map_block(struct inode *inode, sector_t iblock,
+			       sector_t last_block, struct apfs_read_map *map)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_file_extent ext;
+	u64 blk_off;
+	int err;
+
+	map->bh.b_state = 0;
+	map->bh.b_size = (last_block - iblock) << inode->i_blkbits;
+	map->lblk = iblock;
+	map->unit = 0;
+	err = apfs_get_block(inode, iblock, &map->bh, 0 /* create */);
+	if (err || !buffer_mapped(&map->bh) || !APFS_SB(sb)->s_vek_tfm)
+		return err;
+
+	/* The tweak is counted in units from the start of the extent */
+	err = apfs_extent_read(inode, iblock, &ext);
+	if (err)
+		return err;
+	blk_off = iblock - (ext.logical_addr >> inode->i_blkbits);
+	map->unit = ext.crypto_id + apfs_blocks_to_units(sb, blk_off);
+	return 0;
+}
+
+/**
+ * apfs_read_map_covers - Check if a block mapping covers a given block
+ * @inode:	the file
+ * @map:	the mapping
+ * @iblock:	logical block number
+ */
+static inline bool apfs_read_map_covers(struct inode *inode,
+					struct apfs_read_map *map,
+					sector_t iblock)
+{
+	return iblock >= map->lblk &&
+	       iblock - map->lblk < map->bh.b_size >> inode->i_blkbits;
+}
+
+/**
+ * apfs_read_submit - Submit the bio being built, if any
+ * @st:		state of the read
+ */
+static void apfs_read_submit(struct apfs_read_state *st)
+{
+	if (st->bio)
+		submit_bio(st->bio);
+	st->bio = NULL;
+}
+
+/**
+ * apfs_read_page_blocks - Read the blocks of a page one by one, and wait
+ * @page:	the locked page
+ *
+ * This is the slow path for pages whose blocks are not all contiguous, which
+ * can only happen when the block size is smaller than the page size.  The
+ * page is unlocked when done.
+ */
+static void apfs_read_page_blocks(struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	const unsigned int blkbits = inode->i_blkbits;
+	const unsigned int per_page = PAGE_SIZE >> blkbits;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - blkbits);
+	sector_t last_block;
+	struct apfs_read_map map;
+	unsigned int i;
+	int err = 0;
+
+	last_block = (i_size_read(inode) + sb->s_blocksize - 1) >> blkbits;
+	for (i = 0; i < per_page && !err; ++i, ++iblock) {
+		unsigned int off = i << blkbits;
+		struct bio *bio;
+
+		if (iblock >= last_block) {
+			zero_user(page, off, sb->s_blocksize);
+			continue;
+		}
+		err = apfs_read_map_block(inode, iblock, iblock + 1, &map);
+		if (err)
+			break;
+		if (!buffer_mapped(&map.bh)) {
+			zero_user(page, off, sb->s_blocksize);
+			continue;
+		}
+
+		bio = bio_alloc(GFP_NOFS, 1);
+		bio_set_dev(bio, map.bh.b_bdev);
+		bio->bi_iter.bi_sector = map.bh.b_blocknr << (blkbits - 9);
+		bio_set_op_attrs(bio, REQ_OP_READ, 0);
+		bio_add_page(bio, page, sb->s_blocksize, off);
+		err = submit_bio_wait(bio);
+		if (!err && APFS_SB(sb)->s_vek_tfm)
+			err = apfs_decrypt_bio(sb, bio, map.unit);
+		bio_put(bio);
+	}
+
+	if (err) {
+		ClearPageUptodate(page);
+		SetPageError(page);
+	} else {
+		SetPageUptodate(page);
+		apfs_readpage_to_cache(inode, page);
+	}
+	unlock_page(page);
+}
+
+/**
+ * apfs_read_page - Add a page to the bio of a read, or read it on its own
+ * @st:		state of the read
+ * @page:	the locked page
+ * @nr_pages:	number of pages left in the read, including this one
+ *
+ * Blocks are mapped for all the pages left at once, when possible.  A new bio
+ * is started when the blocks of @page don't follow those already in the bio,
+ * either on disk or in their tweaks, or when they are on another device.
+ */
+static void apfs_read_page(struct apfs_read_state *st, struct page *page,
+			   unsigned int nr_pages)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct apfs_read_map *map = &st->map;
+	struct apfs_read_ctx *ctx;
+	bool decrypt = APFS_SB(sb)->s_vek_tfm;
+	bool to_cache = apfs_cache_enabled(inode);
+	const unsigned int blkbits = inode->i_blkbits;
+	const unsigned int per_page = PAGE_SIZE >> blkbits;
+	sector_t blocks[MAX_BUF_PER_PAGE];
+	struct block_device *bdev = NULL;
+	sector_t iblock, last_block, last_in_file;
+	unsigned int first_hole = per_page;
+	unsigned int i;
+	u64 unit = 0;
+	int length;
+
+	iblock = (sector_t)page->index << (PAGE_SHIFT - blkbits);
+	last_block = iblock + nr_pages * per_page;
+	last_in_file = (i_size_read(inode) + sb->s_blocksize - 1) >> blkbits;
+	if (last_block > last_in_file)
+		last_block = last_in_file;
+
+	for (i = 0; i < per_page; ++i, ++iblock) {
+		sector_t off;
+
+		if (iblock >= last_block) {
+			if (first_hole == per_page)
+				first_hole = i;
+			continue;
+		}
+		if (!apfs_read_map_covers(inode, map, iblock) &&
+		    apfs_read_map_block(inode, iblock, last_block, map))
+			goto fail;
+		if (!buffer_mapped(&map->bh)) {
+			if (first_hole == per_page)
+				first_hole = i;
+			continue;
+		}
+		if (first_hole != per_page)
+			goto confused;
+
+		off = iblock - map->lblk;
+		blocks[i] = map->bh.b_blocknr + off;
+		if (!i) {
+			bdev = map->bh.b_bdev;
+			unit = map->unit + apfs_blocks_to_units(sb, off);
+			continue;
+		}
+		if (blocks[i] != blocks[i - 1] + 1 || map->bh.b_bdev != bdev)
+			goto confused;
+		if (decrypt && map->unit + apfs_blocks_to_units(sb, off) !=
+			       unit + apfs_blocks_to_units(sb, i))
+			goto confused;
+	}
+
+	if (first_hole != per_page) {
+		zero_user_segment(page, first_hole << blkbits, PAGE_SIZE);
+		if (!first_hole) {
+			SetPageUptodate(page);
+			apfs_readpage_to_cache(inode, page);
+			unlock_page(page);
+			return;
+		}
+	}
+
+	if (st->bio && (st->last_block + 1 != blocks[0] || st->bdev != bdev ||
+			(decrypt && st->next_unit != unit)))
+		apfs_read_submit(st);
+
+alloc:
+	if (!st->bio) {
+		ctx = NULL;
+		if (decrypt || to_cache) {
+			ctx = mempool_alloc(apfs_read_ctx_pool, GFP_NOFS);
+			ctx->decrypt = decrypt;
+			ctx->unit = unit;
+		}
+		st->bio = bio_alloc(GFP_KERNEL, min_t(int, nr_pages,
+						      BIO_MAX_PAGES));
+		if (ctx)
+			ctx->bio = st->bio;
+		bio_set_dev(st->bio, bdev);
+		st->bio->bi_iter.bi_sector = blocks[0] << (blkbits - 9);
+		st->bio->bi_end_io = apfs_read_end_io;
+		st->bio->bi_private = ctx;
+		bio_set_op_attrs(st->bio, REQ_OP_READ, 0);
+		st->bdev = bdev;
+	}
+
+	length = first_hole << blkbits;
+	if (bio_add_page(st->bio, page, length, 0) < length) {
+		apfs_read_submit(st);
+		goto alloc;
+	}
+	st->last_block = blocks[first_hole - 1];
+	st->next_unit = unit + apfs_blocks_to_units(sb, first_hole);
+
+	/* A page with a hole is the last one in the bio */
+	if (first_hole != per_page)
+		apfs_read_submit(st);
+	return;
+
+confused:
+	apfs_read_submit(st);
+	apfs_read_page_blocks(page);
+	return;
+
+fail:
+	SetPageError(page);
+	zero_user_segment(page, 0, PAGE_SIZE);
+	unlock_page(page);
+}
+
+/**
+ * apfs_mpage_readpages - Read file pages, with work to do before unlocking
+ * @mapping:	the address space of the file
+ * @pages:	list of pages, as passed to ->readpages(), or NULL
+ * @page:	the locked page to read, if @pages is NULL
+ * @nr_pages:	number of pages to read
+ *
+ * Like mpage_readpages(), the blocks are read with as few bios as possible.
+ * The bios of encrypted files are decrypted from a workqueue once complete,
+ * with all the units of a bio in flight at once.  For files with fscache,
+ * the workqueue also stores the pages in the cache.
+ */
+void apfs_mpage_readpages(struct address_space *mapping,
+			  struct list_head *pages, struct page *page,
+			  unsigned int nr_pages)
+{
+	struct apfs_read_state st = {0};
+
+	for (; nr_pages; nr_pages--) {
+		if (pages) {
+			page = list_entry(pages->prev, struct page, lru);
+			list_del(&page->lru);
+			if (add_to_page_cache_lru(page, mapping, page->index,
+						  readahead_gfp_mask(mapping)))
+				goto next_page;
+		}
+		apfs_read_page(&st, page, nr_pages);
+next_page:
+		if (pages)
+			put_page(page);
+	}
+	apfs_read_submit(&st);
+}
+
+/**
+ * apfs_readpage_init - Set up the resources shared by all file reads
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_readpage_init(void)
+{
+	apfs_read_workqueue = alloc_workqueue("apfs_read_queue",
+					      WQ_UNBOUND | WQ_HIGHPRI,
+					      num_online_cpus());
+	if (!apfs_read_workqueue)
+		goto fail;
+	apfs_read_ctx_cachep = KMEM_CACHE(apfs_read_ctx, SLAB_RECLAIM_ACCOUNT);
+	if (!apfs_read_ctx_cachep)
+		goto fail;
+	apfs_read_ctx_pool = mempool_create_slab_pool(APFS_READ_CTX_POOL_SIZE,
+						      apfs_read_ctx_cachep);
+	if (!apfs_read_ctx_pool)
+		goto fail;
+	return 0;
+
+fail:
+	apfs_readpage_exit();
+	return -ENOMEM;
+}
+
+/**
+ * apfs_readpage_exit - Clean up apfs_readpage_init()
+ */
+void apfs_readpage_exit(void)
+{
+	mempool_destroy(apfs_read_ctx_pool);
+	apfs_read_ctx_pool = NULL;
+	kmem_cache_destroy(apfs_read_ctx_cachep);
+	apfs_read_ctx_cachep = NULL;
+	if (apfs_read_workqueue)
+		destroy_workqueue(apfs_read_workqueue);
+	apfs_read_workqueue = NULL;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/readpage.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_READPAGE_H
+#define _APFS_READPAGE_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+/* Number of read contexts kept in reserve for low memory */
+#define APFS_READ_CTX_POOL_SIZE	128
+
+extern int apfs_readpage_init(void);
+extern void apfs_readpage_exit(void);
+extern void apfs_mpage_readpages(struct address_space *mapping,
+				 struct list_head *pages, struct page *page,
+				 unsigned int nr_pages);
+
+#endif	/* _APFS_READPAGE_H */
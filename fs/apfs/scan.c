@@ -0,0 +1,576 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/scan.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include "apfs.h"
+#include "btree.h"
+#include "fusion.h"
+#include "key.h"
+#include "message.h"
+#include "node.h"
+#include "scan.h"
+#include "super.h"
+
+/**
+ * apfs_scan_init - Prepare a scan of a b-tree
+ * @scan:	the scan structure
+ * @sb:		filesystem superblock
+ * @root:	root node of the b-tree
+ * @omap:	root node of the object map for the b-tree, NULL if physical
+ * @xid:	transaction id for the object map lookups
+ * @flags:	type of the b-tree, as in the flags for a query
+ *
+ * The scan takes its own reference to @root and @omap; it will only begin
+ * after a call to apfs_scan_seek().  Callers may also set @scan->min_xid to
+ * skip all records in nodes that were not changed after that transaction, and
+ * @scan->readahead if they expect to go through most of the leaves.
+ *
+ * Whole subtrees can only be skipped for physical trees, where a node gets
+ * rewritten each time one of its children moves.  The index nodes of a
+ * virtual tree hold the virtual ids of their children, so they don't change
+ * when a leaf does; only the leaves can be skipped, based on the transaction
+ * id of their omap records.
+ */
+void apfs_scan_init(struct apfs_scan *scan, struct super_block *sb,
+		    struct apfs_node *root, struct apfs_node *omap,
+		    u64 xid, unsigned int flags)
+{
+	memset(scan, 0, sizeof(*scan));
+	scan->sb = sb;
+	apfs_node_get(root);
+	scan->root = root;
+	if (omap)
+		apfs_node_get(omap);
+	scan->omap = omap;
+	scan->xid = xid;
+	scan->flags = flags;
+}
+
+/**
+ * apfs_scan_cat_init - Prepare a scan of the catalog of the mounted volume
+ * @scan:	the scan structure
+ * @sb:		filesystem superblock
+ */
+void apfs_scan_cat_init(struct apfs_scan *scan, struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	apfs_scan_init(scan, sb, sbi->s_cat_root, sbi->s_omap_root,
+		       sbi->s_xid, APFS_QUERY_CAT);
+}
+
+/**
+ * apfs_scan_pop - Drop the deepest node in the path of a scan
+ * @scan:	the scan
+ */
+static inline void apfs_scan_pop(struct apfs_scan *scan)
+{
+	apfs_node_put(apfs_scan_leaf(scan)->node);
+	scan->depth--;
+}
+
+/**
+ * apfs_scan_release - Release all nodes held by a scan
+ * @scan:	the scan
+ */
+void apfs_scan_release(struct apfs_scan *scan)
+{
+	while (scan->depth)
+		apfs_scan_pop(scan);
+	apfs_node_put(scan->root);
+	if (scan->omap)
+		apfs_node_put(scan->omap);
+}
+
+/**
+ * apfs_node_xid - Read the transaction id from the header of a node
+ * @node:	the node
+ */
+static inline u64 apfs_node_xid(struct apfs_node *node)
+{
+	struct apfs_btree_node_phys *raw;
+
+	raw = (struct apfs_btree_node_phys *)node->object.bh->b_data;
+	return le64_to_cpu(raw->btn_o.o_xid);
+}
+
+/**
+ * apfs_node_level - Read the level of a node in its b-tree
+ * @node:	the node
+ *
+ * Leaves are at level zero.
+ */
+static inline int apfs_node_level(struct apfs_node *node)
+{
+	struct apfs_btree_node_phys *raw;
+
+	raw = (struct apfs_btree_node_phys *)node->object.bh->b_data;
+	return le16_to_cpu(raw->btn_level);
+}
+
+/**
+ * apfs_scan_read_key - Read a key from a node in the path of a scan
+ * @scan:	the scan
+ * @node:	the node
+ * @index:	index of the record in @node
+ * @key:	on return, the parsed key
+ * @off:	on return, the offset of the key in the block
+ *
+ * Returns the length of the key on success, or a negative error code.
+ */
+static int apfs_scan_read_key(struct apfs_scan *scan, struct apfs_node *node,
+			      int index, struct apfs_key *key, int *off)
+{
+	char *raw = node->object.bh->b_data;
+	int len;
+	int err;
+
+	len = apfs_node_locate_key(node, index, off);
+	if (scan->flags & APFS_QUERY_OMAP)
+		err = apfs_read_omap_key(raw + *off, len, key);
+	else
+		err = apfs_read_cat_key(raw + *off, len, key);
+	if (err) {
+		apfs_alert(scan->sb, "bad node key in block 0x%llx",
+			   node->object.block_nr);
+		return err;
+	}
+	return len;
+}
+
+/**
+ * apfs_scan_lower_bound - Find the first record not below a given key
+ * @scan:	the scan
+ * @node:	node to search
+ * @key:	key to look for; the name is ignored
+ *
+ * Returns the index of the first record of @node whose key comes at or after
+ * @key (or the record count if there is none), or a negative error code.
+ */
+static int apfs_scan_lower_bound(struct apfs_scan *scan,
+				 struct apfs_node *node, struct apfs_key *key)
+{
+	int left = 0, right = node->records;
+
+	while (left < right) {
+		struct apfs_key curr;
+		int mid = (left + right) / 2;
+		int off, err;
+
+		err = apfs_scan_read_key(scan, node, mid, &curr, &off);
+		if (err < 0)
+			return err;
+		/* A key without name compares equal to any name */
+		if (apfs_keycmp(scan->sb, key, &curr) > 0)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	return left;
+}
+
+/**
+ * apfs_scan_child_is_leaf - Check if the children of the deepest node of a
+ * scan are leaves
+ * @scan:	the scan
+ */
+bool apfs_scan_child_is_leaf(struct apfs_scan *scan)
+{
+	return apfs_node_level(apfs_scan_leaf(scan)->node) == 1;
+}
+
+/**
+ * apfs_scan_can_skip - Check if the child for the current index record of a
+ * scan can be skipped
+ * @scan:	the scan
+ * @xid:	transaction id for the omap record of the child
+ *
+ * Only for virtual trees; the children of physical trees must be read first.
+ */
+static inline bool apfs_scan_can_skip(struct apfs_scan *scan, u64 xid)
+{
+	return apfs_scan_child_is_leaf(scan) && xid <= scan->min_xid;
+}
+
+/**
+ * apfs_scan_child - Find the child for the current index record of a scan
+ * @scan:	the scan
+ * @bno:	on return, the block number of the child
+ * @xid:	on return, the transaction id for the child's omap record, or 0
+ *		if the tree is physical
+ * @flags:	on return, the flags for the child's omap record, or 0 if the
+ *		tree is physical
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_scan_child(struct apfs_scan *scan, u64 *bno, u64 *xid, u32 *flags)
+{
+	struct super_block *sb = scan->sb;
+	struct apfs_scan_level *level = apfs_scan_leaf(scan);
+	struct apfs_node *node = level->node;
+	char *raw = node->object.bh->b_data;
+	u64 child_id;
+	int off, len;
+
+	len = apfs_node_locate_data(node, level->index, &off);
+	if (len != 8) { /* The data on a nonleaf node is the child id */
+		apfs_alert(sb, "bad index block: 0x%llx",
+			   node->object.block_nr);
+		return -EFSCORRUPTED;
+	}
+	child_id = le64_to_cpup((__le64 *)(raw + off));
+
+	if (!scan->omap) {
+		*bno = child_id;
+		*xid = 0;
+		*flags = 0;
+		return 0;
+	}
+	return apfs_omap_lookup(sb, scan->omap, child_id, scan->xid, bno, xid,
+				flags);
+}
+
+/**
+ * apfs_scan_readahead - Start reading all children of the deepest node
+ * @scan:	the scan
+ *
+ * This is meant for the parents of the leaves: a scan that reads them one by
+ * one never has more than a single request in flight, so it can't keep fast
+ * devices busy.  The children that will be skipped by the scan are not read.
+ */
+static void apfs_scan_readahead(struct apfs_scan *scan)
+{
+	struct apfs_scan_level *level = apfs_scan_leaf(scan);
+	struct blk_plug plug;
+	int index = level->index;
+
+	blk_start_plug(&plug);
+	for (level->index = 0; level->index < level->node->records;
+	     ++level->index) {
+		u64 bno, xid;
+		u32 flags;
+
+		if (apfs_scan_child(scan, &bno, &xid, &flags))
+			break;
+		if (scan->omap && apfs_scan_can_skip(scan, xid))
+			continue;
+		apfs_sb_breadahead(scan->sb, bno);
+	}
+	blk_finish_plug(&plug);
+	level->index = index;
+}
+
+/**
+ * apfs_scan_push_child - Add the child for the current index record to a scan
+ * @scan:	the scan
+ *
+ * The new level is left right before its first record.  Returns 0 on success,
+ * even if the child was skipped because it didn't change after
+ * @scan->min_xid, or a negative error code in case of failure.
+ */
+int apfs_scan_push_child(struct apfs_scan *scan)
+{
+	struct super_block *sb = scan->sb;
+	struct apfs_scan_level *level;
+	struct apfs_node *child;
+	u64 child_blk, child_xid;
+	u32 child_flags;
+	int err;
+
+	if (scan->depth >= APFS_SCAN_MAX_DEPTH) {
+		apfs_alert(sb, "b-tree is corrupted");
+		return -EFSCORRUPTED;
+	}
+
+	err = apfs_scan_child(scan, &child_blk, &child_xid, &child_flags);
+	if (err)
+		return err;
+	/* Don't even read the leaf if it hasn't changed */
+	if (scan->omap && apfs_scan_can_skip(scan, child_xid))
+		return 0;
+
+	child = apfs_read_vnode(sb, child_blk, child_flags);
+	if (IS_ERR(child))
+		return PTR_ERR(child);
+	if (!scan->omap) {
+		child_xid = apfs_node_xid(child);
+		if (child_xid <= scan->min_xid) {
+			apfs_node_put(child);
+			return 0;
+		}
+	}
+
+	level = &scan->path[scan->depth++];
+	level->node = child;
+	level->xid = child_xid;
+	level->index = -1;
+
+	if (scan->readahead && apfs_node_level(child) == 1)
+		apfs_scan_readahead(scan);
+	return 0;
+}
+
+/**
+ * apfs_scan_seek - Move a scan right before the first record for a key
+ * @scan:	the scan
+ * @key:	key to look for, or NULL for the beginning of the tree
+ *
+ * The name in @key is ignored, so the next call to apfs_scan_next() will
+ * return the first record that matches all other fields of @key, or the
+ * first that comes after them.  Returns 0 on success or a negative error
+ * code in case of failure.
+ */
+int apfs_scan_seek(struct apfs_scan *scan, struct apfs_key *key)
+{
+	struct apfs_scan_level *level;
+	u64 root_xid;
+	int err;
+
+	while (scan->depth)
+		apfs_scan_pop(scan);
+
+	root_xid = apfs_node_xid(scan->root);
+	/* Nothing changed at all */
+	if ((!scan->omap || apfs_node_is_leaf(scan->root)) &&
+	    root_xid <= scan->min_xid)
+		return 0;
+	apfs_node_get(scan->root);
+	level = &scan->path[scan->depth++];
+	level->node = scan->root;
+	level->xid = root_xid;
+	level->index = -1;
+	if (scan->readahead && apfs_node_level(scan->root) == 1)
+		apfs_scan_readahead(scan);
+
+	if (!key)
+		return 0;
+
+	while (1) {
+		struct apfs_node *node;
+		int depth = scan->depth;
+		int index;
+
+		level = apfs_scan_leaf(scan);
+		node = level->node;
+		index = apfs_scan_lower_bound(scan, node, key);
+		if (index < 0)
+			return index;
+
+		if (apfs_node_is_leaf(node)) {
+			level->index = index - 1;
+			return 0;
+		}
+
+		/*
+		 * Records that match the key, other than in the name, may
+		 * begin in the child before the first matching separator.
+		 */
+		level->index = index ? index - 1 : 0;
+		err = apfs_scan_push_child(scan);
+		if (err)
+			return err;
+		if (scan->depth == depth) /* The child was skipped */
+			return 0;
+	}
+}
+
+/**
+ * apfs_scan_advance - Move a scan to the next entry of its deepest node
+ * @scan:	the scan
+ *
+ * The next entry may be a leaf record or the child pointer of an index node;
+ * callers that want to skip whole subtrees can check for the second case with
+ * apfs_scan_at_leaf().  Returns 0 on success, and sets the key, key_off and
+ * key_len fields of @scan to the values for the new entry.  Returns -ENODATA
+ * once the entries have run out, or another negative error code in case of
+ * failure.
+ */
+int apfs_scan_advance(struct apfs_scan *scan)
+{
+	while (scan->depth) {
+		struct apfs_scan_level *level = apfs_scan_leaf(scan);
+		struct apfs_node *node = level->node;
+		int err;
+
+		if (++level->index >= node->records) {
+			apfs_scan_pop(scan);
+			continue;
+		}
+
+		err = apfs_scan_read_key(scan, node, level->index, &scan->key,
+					 &scan->key_off);
+		if (err < 0)
+			return err;
+		scan->key_len = err;
+		return 0;
+	}
+	return -ENODATA;
+}
+
+/**
+ * apfs_scan_read_data - Locate the data for the current leaf record of a scan
+ * @scan:	the scan
+ *
+ * Sets the off and len fields of @scan.  Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+int apfs_scan_read_data(struct apfs_scan *scan)
+{
+	struct apfs_scan_level *level = apfs_scan_leaf(scan);
+
+	scan->len = apfs_node_locate_data(level->node, level->index,
+					  &scan->off);
+	if (scan->len == 0)
+		return -EFSCORRUPTED;
+	return 0;
+}
+
+/**
+ * apfs_scan_next - Move a scan to the next record of the b-tree
+ * @scan:	the scan
+ *
+ * Returns 0 on success, and sets the key, key_off, key_len, off and len fields
+ * of @scan to the values for the new record; the leaf node that holds it can
+ * be found with apfs_scan_leaf().  Returns -ENODATA once the records have run
+ * out, or another negative error code in case of failure.
+ */
+int apfs_scan_next(struct apfs_scan *scan)
+{
+	int err;
+
+	while (1) {
+		err = apfs_scan_advance(scan);
+		if (err)
+			return err;
+		if (apfs_scan_at_leaf(scan))
+			return apfs_scan_read_data(scan);
+		err = apfs_scan_push_child(scan);
+		if (err)
+			return err;
+	}
+}
+
+/**
+ * apfs_scan_separators - Collect the index keys from the top of a b-tree
+ * @scan:	the scan
+ * @keys:	array to store the keys, with room for APFS_SCAN_MAX_SEPARATORS
+ * @wanted:	number of keys the caller would like to have
+ *
+ * The keys of the root are collected, and also those of its children if the
+ * root alone has too few of them and isn't the parent of the leaves.  The
+ * first key of the tree is left out, since it can't separate anything.
+ * Returns the number of keys collected, or a negative error code in case of
+ * failure.
+ */
+static int apfs_scan_separators(struct apfs_scan *scan, struct apfs_key *keys,
+				int wanted)
+{
+	struct apfs_scan_level *level;
+	struct apfs_node *root = scan->root;
+	bool deeper;
+	int count = 0;
+	int i, off, err;
+
+	if (apfs_node_is_leaf(root))
+		return 0;
+	deeper = root->records < wanted && apfs_node_level(root) > 1;
+
+	err = apfs_scan_seek(scan, NULL);
+	if (err)
+		return err;
+	if (!scan->depth) /* The whole tree was skipped */
+		return 0;
+	level = apfs_scan_leaf(scan);
+	if (deeper)
+		apfs_scan_readahead(scan);
+
+	for (level->index = 0; level->index < root->records; ++level->index) {
+		struct apfs_node *child;
+
+		if (!deeper) {
+			if (count == APFS_SCAN_MAX_SEPARATORS)
+				break;
+			err = apfs_scan_read_key(scan, root, level->index,
+						 &keys[count++], &off);
+			if (err < 0)
+				return err;
+			continue;
+		}
+
+		err = apfs_scan_push_child(scan);
+		if (err)
+			return err;
+		if (scan->depth == 1) /* The child was skipped */
+			continue;
+		child = apfs_scan_leaf(scan)->node;
+		for (i = 0; i < child->records; ++i) {
+			if (count == APFS_SCAN_MAX_SEPARATORS)
+				break;
+			err = apfs_scan_read_key(scan, child, i,
+						 &keys[count++], &off);
+			if (err < 0)
+				return err;
+		}
+		apfs_scan_pop(scan);
+	}
+
+	/* The names point into the nodes, and only whole names separate */
+	for (i = 0; i < count; ++i)
+		keys[i].name = NULL;
+	return count ? count - 1 : 0;
+}
+
+/**
+ * apfs_scan_partition - Split the key space of a b-tree into ranges
+ * @scan:	the scan, which must be repositioned before any further use
+ * @bounds:	array to store the boundaries between the ranges
+ * @count:	number of ranges wanted
+ *
+ * Picks evenly spaced separator keys from the upper levels of the tree, so
+ * that each range covers a similar number of leaves, and can be scanned in
+ * parallel with the others.  The names in the boundaries are always NULL.
+ *
+ * Returns the number of boundaries stored in @bounds, which is never more than
+ * @count - 1, or a negative error code in case of failure.
+ */
+int apfs_scan_partition(struct apfs_scan *scan, struct apfs_key *bounds,
+			int count)
+{
+	struct apfs_key *keys;
+	int nkeys, nbounds = 0;
+	int i;
+
+	if (count < 2)
+		return 0;
+
+	keys = kvmalloc_array(APFS_SCAN_MAX_SEPARATORS + 1, sizeof(*keys),
+			      GFP_KERNEL);
+	if (!keys)
+		return -ENOMEM;
+	nkeys = apfs_scan_separators(scan, keys, count);
+	if (nkeys < 0) {
+		kvfree(keys);
+		return nkeys;
+	}
+
+	for (i = 1; i < count && i <= nkeys; ++i) {
+		/* Skip the first key, it has no records before it */
+		struct apfs_key *key = &keys[1 + (u64)(i - 1) * nkeys / count];
+
+		/* Keys that only differ in the name can't be told apart */
+		if (nbounds &&
+		    apfs_keycmp(scan->sb, &bounds[nbounds - 1], key) == 0)
+			continue;
+		bounds[nbounds++] = *key;
+	}
+
+	kvfree(keys);
+	return nbounds;
+}
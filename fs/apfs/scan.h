@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/scan.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_SCAN_H
+#define _APFS_SCAN_H
+
+#include <linux/types.h>
+#include "key.h"
+#include "node.h"
+
+struct super_block;
+
+/* Maximum depth of a b-tree, same limit as apfs_btree_query() */
+#define APFS_SCAN_MAX_DEPTH	12
+
+/* Maximum number of index keys considered to partition a b-tree */
+#define APFS_SCAN_MAX_SEPARATORS	4096
+
+/*
+ * A node in the path of a b-tree scan
+ */
+struct apfs_scan_level {
+	struct apfs_node *node;		/* Node at this level */
+	u64 xid;			/* Last transaction to write it */
+	int index;			/* Current record in the node */
+};
+
+/*
+ * Structure used to walk all the records of a b-tree in order.  Unlike a
+ * query, which always starts from the root, a scan keeps its whole path so
+ * that moving to the next leaf is cheap.
+ */
+struct apfs_scan {
+	struct super_block *sb;
+	struct apfs_node *root;		/* Root of the b-tree */
+	struct apfs_node *omap;		/* Object map for the tree, or NULL */
+	u64 xid;			/* Transaction id for omap lookups */
+	u64 min_xid;			/* Skip nodes not newer than this */
+	unsigned int flags;		/* Tree type, as in the query flags */
+	bool readahead;			/* Read sibling leaves in one batch */
+
+	int depth;			/* Number of levels in the path */
+	struct apfs_scan_level path[APFS_SCAN_MAX_DEPTH];
+
+	/* Set by apfs_scan_next() on success */
+	struct apfs_key key;		/* Key of the current record */
+	int key_off;			/* Offset of the key in the leaf */
+	int key_len;			/* Length of the key */
+	int off;			/* Offset of the data in the leaf */
+	int len;			/* Length of the data */
+};
+
+/**
+ * apfs_scan_leaf - Get the leaf level for the current record of a scan
+ * @scan:	the scan
+ */
+static inline struct apfs_scan_level *apfs_scan_leaf(struct apfs_scan *scan)
+{
+	return &scan->path[scan->depth - 1];
+}
+
+/**
+ * apfs_scan_at_leaf - Check if the current entry of a scan is a leaf record
+ * @scan:	the scan
+ */
+static inline bool apfs_scan_at_leaf(struct apfs_scan *scan)
+{
+	return apfs_node_is_leaf(apfs_scan_leaf(scan)->node);
+}
+
+extern void apfs_scan_init(struct apfs_scan *scan, struct super_block *sb,
+			   struct apfs_node *root, struct apfs_node *omap,
+			   u64 xid, unsigned int flags);
+extern void apfs_scan_cat_init(struct apfs_scan *scan, struct super_block *sb);
+extern void apfs_scan_release(struct apfs_scan *scan);
+extern int apfs_scan_seek(struct apfs_scan *scan, struct apfs_key *key);
+extern int apfs_scan_child(struct apfs_scan *scan, u64 *bno, u64 *xid,
+			   u32 *flags);
+extern bool apfs_scan_child_is_leaf(struct apfs_scan *scan);
+extern int apfs_scan_push_child(struct apfs_scan *scan);
+extern int apfs_scan_advance(struct apfs_scan *scan);
+extern int apfs_scan_read_data(struct apfs_scan *scan);
+extern int apfs_scan_next(struct apfs_scan *scan);
+extern int apfs_scan_partition(struct apfs_scan *scan,
+			       struct apfs_key *bounds, int count);
+
+#endif	/* _APFS_SCAN_H */
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/slotcache.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include "slotcache.h"
+
+/**
+ * apfs_slot_cache_init - Initialize an empty direct-mapped cache
+ * @cache:	the cache
+ * @entries:	array of slots for the cache
+ * @slots:	number of slots in @entries, must be a power of two
+ * @size:	size of each slot
+ */
+void apfs_slot_cache_init(struct apfs_slot_cache *cache, void *entries,
+			  unsigned int slots, size_t size)
+{
+	memset(entries, 0, slots * size);
+	spin_lock_init(&cache->lock);
+	cache->bits = ilog2(slots);
+	cache->size = size;
+	cache->entries = entries;
+}
+
+/**
+ * apfs_slot_cache_entry - Find the slot for a hash
+ * @cache:	the cache
+ * @hash:	hash of the key
+ */
+static inline void *apfs_slot_cache_entry(struct apfs_slot_cache *cache,
+					  u64 hash)
+{
+	return cache->entries + hash_64(hash, cache->bits) * cache->size;
+}
+
+/**
+ * apfs_slot_cache_find - Look for an entry in a direct-mapped cache
+ * @cache:	the cache
+ * @hash:	hash of the key
+ * @match:	callback to check the entry in the slot for @hash
+ * @key:	key to pass to @match
+ * @out:	output argument to pass to @match
+ *
+ * Returns true on a cache hit, false otherwise.
+ */
+bool apfs_slot_cache_find(struct apfs_slot_cache *cache, u64 hash,
+			  apfs_slot_match_t match, const void *key, void *out)
+{
+	void *entry = apfs_slot_cache_entry(cache, hash);
+	bool hit;
+
+	spin_lock(&cache->lock);
+	hit = match(entry, key, out);
+	spin_unlock(&cache->lock);
+	return hit;
+}
+
+/**
+ * apfs_slot_cache_replace - Add an entry to a direct-mapped cache
+ * @cache:	the cache
+ * @hash:	hash of the key
+ * @entry:	the new entry
+ * @old:	if not NULL, buffer to receive the entry replaced
+ */
+void apfs_slot_cache_replace(struct apfs_slot_cache *cache, u64 hash,
+			     const void *entry, void *old)
+{
+	void *slot = apfs_slot_cache_entry(cache, hash);
+
+	spin_lock(&cache->lock);
+	if (old)
+		memcpy(old, slot, cache->size);
+	memcpy(slot, entry, cache->size);
+	spin_unlock(&cache->lock);
+}
+
+/**
+ * apfs_slot_cache_clear - Empty all the slots of a direct-mapped cache
+ * @cache:	the cache
+ * @old:	buffer to receive each entry removed
+ * @release:	callback to release each entry, called without the lock
+ */
+void apfs_slot_cache_clear(struct apfs_slot_cache *cache, void *old,
+			   void (*release)(void *old))
+{
+	unsigned int i;
+
+	for (i = 0; i < 1U << cache->bits; ++i) {
+		void *slot = cache->entries + i * cache->size;
+
+		spin_lock(&cache->lock);
+		memcpy(old, slot, cache->size);
+		memset(slot, 0, cache->size);
+		spin_unlock(&cache->lock);
+		release(old);
+	}
+}
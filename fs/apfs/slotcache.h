@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/slotcache.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_SLOTCACHE_H
+#define _APFS_SLOTCACHE_H
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/*
+ * Small direct-mapped cache with fixed-size entries.  Each entry goes in the
+ * slot picked by a hash of its key, replacing whatever was there before; an
+ * entry of all zeroes marks an unused slot.  A single lock covers all slots.
+ *
+ * Nothing ever invalidates these caches: the driver is read-only, so the
+ * on-disk structures they remember can't change while mounted.  A cache
+ * shared by mounts of different snapshots must have the transaction id as
+ * part of its keys.
+ */
+struct apfs_slot_cache {
+	spinlock_t lock;
+	unsigned int bits;		/* Log2 of the number of slots */
+	size_t size;			/* Size of each entry */
+	char *entries;			/* Array of slots */
+};
+
+/*
+ * Callback to check if a cached entry matches a key.  It's called with the
+ * cache lock held, so on a match it must also copy out what it needs.
+ */
+typedef bool (*apfs_slot_match_t)(const void *entry, const void *key,
+				  void *out);
+
+extern void apfs_slot_cache_init(struct apfs_slot_cache *cache, void *entries,
+				 unsigned int slots, size_t size);
+extern bool apfs_slot_cache_find(struct apfs_slot_cache *cache, u64 hash,
+				 apfs_slot_match_t match, const void *key,
+				 void *out);
+extern void apfs_slot_cache_replace(struct apfs_slot_cache *cache, u64 hash,
+				    const void *entry, void *old);
+extern void apfs_slot_cache_clear(struct apfs_slot_cache *cache, void *old,
+				  void (*release)(void *old));
+
+#endif	/* _APFS_SLOTCACHE_H */
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/snapshot.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/kernel.h>
+#include "apfs.h"
+#include "btree.h"
+#include "fusion.h"
+#include "key.h"
+#include "message.h"
+#include "node.h"
+#include "object.h"
+#include "snapshot.h"
+#include "super.h"
+
+/**
+ * apfs_snap_query - Read a record from the snapshot metadata tree
+ * @sb:		filesystem superblock
+ * @root:	root node of the snapshot metadata tree
+ * @key:	key for the record
+ * @val:	on return, the beginning of the value for the record
+ * @size:	minimum length of the value
+ *
+ * Returns 0 on success, -ENODATA if the record doesn't exist, or another
+ * negative error code in case of failure.
+ */
+static int apfs_snap_query(struct super_block *sb, struct apfs_node *root,
+			   struct apfs_key *key, void *val, int size)
+{
+	struct apfs_query *query;
+	char *raw;
+	int err;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = key;
+	query->flags |= APFS_QUERY_SNAP_META | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err)
+		goto fail;
+
+	if (query->len < size) {
+		apfs_alert(sb, "bad snapshot record in block 0x%llx",
+			   query->node->object.block_nr);
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	raw = query->node->object.bh->b_data;
+	memcpy(val, raw + query->off, size);
+
+fail:
+	apfs_free_query(sb, query);
+	return err;
+}
+
+/**
+ * apfs_snap_read_meta_root - Read the root of the snapshot metadata tree
+ * @sb:	filesystem superblock
+ *
+ * The tree is taken from the current volume superblock even for a snapshot
+ * mount, since the copy in the snapshot may have been overwritten.  Returns
+ * the root node on success, or an error pointer in case of failure.
+ */
+static struct apfs_node *apfs_snap_read_meta_root(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_node *root;
+
+	if (!sbi->s_snap_meta_tree) {
+		apfs_err(sb, "unsupported snapshot metadata tree");
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+	root = apfs_read_node(sb, sbi->s_snap_meta_tree);
+	if (IS_ERR(root))
+		apfs_err(sb, "unable to read the snapshot metadata tree");
+	return root;
+}
+
+/**
+ * apfs_snap_sblock - Find the volume superblock for a snapshot
+ * @sb:		filesystem superblock
+ * @root:	root node of the snapshot metadata tree
+ * @xid:	transaction id for the snapshot
+ * @sblock:	on return, the block number of the snapshot's volume superblock
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_snap_sblock(struct super_block *sb, struct apfs_node *root,
+			    u64 xid, u64 *sblock)
+{
+	struct apfs_snap_metadata_val meta;
+	struct apfs_key key;
+	int err;
+
+	apfs_init_snap_metadata_key(xid, &key);
+	err = apfs_snap_query(sb, root, &key, &meta, sizeof(meta));
+	if (err)
+		return err;
+	*sblock = le64_to_cpu(meta.sblock_oid);
+	return 0;
+}
+
+/**
+ * apfs_snap_lookup - Find a snapshot of the mounted volume
+ * @sb:		filesystem superblock
+ * @snap:	name of the snapshot, or its transaction id
+ * @xid:	on return, the transaction id for the snapshot
+ * @sblock:	on return, the block number of the snapshot's volume superblock
+ *
+ * The name is checked first; @snap is only taken to be a transaction id if no
+ * snapshot has that name.  Returns 0 on success, or a negative error code in
+ * case of failure.
+ */
+int apfs_snap_lookup(struct super_block *sb, const char *snap,
+		     u64 *xid, u64 *sblock)
+{
+	struct apfs_snap_name_val name;
+	struct apfs_node *root;
+	struct apfs_key key;
+	int err;
+
+	root = apfs_snap_read_meta_root(sb);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+
+	apfs_init_snap_name_key(snap, &key);
+	err = apfs_snap_query(sb, root, &key, &name, sizeof(name));
+	if (!err) {
+		*xid = le64_to_cpu(name.snap_xid);
+	} else if (err == -ENODATA) {
+		if (kstrtou64(snap, 0, xid))
+			goto fail;
+	} else {
+		goto fail;
+	}
+
+	err = apfs_snap_sblock(sb, root, *xid, sblock);
+
+fail:
+	apfs_node_put(root);
+	if (err == -ENODATA)
+		apfs_err(sb, "snapshot %s not found", snap);
+	return err;
+}
+
+/**
+ * apfs_snap_read_super - Read the volume superblock for a snapshot
+ * @sb:		filesystem superblock
+ * @bno:	block number of the snapshot superblock
+ *
+ * Returns the buffer head on success, or an error pointer in case of failure.
+ */
+struct buffer_head *apfs_snap_read_super(struct super_block *sb, u64 bno)
+{
+	struct apfs_superblock *vsb_raw;
+	struct buffer_head *bh;
+
+	bh = apfs_sb_bread(sb, bno);
+	if (!bh) {
+		apfs_err(sb, "unable to read snapshot superblock");
+		return ERR_PTR(-EINVAL);
+	}
+	vsb_raw = (struct apfs_superblock *)bh->b_data;
+	if (le32_to_cpu(vsb_raw->apfs_magic) != APFS_MAGIC) {
+		apfs_err(sb, "wrong magic in snapshot superblock");
+		brelse(bh);
+		return ERR_PTR(-EINVAL);
+	}
+	if (!apfs_obj_verify_csum(sb, &vsb_raw->apfs_o)) {
+		apfs_err(sb, "inconsistent snapshot superblock");
+		brelse(bh);
+		return ERR_PTR(-EFSBADCRC);
+	}
+	return bh;
+}
+
+/**
+ * apfs_snap_read_catalog - Read the catalog root of a snapshot
+ * @sb:		filesystem superblock
+ * @xid:	transaction id for the snapshot
+ *
+ * If @xid is the transaction id of the mount itself, the mounted catalog is
+ * returned, so that the current state of a volume can be compared to one of
+ * its snapshots.  The caller must put the node when done with it.  Returns
+ * the root node on success, or an error pointer in case of failure.
+ */
+struct apfs_node *apfs_snap_read_catalog(struct super_block *sb, u64 xid)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw;
+	struct apfs_node *root;
+	struct buffer_head *bh;
+	u64 sblock, root_oid, root_bno, map_xid;
+	u32 flags;
+	int err;
+
+	if (xid == sbi->s_xid) {
+		apfs_node_get(sbi->s_cat_root);
+		return sbi->s_cat_root;
+	}
+
+	root = apfs_snap_read_meta_root(sb);
+	if (IS_ERR(root))
+		return root;
+	err = apfs_snap_sblock(sb, root, xid, &sblock);
+	apfs_node_put(root);
+	if (err)
+		return ERR_PTR(err);
+
+	bh = apfs_snap_read_super(sb, sblock);
+	if (IS_ERR(bh))
+		return ERR_CAST(bh);
+	vsb_raw = (struct apfs_superblock *)bh->b_data;
+	root_oid = le64_to_cpu(vsb_raw->apfs_root_tree_oid);
+	brelse(bh);
+
+	err = apfs_omap_lookup(sb, sbi->s_omap_root, root_oid, xid, &root_bno,
+			       &map_xid, &flags);
+	if (err)
+		return ERR_PTR(err);
+	return apfs_read_vnode(sb, root_bno, flags);
+}
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/snapshot.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_SNAPSHOT_H
+#define _APFS_SNAPSHOT_H
+
+#include <linux/types.h>
+
+struct super_block;
+struct buffer_head;
+struct apfs_node;
+
+/*
+ * Structure of the value of a snapshot metadata record
+ */
+struct apfs_snap_metadata_val {
+	__le64 extentref_tree_oid;
+	__le64 sblock_oid;
+	__le64 create_time;
+	__le64 change_time;
+	__le64 inum;
+	__le32 extentref_tree_type;
+	__le32 flags;
+	__le16 name_len;
+	u8 name[0];
+} __packed;
+
+/*
+ * Structure of the value of a snapshot name record
+ */
+struct apfs_snap_name_val {
+	__le64 snap_xid;
+} __packed;
+
+extern int apfs_snap_lookup(struct super_block *sb, const char *snap,
+			    u64 *xid, u64 *sblock);
+extern struct buffer_head *apfs_snap_read_super(struct super_block *sb,
+						u64 bno);
+extern struct apfs_node *apfs_snap_read_catalog(struct super_block *sb,
+						u64 xid);
+
+#endif	/* _APFS_SNAPSHOT_H */
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/spaceman.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/buffer_head.h>
+#include "apfs.h"
+#include "message.h"
+#include "object.h"
+#include "spaceman.h"
+#include "super.h"
+
+/**
+ * apfs_read_spaceman - Read the free space count from the space manager
+ * @sb:	filesystem superblock
+ *
+ * The space manager is an ephemeral object, so it must be found through the
+ * checkpoint map.  On success, returns 0 and sets the nx_free_blocks and
+ * nx_avail_blocks fields of APFS_NXI(@sb); on failure returns a negative error
+ * code.
+ */
+int apfs_read_spaceman(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
+	struct apfs_spaceman_phys *sm_raw;
+	struct buffer_head *bh;
+	u64 oid, bno, free = 0, reserve, reserve_used;
+	u32 size;
+	int err = 0;
+	int i;
+
+	oid = le64_to_cpu(msb_raw->nx_spaceman_oid);
+	err = apfs_cpm_lookup_oid(sb, oid, APFS_OBJECT_TYPE_SPACEMAN,
+				  &bno, &size);
+	if (err) {
+		apfs_err(sb, "unable to find the space manager");
+		return err;
+	}
+	if (size < sizeof(*sm_raw) || size % sb->s_blocksize)
+		return -EFSCORRUPTED;
+
+	bh = sb_bread(sb, bno);
+	if (!bh) {
+		apfs_err(sb, "unable to read the space manager");
+		return -EIO;
+	}
+	sm_raw = (struct apfs_spaceman_phys *)bh->b_data;
+
+	if ((le32_to_cpu(sm_raw->sm_o.o_type) & APFS_OBJECT_TYPE_MASK) !=
+						APFS_OBJECT_TYPE_SPACEMAN ||
+	    le64_to_cpu(sm_raw->sm_o.o_oid) != oid) {
+		apfs_err(sb, "bad space manager in block 0x%llx", bno);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	err = apfs_multiblock_verify_csum(sb, bno,
+					  size >> sb->s_blocksize_bits);
+	if (err) {
+		apfs_err(sb, "bad checksum for the space manager");
+		goto out;
+	}
+
+	for (i = 0; i < APFS_SD_COUNT; ++i)
+		free += le64_to_cpu(sm_raw->sm_dev[i].sm_free_count);
+	if (free > le64_to_cpu(msb_raw->nx_block_count)) {
+		apfs_err(sb, "free block count is too big");
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+
+	/* Space reserved by the volumes is not available to the others */
+	reserve = le64_to_cpu(sm_raw->sm_fs_reserve_block_count);
+	reserve_used = le64_to_cpu(sm_raw->sm_fs_reserve_alloc_count);
+	reserve = reserve > reserve_used ? reserve - reserve_used : 0;
+
+	nxi->nx_free_blocks = free;
+	nxi->nx_avail_blocks = free > reserve ? free - reserve : 0;
+
+out:
+	brelse(bh);
+	return err;
+}
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/spaceman.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_SPACEMAN_H
+#define _APFS_SPACEMAN_H
+
+#include <linux/types.h>
+#include "object.h"
+
+struct super_block;
+
+/* Indexes into the array of devices of the space manager */
+enum {
+	APFS_SD_MAIN	= 0,
+	APFS_SD_TIER2	= 1,
+	APFS_SD_COUNT	= 2
+};
+
+/*
+ * Structure used to store the allocation information for a device
+ */
+struct apfs_spaceman_device {
+	__le64 sm_block_count;
+	__le64 sm_chunk_count;
+	__le32 sm_cib_count;
+	__le32 sm_cab_count;
+	__le64 sm_free_count;
+	__le32 sm_addr_offset;
+	__le32 sm_reserved;
+	__le64 sm_reserved2;
+} __packed;
+
+/*
+ * On-disk representation of the space manager.  Only the fields that come
+ * before the free queues are listed, since they are the only ones we use.
+ */
+struct apfs_spaceman_phys {
+/*00*/	struct apfs_obj_phys sm_o;
+/*20*/	__le32 sm_block_size;
+	__le32 sm_blocks_per_chunk;
+	__le32 sm_chunks_per_cib;
+	__le32 sm_cibs_per_cab;
+/*30*/	struct apfs_spaceman_device sm_dev[APFS_SD_COUNT];
+/*90*/	__le32 sm_flags;
+	__le32 sm_ip_bm_tx_multiplier;
+	__le64 sm_ip_block_count;
+/*A0*/	__le32 sm_ip_bm_size_in_blocks;
+	__le32 sm_ip_bm_block_count;
+	__le64 sm_ip_bm_base;
+/*B0*/	__le64 sm_ip_base;
+	__le64 sm_fs_reserve_block_count;
+/*C0*/	__le64 sm_fs_reserve_alloc_count;
+} __packed;
+
+extern int apfs_read_spaceman(struct super_block *sb);
+
+#endif	/* _APFS_SPACEMAN_H */
@@ -6,6 +6,8 @@
  */
 
 #include <linux/module.h>
+#include <linux/backing-dev.h>
+#include <linux/blkdev.h>
 #include <linux/fs.h>
 #include <linux/magic.h>
 #include <linux/slab.h>
@@ -14,13 +16,23 @@
 #include <linux/statfs.h>
 #include <linux/seq_file.h>
 #include <linux/iversion.h>
+#include <linux/sort.h>
 #include "apfs.h"
 #include "btree.h"
+#include "cache.h"
+#include "crypto.h"
+#include "debugfs.h"
+#include "fusion.h"
 #include "inode.h"
+#include "iotrace.h"
 #include "message.h"
 #include "node.h"
 #include "object.h"
+#include "readpage.h"
+#include "snapshot.h"
+#include "spaceman.h"
 #include "super.h"
+#include "sysfs.h"
 #include "xattr.h"
 
 /**
@@ -84,23 +96,215 @@ static struct buffer_head *apfs_read_super_copy(struct super_block *sb)
 	return ERR_PTR(err);
 }
 
+/**
+ * apfs_xp_tree_walk - Collect the runs of blocks in a checkpoint b-tree
+ * @sb:		superblock structure
+ * @bno:	block number of the node to walk
+ * @depth:	depth of the node in the tree
+ * @ranges:	array of runs to fill
+ * @nranges:	number of runs already in @ranges, updated on return
+ * @max:	capacity of @ranges
+ *
+ * The checkpoint descriptor b-tree is a physical tree; its keys are block
+ * offsets inside the checkpoint area, and its values are the physical ranges
+ * that hold them.  Returns 0 on success or a negative error code in case of
+ * failure.
+ */
+static int apfs_xp_tree_walk(struct super_block *sb, u64 bno, int depth,
+			     struct apfs_xp_range *ranges, int *nranges,
+			     int max)
+{
+	struct apfs_node *node;
+	char *raw;
+	int err = 0;
+	int i;
+
+	if (depth >= 12) { /* Same limit as apfs_btree_query() */
+		apfs_alert(sb, "checkpoint descriptor tree is corrupted");
+		return -EFSCORRUPTED;
+	}
+
+	node = apfs_read_node(sb, bno);
+	if (IS_ERR(node))
+		return PTR_ERR(node);
+	raw = node->object.bh->b_data;
+
+	for (i = 0; i < node->records; ++i) {
+		struct apfs_prange *prange;
+		struct apfs_xp_range *range;
+		int key_off, key_len, off, len;
+
+		key_len = apfs_node_locate_key(node, i, &key_off);
+		len = apfs_node_locate_data(node, i, &off);
+		if (key_len < sizeof(__le64)) {
+			err = -EFSCORRUPTED;
+			break;
+		}
+
+		if (!apfs_node_is_leaf(node)) {
+			u64 child;
+
+			/* Physical tree, so the child id is the block number */
+			if (len != sizeof(__le64)) {
+				err = -EFSCORRUPTED;
+				break;
+			}
+			child = le64_to_cpup((__le64 *)(raw + off));
+			err = apfs_xp_tree_walk(sb, child, depth + 1, ranges,
+						nranges, max);
+			if (err)
+				break;
+			continue;
+		}
+
+		if (len < sizeof(*prange) || *nranges >= max) {
+			err = -EFSCORRUPTED;
+			break;
+		}
+		prange = (struct apfs_prange *)(raw + off);
+		range = &ranges[(*nranges)++];
+		range->index = le64_to_cpup((__le64 *)(raw + key_off));
+		range->bno = le64_to_cpu(prange->pr_start_paddr);
+		range->count = le64_to_cpu(prange->pr_block_count);
+	}
+
+	if (err == -EFSCORRUPTED)
+		apfs_alert(sb, "bad checkpoint descriptor node in block 0x%llx",
+			   bno);
+	apfs_node_put(node);
+	return err;
+}
+
+/**
+ * apfs_read_xp_desc - Find the layout of the checkpoint descriptor area
+ * @sb:		superblock structure
+ * @msb_raw:	container superblock to read the layout from
+ *
+ * Returns a negative error code in case of failure.  On success, returns 0
+ * and sets the nx_xp_desc, nx_xp_desc_nranges and nx_xp_desc_blocks fields of
+ * APFS_NXI(@sb).
+ */
+static int apfs_read_xp_desc(struct super_block *sb,
+			     struct apfs_nx_superblock *msb_raw)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_xp_range *ranges;
+	u64 desc_base, next = 0;
+	u32 desc_blocks;
+	int nranges = 0;
+	int err;
+	int i;
+
+	desc_base = le64_to_cpu(msb_raw->nx_xp_desc_base);
+	desc_blocks = le32_to_cpu(msb_raw->nx_xp_desc_blocks);
+	if (!desc_blocks || desc_blocks > APFS_NX_XP_MAX_BLOCKS) {
+		apfs_err(sb, "too many checkpoint descriptors?");
+		return -EFSCORRUPTED;
+	}
+
+	if (!(desc_base & APFS_NX_XP_NONCONTIGUOUS)) {
+		/* The whole area is a single run */
+		ranges = kmalloc(sizeof(*ranges), GFP_KERNEL);
+		if (!ranges)
+			return -ENOMEM;
+		ranges->index = 0;
+		ranges->bno = desc_base;
+		ranges->count = desc_blocks;
+		nranges = 1;
+		goto out;
+	}
+
+	/* There can't be more runs than blocks in the area */
+	ranges = kmalloc_array(desc_blocks, sizeof(*ranges), GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+	err = apfs_xp_tree_walk(sb, desc_base & ~APFS_NX_XP_NONCONTIGUOUS,
+				0 /* depth */, ranges, &nranges, desc_blocks);
+	if (err)
+		goto fail;
+
+	/* The runs must cover the whole area, in order and without gaps */
+	for (i = 0; i < nranges; ++i) {
+		if (ranges[i].index != next || !ranges[i].count)
+			break;
+		next += ranges[i].count;
+	}
+	if (i != nranges || next != desc_blocks) {
+		apfs_err(sb, "bad layout for checkpoint descriptor area");
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+
+out:
+	nxi->nx_xp_desc = ranges;
+	nxi->nx_xp_desc_nranges = nranges;
+	nxi->nx_xp_desc_blocks = desc_blocks;
+	return 0;
+
+fail:
+	kfree(ranges);
+	return err;
+}
+
+/**
+ * apfs_xp_desc_readahead - Start reading the whole checkpoint descriptor area
+ * @sb:	superblock structure
+ *
+ * The area is scanned in full on every mount, so submit all the reads at once
+ * and let the block layer merge them, instead of waiting on each block.
+ */
+static void apfs_xp_desc_readahead(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct blk_plug plug;
+	int i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nxi->nx_xp_desc_nranges; ++i) {
+		struct apfs_xp_range *range = &nxi->nx_xp_desc[i];
+		u64 j;
+
+		for (j = 0; j < range->count; ++j)
+			sb_breadahead(sb, range->bno + j);
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Container superblock found in the checkpoint area, not yet verified
+ */
+struct apfs_xp_candidate {
+	u64 xid;
+	u64 bno;
+};
+
+/* Sort the candidates with the latest transaction first */
+static int apfs_xp_candidate_cmp(const void *a, const void *b)
+{
+	const struct apfs_xp_candidate *c1 = a, *c2 = b;
+
+	if (c1->xid == c2->xid)
+		return 0;
+	return c1->xid < c2->xid ? 1 : -1;
+}
+
 /**
  * apfs_map_main_super - Find the container superblock and map it into memory
  * @sb:	superblock structure
  *
  * Returns a negative error code in case of failure.  On success, returns 0
- * and sets the s_msb_raw, s_mobject and s_xid fields of APFS_SB(@sb).
+ * and sets the nx_raw, nx_object and nx_xid fields of APFS_NXI(@sb).
  */
 static int apfs_map_main_super(struct super_block *sb)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct buffer_head *bh;
-	struct buffer_head *desc_bh = NULL;
+	struct buffer_head *desc_bh;
 	struct apfs_nx_superblock *msb_raw;
+	struct apfs_xp_candidate *cands = NULL;
 	u64 xid, bno = APFS_NX_BLOCK_NUM;
-	u64 desc_base;
-	u32 desc_blocks;
-	int err = -EINVAL;
+	int ncands = 0;
+	int err;
 	int i;
 
 	/* Read the superblock from the last clean unmount */
@@ -110,69 +314,230 @@ static int apfs_map_main_super(struct super_block *sb)
 	msb_raw = (struct apfs_nx_superblock *)bh->b_data;
 
 	/* We want to mount the latest valid checkpoint among the descriptors */
-	desc_base = le64_to_cpu(msb_raw->nx_xp_desc_base);
-	if (desc_base >> 63 != 0) {
-		/* The highest bit is set when checkpoints are not contiguous */
-		apfs_err(sb, "checkpoint descriptor tree not yet supported");
+	err = apfs_read_xp_desc(sb, msb_raw);
+	if (err)
 		goto fail;
-	}
-	desc_blocks = le32_to_cpu(msb_raw->nx_xp_desc_blocks);
-	if (desc_blocks > 10000) { /* Arbitrary loop limit, is it enough? */
-		apfs_err(sb, "too many checkpoint descriptors?");
-		err = -EFSCORRUPTED;
+	apfs_xp_desc_readahead(sb);
+
+	cands = kvmalloc_array(nxi->nx_xp_desc_blocks, sizeof(*cands),
+			       GFP_KERNEL);
+	if (!cands) {
+		err = -ENOMEM;
 		goto fail;
 	}
 
-	/* Now we go through the checkpoints one by one */
+	/*
+	 * Collect the superblocks that are newer than the one in block zero.
+	 * Checksums are expensive, so leave them for later.
+	 */
 	xid = le64_to_cpu(msb_raw->nx_o.o_xid);
-	for (i = 0; i < desc_blocks; ++i) {
+	for (i = 0; i < nxi->nx_xp_desc_nranges; ++i) {
+		struct apfs_xp_range *range = &nxi->nx_xp_desc[i];
+		u64 j;
+
+		for (j = 0; j < range->count; ++j) {
+			struct apfs_nx_superblock *desc_raw;
+			u64 desc_xid;
+
+			desc_bh = sb_bread(sb, range->bno + j);
+			if (!desc_bh) {
+				apfs_err(sb, "unable to read checkpoint descriptor");
+				err = -EINVAL;
+				goto fail;
+			}
+			desc_raw = (struct apfs_nx_superblock *)desc_bh->b_data;
+			desc_xid = le64_to_cpu(desc_raw->nx_o.o_xid);
+
+			if (le32_to_cpu(desc_raw->nx_magic) == APFS_NX_MAGIC &&
+			    desc_xid > xid) {
+				cands[ncands].xid = desc_xid;
+				cands[ncands].bno = range->bno + j;
+				ncands++;
+			}
+			brelse(desc_bh);
+		}
+	}
+
+	/* Now pick the latest one that is not corrupted */
+	sort(cands, ncands, sizeof(*cands), apfs_xp_candidate_cmp, NULL);
+	for (i = 0; i < ncands; ++i) {
 		struct apfs_nx_superblock *desc_raw;
 
-		brelse(desc_bh);
-		desc_bh = sb_bread(sb, desc_base + i);
+		desc_bh = sb_bread(sb, cands[i].bno);
 		if (!desc_bh) {
 			apfs_err(sb, "unable to read checkpoint descriptor");
+			err = -EINVAL;
 			goto fail;
 		}
 		desc_raw = (struct apfs_nx_superblock *)desc_bh->b_data;
-
-		if (le32_to_cpu(desc_raw->nx_magic) != APFS_NX_MAGIC)
-			continue; /* Not a superblock */
-		if (le64_to_cpu(desc_raw->nx_o.o_xid) <= xid)
-			continue; /* Old */
-		if (!apfs_obj_verify_csum(sb, &desc_raw->nx_o))
+		if (!apfs_obj_verify_csum(sb, &desc_raw->nx_o)) {
+			brelse(desc_bh);
 			continue; /* Corrupted */
+		}
 
-		xid = le64_to_cpu(desc_raw->nx_o.o_xid);
+		xid = cands[i].xid;
 		msb_raw = desc_raw;
-		bno = desc_base + i;
+		bno = cands[i].bno;
 		brelse(bh);
 		bh = desc_bh;
-		desc_bh = NULL;
+		break;
 	}
+	kvfree(cands);
 
-	sbi->s_xid = xid;
-	sbi->s_msb_raw = msb_raw;
-	sbi->s_mobject.sb = sb;
-	sbi->s_mobject.block_nr = bno;
-	sbi->s_mobject.oid = le64_to_cpu(msb_raw->nx_o.o_oid);
-	sbi->s_mobject.bh = bh;
+	nxi->nx_xid = xid;
+	nxi->nx_raw = msb_raw;
+	nxi->nx_object.block_nr = bno;
+	nxi->nx_object.oid = le64_to_cpu(msb_raw->nx_o.o_oid);
+	nxi->nx_object.bh = bh;
 	return 0;
 
 fail:
+	kvfree(cands);
+	kfree(nxi->nx_xp_desc);
+	nxi->nx_xp_desc = NULL;
 	brelse(bh);
 	return err;
 }
 
 /**
- * apfs_unmap_main_super - Clean up apfs_map_main_super()
+ * apfs_xp_desc_bno - Find the physical block for an offset in the checkpoint
+ *		      descriptor area
+ * @sb:		filesystem superblock
+ * @index:	logical offset inside the area
+ * @bno:	on return, the block number
+ *
+ * Returns 0 on success, or -EFSCORRUPTED if @index is out of range.
+ */
+static int apfs_xp_desc_bno(struct super_block *sb, u64 index, u64 *bno)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	int i;
+
+	for (i = 0; i < nxi->nx_xp_desc_nranges; ++i) {
+		struct apfs_xp_range *range = &nxi->nx_xp_desc[i];
+
+		if (index >= range->index &&
+		    index < range->index + range->count) {
+			*bno = range->bno + index - range->index;
+			return 0;
+		}
+	}
+	return -EFSCORRUPTED;
+}
+
+/**
+ * apfs_cpm_lookup_oid - Find the location of an ephemeral object
+ * @sb:		filesystem superblock
+ * @oid:	ephemeral object id
+ * @type:	expected object type
+ * @bno:	on return, the block number of the object
+ * @size:	on return, the size of the object in bytes
+ *
+ * Searches the checkpoint-mapping blocks of the mounted checkpoint, which are
+ * stored in the descriptor area right before its container superblock.
+ * Returns 0 on success, -ENODATA if the object is not mapped, or another
+ * negative error code in case of failure.
+ */
+int apfs_cpm_lookup_oid(struct super_block *sb, u64 oid, u32 type,
+			u64 *bno, u32 *size)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
+	u32 desc_index = le32_to_cpu(msb_raw->nx_xp_desc_index);
+	u32 desc_len = le32_to_cpu(msb_raw->nx_xp_desc_len);
+	int max_maps;
+	int i;
+
+	if (!desc_len || desc_len > nxi->nx_xp_desc_blocks)
+		return -EFSCORRUPTED;
+	max_maps = (sb->s_blocksize - sizeof(struct apfs_checkpoint_map_phys))
+			/ sizeof(struct apfs_checkpoint_mapping);
+
+	/* The last block of the checkpoint is the superblock itself */
+	for (i = 0; i < desc_len - 1; ++i) {
+		struct apfs_checkpoint_map_phys *cpm;
+		struct buffer_head *bh;
+		u64 map_bno;
+		u32 count, flags;
+		int err;
+		int j;
+
+		err = apfs_xp_desc_bno(sb, ((u64)desc_index + i) %
+					   nxi->nx_xp_desc_blocks, &map_bno);
+		if (err)
+			return err;
+		bh = sb_bread(sb, map_bno);
+		if (!bh) {
+			apfs_err(sb, "unable to read checkpoint map");
+			return -EIO;
+		}
+		cpm = (struct apfs_checkpoint_map_phys *)bh->b_data;
+
+		if ((le32_to_cpu(cpm->cpm_o.o_type) & APFS_OBJECT_TYPE_MASK) !=
+					APFS_OBJECT_TYPE_CHECKPOINT_MAP ||
+		    le64_to_cpu(cpm->cpm_o.o_xid) != nxi->nx_xid ||
+		    !apfs_obj_verify_csum(sb, &cpm->cpm_o)) {
+			apfs_err(sb, "bad checkpoint map in block 0x%llx",
+				 map_bno);
+			brelse(bh);
+			return -EFSCORRUPTED;
+		}
+
+		count = min_t(u32, le32_to_cpu(cpm->cpm_count), max_maps);
+		flags = le32_to_cpu(cpm->cpm_flags);
+		for (j = 0; j < count; ++j) {
+			struct apfs_checkpoint_mapping *map = &cpm->cpm_map[j];
+
+			if (le64_to_cpu(map->cpm_oid) != oid)
+				continue;
+			if ((le32_to_cpu(map->cpm_type) &
+			     APFS_OBJECT_TYPE_MASK) != type) {
+				brelse(bh);
+				return -EFSCORRUPTED;
+			}
+			*bno = le64_to_cpu(map->cpm_paddr);
+			*size = le32_to_cpu(map->cpm_size);
+			brelse(bh);
+			return 0;
+		}
+		brelse(bh);
+
+		if (flags & APFS_CHECKPOINT_MAP_LAST)
+			break;
+	}
+	return -ENODATA;
+}
+
+/**
+ * apfs_read_nx_omap - Find the root node of the container object map
  * @sb:	filesystem superblock
+ *
+ * On success, returns 0 and sets APFS_NXI(@sb)->nx_omap_root; on failure
+ * returns a negative error code.
  */
-static inline void apfs_unmap_main_super(struct super_block *sb)
+static int apfs_read_nx_omap(struct super_block *sb)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_omap_phys *msb_omap_raw;
+	struct buffer_head *bh;
+	u64 msb_omap;
+
+	msb_omap = le64_to_cpu(nxi->nx_raw->nx_omap_oid);
+	bh = apfs_sb_bread(sb, msb_omap);
+	if (!bh) {
+		apfs_err(sb, "unable to read container object map");
+		return -EINVAL;
+	}
+	msb_omap_raw = (struct apfs_omap_phys *)bh->b_data;
+	if (!apfs_obj_verify_csum(sb, &msb_omap_raw->om_o)) {
+		apfs_err(sb, "bad checksum for the container object map");
+		brelse(bh);
+		return -EFSBADCRC;
+	}
 
-	brelse(sbi->s_mobject.bh);
+	nxi->nx_omap_root = le64_to_cpu(msb_omap_raw->om_tree_oid);
+	brelse(bh);
+	return 0;
 }
 
 /**
@@ -185,13 +550,14 @@ static inline void apfs_unmap_main_super(struct super_block *sb)
 static int apfs_map_volume_super(struct super_block *sb)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nx_superblock *msb_raw = sbi->s_msb_raw;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
 	struct apfs_superblock *vsb_raw;
-	struct apfs_omap_phys *msb_omap_raw;
 	struct apfs_node *vnode;
 	struct buffer_head *bh;
 	u64 vol_id;
-	u64 msb_omap, vb, vsb;
+	u64 vsb;
+	u32 tree_type;
 	int err;
 
 	/* Get the id for the requested volume number */
@@ -205,39 +571,21 @@ static int apfs_map_volume_super(struct super_block *sb)
 		return -EINVAL;
 	}
 
-	/* Get the container's object map */
-	msb_omap = le64_to_cpu(msb_raw->nx_omap_oid);
-	bh = sb_bread(sb, msb_omap);
-	if (!bh) {
-		apfs_err(sb, "unable to read container object map");
-		return -EINVAL;
-	}
-	msb_omap_raw = (struct apfs_omap_phys *)bh->b_data;
-	if (!apfs_obj_verify_csum(sb, &msb_omap_raw->om_o)) {
-		apfs_err(sb, "bad checksum for the container object map");
-		err = -EFSBADCRC;
-		goto fail;
-	}
-
 	/* Get the Volume Block */
-	vb = le64_to_cpu(msb_omap_raw->om_tree_oid);
-	msb_omap_raw = NULL;
-	brelse(bh);
-
-	vnode = apfs_read_node(sb, vb);
+	vnode = apfs_read_node(sb, nxi->nx_omap_root);
 	if (IS_ERR(vnode)) {
 		apfs_err(sb, "unable to read volume block");
 		return PTR_ERR(vnode);
 	}
 
-	err = apfs_omap_lookup_block(sb, vnode, vol_id, &vsb);
+	err = apfs_omap_lookup_block(sb, vnode, vol_id, nxi->nx_xid, &vsb);
 	apfs_node_put(vnode);
 	if (err) {
 		apfs_err(sb, "volume not found, likely corruption");
 		return err;
 	}
 
-	bh = sb_bread(sb, vsb);
+	bh = apfs_sb_bread(sb, vsb);
 	if (!bh) {
 		apfs_err(sb, "unable to read volume superblock");
 		return -EINVAL;
@@ -255,6 +603,12 @@ static int apfs_map_volume_super(struct super_block *sb)
 		goto fail;
 	}
 
+	/* Keep the snapshot tree from the current sb, even for snapshots */
+	tree_type = le32_to_cpu(vsb_raw->apfs_snap_meta_tree_type);
+	if ((tree_type & APFS_OBJ_STORAGETYPE_MASK) == APFS_OBJ_PHYSICAL)
+		sbi->s_snap_meta_tree =
+			le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid);
+
 	sbi->s_vsb_raw = vsb_raw;
 	sbi->s_vobject.sb = sb;
 	sbi->s_vobject.block_nr = vsb;
@@ -278,6 +632,40 @@ static inline void apfs_unmap_volume_super(struct super_block *sb)
 	brelse(sbi->s_vobject.bh);
 }
 
+/**
+ * apfs_map_snap_super - Replace the volume superblock with a snapshot's
+ * @sb:	filesystem superblock
+ *
+ * The object map of the current volume superblock must already be read, since
+ * the snapshot's omap may have been overwritten since.  Returns 0 on success,
+ * or a negative error code in case of failure.
+ */
+static int apfs_map_snap_super(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw;
+	struct buffer_head *bh;
+	u64 xid, bno;
+	int err;
+
+	err = apfs_snap_lookup(sb, sbi->s_snap_name, &xid, &bno);
+	if (err)
+		return err;
+
+	bh = apfs_snap_read_super(sb, bno);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	vsb_raw = (struct apfs_superblock *)bh->b_data;
+
+	apfs_unmap_volume_super(sb);
+	sbi->s_xid = xid;
+	sbi->s_vsb_raw = vsb_raw;
+	sbi->s_vobject.block_nr = bno;
+	sbi->s_vobject.oid = le64_to_cpu(vsb_raw->apfs_o.o_oid);
+	sbi->s_vobject.bh = bh;
+	return 0;
+}
+
 /**
  * apfs_read_omap - Find and read the omap root node
  * @sb:	superblock structure
@@ -296,7 +684,7 @@ static int apfs_read_omap(struct super_block *sb)
 
 	/* Get the block holding the volume omap information */
 	omap_blk = le64_to_cpu(vsb_raw->apfs_omap_oid);
-	bh = sb_bread(sb, omap_blk);
+	bh = apfs_sb_bread(sb, omap_blk);
 	if (!bh) {
 		apfs_err(sb, "unable to read the volume object map");
 		return -EINVAL;
@@ -349,14 +737,15 @@ static void apfs_put_super(struct super_block *sb)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 
+	apfs_debugfs_unregister(sb);
+	apfs_unregister_sysfs(sb);
 	apfs_node_put(sbi->s_cat_root);
 	apfs_node_put(sbi->s_omap_root);
+	apfs_crypto_release(sb);
+	apfs_cache_put_volume_cookie(sb);
+	apfs_inode_cache_shrink(&sbi->s_inode_cache, ULONG_MAX);
 
-	apfs_unmap_main_super(sb);
 	apfs_unmap_volume_super(sb);
-
-	sb->s_fs_info = NULL;
-	kfree(sbi);
 }
 
 static struct kmem_cache *apfs_inode_cachep;
@@ -369,6 +758,14 @@ static struct inode *apfs_alloc_inode(struct super_block *sb)
 	if (!ai)
 		return NULL;
 	inode_set_iversion(&ai->vfs_inode, 1);
+	ai->i_nchildren = 0;
+	ai->i_bloom = NULL;
+	atomic_set(&ai->i_lookup_misses, 0);
+	ai->i_readdir_pages = 0;
+	atomic_set(&ai->i_readdir_scans, 0);
+#ifdef CONFIG_APFS_FSCACHE
+	ai->i_fscache = NULL;
+#endif
 	return &ai->vfs_inode;
 }
 
@@ -384,6 +781,14 @@ static void apfs_destroy_inode(struct inode *inode)
 	call_rcu(&inode->i_rcu, apfs_i_callback);
 }
 
+static void apfs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+	apfs_cache_put_inode_cookie(inode);
+	apfs_dir_release_bloom(inode);
+}
+
 static void init_once(void *p)
 {
 	struct apfs_inode_info *ai = (struct apfs_inode_info *)p;
@@ -420,35 +825,20 @@ static void destroy_inodecache(void)
  * @sb:		filesystem superblock
  * @count:	on return it will store the block count
  *
- * This function probably belongs in a separate file, but for now it is
- * only called by statfs.
+ * This is slow, so it's only used at mount time when the space manager can't
+ * be read.
  */
 static int apfs_count_used_blocks(struct super_block *sb, u64 *count)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nx_superblock *msb_raw = sbi->s_msb_raw;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
 	struct apfs_node *vnode;
-	struct apfs_omap_phys *msb_omap_raw;
 	struct buffer_head *bh;
-	u64 msb_omap, vb;
 	int i;
 	int err = 0;
 
-	/* Get the container's object map */
-	msb_omap = le64_to_cpu(msb_raw->nx_omap_oid);
-	bh = sb_bread(sb, msb_omap);
-	if (!bh) {
-		apfs_err(sb, "unable to read container object map");
-		return -EIO;
-	}
-	msb_omap_raw = (struct apfs_omap_phys *)bh->b_data;
-
 	/* Get the Volume Block */
-	vb = le64_to_cpu(msb_omap_raw->om_tree_oid);
-	msb_omap_raw = NULL;
-	brelse(bh);
-	bh = NULL;
-	vnode = apfs_read_node(sb, vb);
+	vnode = apfs_read_node(sb, nxi->nx_omap_root);
 	if (IS_ERR(vnode)) {
 		apfs_err(sb, "unable to read volume block");
 		return PTR_ERR(vnode);
@@ -464,11 +854,12 @@ static int apfs_count_used_blocks(struct super_block *sb, u64 *count)
 		vol_id = le64_to_cpu(msb_raw->nx_fs_oid[i]);
 		if (vol_id == 0) /* All volumes have been checked */
 			break;
-		err = apfs_omap_lookup_block(sb, vnode, vol_id, &vol_bno);
+		err = apfs_omap_lookup_block(sb, vnode, vol_id, nxi->nx_xid,
+					     &vol_bno);
 		if (err)
 			break;
 
-		bh = sb_bread(sb, vol_bno);
+		bh = apfs_sb_bread(sb, vol_bno);
 		if (!bh) {
 			err = -EIO;
 			apfs_err(sb, "unable to read volume superblock");
@@ -483,14 +874,40 @@ static int apfs_count_used_blocks(struct super_block *sb, u64 *count)
 	return err;
 }
 
+/**
+ * apfs_read_free_space - Find the free space in the container
+ * @sb:	filesystem superblock
+ *
+ * Sets the nx_free_blocks and nx_avail_blocks fields of APFS_NXI(@sb), so
+ * that statfs doesn't need to do any i/o.
+ */
+static void apfs_read_free_space(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	u64 total, used;
+	int err;
+
+	if (!apfs_read_spaceman(sb))
+		return;
+
+	/* Fall back to adding up the blocks allocated by each volume */
+	apfs_warn(sb, "free space count may be inaccurate");
+	total = le64_to_cpu(nxi->nx_raw->nx_block_count);
+	err = apfs_count_used_blocks(sb, &used);
+	if (err || used > total)
+		used = total;
+	nxi->nx_free_blocks = total - used;
+	nxi->nx_avail_blocks = nxi->nx_free_blocks;
+}
+
 static int apfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_nx_superblock *msb_raw = sbi->s_msb_raw;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_nx_superblock *msb_raw = nxi->nx_raw;
 	struct apfs_superblock *vol = sbi->s_vsb_raw;
-	u64 fsid, used_blocks = 0;
-	int err;
+	u64 fsid;
 
 	buf->f_type = APFS_SUPER_MAGIC;
 	/* Nodes are assumed to fit in a page, for now */
@@ -498,11 +915,9 @@ static int apfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	/* Volumes share the whole disk space */
 	buf->f_blocks = le64_to_cpu(msb_raw->nx_block_count);
-	err = apfs_count_used_blocks(sb, &used_blocks);
-	if (err)
-		return err;
-	buf->f_bfree = buf->f_blocks - used_blocks;
-	buf->f_bavail = buf->f_bfree; /* I don't know any better */
+	/* The free space doesn't change for a read-only mount */
+	buf->f_bfree = nxi->nx_free_blocks;
+	buf->f_bavail = nxi->nx_avail_blocks;
 
 	/* The file count is only for the mounted volume */
 	buf->f_files = le64_to_cpu(vol->apfs_num_files) +
@@ -532,6 +947,8 @@ static int apfs_show_options(struct seq_file *seq, struct dentry *root)
 
 	if (sbi->s_vol_nr != 0)
 		seq_printf(seq, ",vol=%u", sbi->s_vol_nr);
+	if (sbi->s_snap_name)
+		seq_show_option(seq, "snap", sbi->s_snap_name);
 	if (sbi->s_flags & APFS_UID_OVERRIDE)
 		seq_printf(seq, ",uid=%u", from_kuid(&init_user_ns,
 						     sbi->s_uid));
@@ -540,20 +957,43 @@ static int apfs_show_options(struct seq_file *seq, struct dentry *root)
 						     sbi->s_gid));
 	if (sbi->s_flags & APFS_CHECK_NODES)
 		seq_puts(seq, ",cknodes");
+	if (sbi->s_flags & APFS_FSCACHE)
+		seq_puts(seq, ",fsc");
+	if (sbi->s_flags & APFS_BLOOM)
+		seq_puts(seq, ",bloom");
+	if (sbi->s_flags & APFS_IOTRACE)
+		seq_puts(seq, ",iotrace");
 
 	return 0;
 }
 
+static long apfs_nr_cached_objects(struct super_block *sb,
+				   struct shrink_control *sc)
+{
+	return READ_ONCE(APFS_SB(sb)->s_inode_cache.count);
+}
+
+static long apfs_free_cached_objects(struct super_block *sb,
+				     struct shrink_control *sc)
+{
+	return apfs_inode_cache_shrink(&APFS_SB(sb)->s_inode_cache,
+				       sc->nr_to_scan);
+}
+
 static const struct super_operations apfs_sops = {
 	.alloc_inode	= apfs_alloc_inode,
 	.destroy_inode	= apfs_destroy_inode,
+	.evict_inode	= apfs_evict_inode,
 	.put_super	= apfs_put_super,
 	.statfs		= apfs_statfs,
 	.show_options	= apfs_show_options,
+	.nr_cached_objects = apfs_nr_cached_objects,
+	.free_cached_objects = apfs_free_cached_objects,
 };
 
 enum {
-	Opt_cknodes, Opt_uid, Opt_gid, Opt_vol, Opt_err,
+	Opt_cknodes, Opt_uid, Opt_gid, Opt_vol, Opt_snap, Opt_pass, Opt_tier2,
+	Opt_fsc, Opt_bloom, Opt_iotrace, Opt_err,
 };
 
 static const match_table_t tokens = {
@@ -561,16 +1001,24 @@ static const match_table_t tokens = {
 	{Opt_uid, "uid=%u"},
 	{Opt_gid, "gid=%u"},
 	{Opt_vol, "vol=%u"},
+	{Opt_snap, "snap=%s"},
+	{Opt_pass, "pass=%s"},
+	{Opt_tier2, "tier2=%s"},
+	{Opt_fsc, "fsc"},
+	{Opt_bloom, "bloom"},
+	{Opt_iotrace, "iotrace"},
 	{Opt_err, NULL}
 };
 
 /*
  * Many of the parse_options() functions in other file systems return 0
  * on error. This one returns an error code, and 0 on success.
+ *
+ * The options are parsed before the superblock is found, because the volume
+ * number is needed to tell if the requested volume is already mounted.
  */
-static int parse_options(struct super_block *sb, char *options)
+static int parse_options(struct apfs_sb_info *sbi, char *options)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
 	char *p;
 	substring_t args[MAX_OPT_ARGS];
 	int option;
@@ -603,7 +1051,7 @@ static int parse_options(struct super_block *sb, char *options)
 				return err;
 			sbi->s_uid = make_kuid(current_user_ns(), option);
 			if (!uid_valid(sbi->s_uid)) {
-				apfs_err(sb, "invalid uid");
+				pr_err("APFS: invalid uid\n");
 				return -EINVAL;
 			}
 			sbi->s_flags |= APFS_UID_OVERRIDE;
@@ -614,7 +1062,7 @@ static int parse_options(struct super_block *sb, char *options)
 				return err;
 			sbi->s_gid = make_kgid(current_user_ns(), option);
 			if (!gid_valid(sbi->s_gid)) {
-				apfs_err(sb, "invalid gid");
+				pr_err("APFS: invalid gid\n");
 				return -EINVAL;
 			}
 			sbi->s_flags |= APFS_GID_OVERRIDE;
@@ -624,6 +1072,38 @@ static int parse_options(struct super_block *sb, char *options)
 			if (err)
 				return err;
 			break;
+		case Opt_snap:
+			kfree(sbi->s_snap_name);
+			sbi->s_snap_name = match_strdup(&args[0]);
+			if (!sbi->s_snap_name)
+				return -ENOMEM;
+			break;
+		case Opt_pass:
+			kzfree(sbi->s_passphrase);
+			sbi->s_passphrase = match_strdup(&args[0]);
+			if (!sbi->s_passphrase)
+				return -ENOMEM;
+			break;
+		case Opt_tier2:
+			kfree(sbi->s_tier2_path);
+			sbi->s_tier2_path = match_strdup(&args[0]);
+			if (!sbi->s_tier2_path)
+				return -ENOMEM;
+			break;
+		case Opt_fsc:
+#ifdef CONFIG_APFS_FSCACHE
+			sbi->s_flags |= APFS_FSCACHE;
+			break;
+#else
+			pr_err("APFS: fsc support is not compiled in\n");
+			return -EINVAL;
+#endif
+		case Opt_bloom:
+			sbi->s_flags |= APFS_BLOOM;
+			break;
+		case Opt_iotrace:
+			sbi->s_flags |= APFS_IOTRACE;
+			break;
 		default:
 			return -EINVAL;
 		}
@@ -631,89 +1111,361 @@ static int parse_options(struct super_block *sb, char *options)
 	return 0;
 }
 
+/*
+ * List of containers in use, so that all mounted volumes from the same device
+ * can share a single copy of the container state.  Protected by nxs_mutex,
+ * which also serializes the reading of the container superblock.
+ */
+static LIST_HEAD(nxs);
+static DEFINE_MUTEX(nxs_mutex);
+
+/**
+ * apfs_attach_nxi - Find or create the container info for a block device
+ * @sbi:	in-memory superblock info for the new volume mount
+ * @bdev:	block device for the container, already opened by the caller
+ *
+ * The caller's reference on @bdev is consumed in all cases.  Returns 0 on
+ * success, or a negative error code in case of failure.
+ */
+static int apfs_attach_nxi(struct apfs_sb_info *sbi, struct block_device *bdev)
+{
+	struct apfs_nxsb_info *nxi;
+
+	mutex_lock(&nxs_mutex);
+	list_for_each_entry(nxi, &nxs, nx_list) {
+		if (nxi->nx_bdev == bdev) {
+			++nxi->nx_refcnt;
+			sbi->s_nxi = nxi;
+			mutex_unlock(&nxs_mutex);
+			blkdev_put(bdev, FMODE_READ | FMODE_EXCL);
+			return 0;
+		}
+	}
+
+	nxi = kzalloc(sizeof(*nxi), GFP_KERNEL);
+	if (!nxi) {
+		mutex_unlock(&nxs_mutex);
+		blkdev_put(bdev, FMODE_READ | FMODE_EXCL);
+		return -ENOMEM;
+	}
+	nxi->nx_bdev = bdev;
+	nxi->nx_refcnt = 1;
+	apfs_omap_cache_init(&nxi->nx_omap_cache);
+	list_add(&nxi->nx_list, &nxs);
+	sbi->s_nxi = nxi;
+	mutex_unlock(&nxs_mutex);
+	return 0;
+}
+
+/**
+ * apfs_detach_nxi - Drop a volume's reference to the container info
+ * @sbi:	in-memory superblock info for the volume
+ *
+ * The container superblock is released, and the block device closed, once the
+ * last volume goes away.
+ */
+static void apfs_detach_nxi(struct apfs_sb_info *sbi)
+{
+	struct apfs_nxsb_info *nxi = sbi->s_nxi;
+
+	if (!nxi)
+		return;
+	sbi->s_nxi = NULL;
+
+	mutex_lock(&nxs_mutex);
+	if (--nxi->nx_refcnt) {
+		mutex_unlock(&nxs_mutex);
+		return;
+	}
+	list_del(&nxi->nx_list);
+	mutex_unlock(&nxs_mutex);
+
+	brelse(nxi->nx_object.bh);
+	kfree(nxi->nx_xp_desc);
+	apfs_fusion_exit(nxi);
+	blkdev_put(nxi->nx_bdev, FMODE_READ | FMODE_EXCL);
+	kfree(nxi);
+}
+
+/**
+ * apfs_read_main_super - Set up the container info for a new volume mount
+ * @sb:	filesystem superblock
+ *
+ * Only the first volume mounted from the container does any i/o here; the
+ * rest just set their blocksize to match.  Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+static int apfs_read_main_super(struct super_block *sb)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	int err = 0;
+
+	mutex_lock(&nxs_mutex);
+
+	if (nxi->nx_raw) {
+		u32 blocksize = le32_to_cpu(nxi->nx_raw->nx_block_size);
+
+		if (!sb_set_blocksize(sb, blocksize)) {
+			apfs_err(sb, "bad blocksize %u", blocksize);
+			err = -EINVAL;
+		}
+		sb->s_magic = APFS_NX_MAGIC;
+		goto out;
+	}
+
+	err = apfs_map_main_super(sb);
+	if (err)
+		goto out;
+	err = apfs_fusion_init(sb, APFS_SB(sb)->s_tier2_path);
+	if (err)
+		goto fail;
+	err = apfs_read_nx_omap(sb);
+	if (err)
+		goto fail;
+	apfs_read_free_space(sb);
+	goto out;
+
+fail:
+	apfs_fusion_exit(nxi);
+	brelse(nxi->nx_object.bh);
+	nxi->nx_object.bh = NULL;
+	nxi->nx_raw = NULL;
+	kfree(nxi->nx_xp_desc);
+	nxi->nx_xp_desc = NULL;
+out:
+	mutex_unlock(&nxs_mutex);
+	return err;
+}
+
 static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 {
-	struct apfs_sb_info *sbi;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct inode *root;
 	int err;
 
 	apfs_notice(sb, "this module is read-only");
-	sb->s_flags |= SB_RDONLY;
 
-	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
-	if (!sbi)
+	sbi->s_stats = alloc_percpu(struct apfs_stats);
+	if (!sbi->s_stats)
 		return -ENOMEM;
-	sb->s_fs_info = sbi;
+	err = apfs_iotrace_alloc(sb);
+	if (err)
+		return err;
 
-	err = apfs_map_main_super(sb);
+	err = apfs_read_main_super(sb);
 	if (err)
-		goto failed_main_super;
+		return err;
 
 	/* For now we only support blocksize < PAGE_SIZE */
 	sbi->s_blocksize = sb->s_blocksize;
 	sbi->s_blocksize_bits = sb->s_blocksize_bits;
-
-	err = parse_options(sb, data);
-	if (err)
-		goto failed_volume_super;
+	sbi->s_xid = APFS_NXI(sb)->nx_xid;
+	apfs_name_cache_init(&sbi->s_name_cache);
+	apfs_lookup_cache_init(&sbi->s_lookup_cache);
+	apfs_inode_cache_init(&sbi->s_inode_cache);
+	apfs_node_cache_init(&sbi->s_node_cache);
 
 	err = apfs_map_volume_super(sb);
 	if (err)
-		goto failed_volume_super;
+		return err;
 
 	/* The omap needs to be set before the call to apfs_read_catalog() */
 	err = apfs_read_omap(sb);
 	if (err)
 		goto failed_omap;
 
+	if (sbi->s_snap_name) {
+		err = apfs_map_snap_super(sb);
+		if (err)
+			goto failed_cat;
+	}
+
+	/* The passphrase is not needed once the volume key is known */
+	err = apfs_crypto_unlock(sb);
+	kzfree(sbi->s_passphrase);
+	sbi->s_passphrase = NULL;
+	if (err)
+		goto failed_cat;
+
+	/* Plaintext must never be written out to the persistent cache */
+	if (sbi->s_vek_tfm && (sbi->s_flags & APFS_FSCACHE)) {
+		apfs_err(sb, "fsc is not allowed on encrypted volumes");
+		err = -EINVAL;
+		goto failed_cat;
+	}
+
 	err = apfs_read_catalog(sb);
 	if (err)
 		goto failed_cat;
+	apfs_cache_get_volume_cookie(sb);
 
 	sb->s_op = &apfs_sops;
 	sb->s_d_op = &apfs_dentry_operations;
+	sb->s_export_op = &apfs_export_ops;
 	sb->s_xattr = apfs_xattr_handlers;
 	sb->s_maxbytes = MAX_LFS_FILESIZE;
 
+	/* Once the root dentry is set, apfs_put_super() will do the cleanup */
+	err = apfs_register_sysfs(sb);
+	if (err)
+		goto failed_mount;
+
 	root = apfs_iget(sb, APFS_ROOT_DIR_INO_NUM);
 	if (IS_ERR(root)) {
 		apfs_err(sb, "unable to get root inode");
 		err = PTR_ERR(root);
-		goto failed_mount;
+		goto failed_root;
 	}
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		apfs_err(sb, "unable to get root dentry");
 		err = -ENOMEM;
-		goto failed_mount;
+		goto failed_root;
 	}
+
+	apfs_debugfs_register(sb);
 	return 0;
 
+failed_root:
+	apfs_unregister_sysfs(sb);
 failed_mount:
+	apfs_inode_cache_shrink(&sbi->s_inode_cache, ULONG_MAX);
+	apfs_cache_put_volume_cookie(sb);
 	apfs_node_put(sbi->s_cat_root);
+	sbi->s_cat_root = NULL;
 failed_cat:
+	apfs_crypto_release(sb);
 	apfs_node_put(sbi->s_omap_root);
+	sbi->s_omap_root = NULL;
 failed_omap:
 	apfs_unmap_volume_super(sb);
-failed_volume_super:
-	apfs_unmap_main_super(sb);
-failed_main_super:
-	sb->s_fs_info = NULL;
-	kfree(sbi);
+	sbi->s_vobject.bh = NULL;
 	return err;
 }
 
+/*
+ * Two superblocks are the same volume if they share the container and the
+ * volume number, and they were mounted from the same snapshot (if any).
+ */
+static int apfs_test_super(struct super_block *sb, void *data)
+{
+	struct apfs_sb_info *sbi_1 = data;
+	struct apfs_sb_info *sbi_2 = APFS_SB(sb);
+
+	if (sbi_1->s_nxi != sbi_2->s_nxi ||
+	    sbi_1->s_vol_nr != sbi_2->s_vol_nr)
+		return false;
+	if (!sbi_1->s_snap_name || !sbi_2->s_snap_name)
+		return sbi_1->s_snap_name == sbi_2->s_snap_name;
+	return strcmp(sbi_1->s_snap_name, sbi_2->s_snap_name) == 0;
+}
+
+static int apfs_set_super(struct super_block *sb, void *data)
+{
+	struct apfs_sb_info *sbi = data;
+	struct block_device *bdev = sbi->s_nxi->nx_bdev;
+	int err;
+
+	/* Each volume needs its own device number, not the one from the bdev */
+	err = set_anon_super(sb, NULL);
+	if (err)
+		return err;
+	sb->s_fs_info = sbi;
+	sb->s_bdev = bdev;
+	sb->s_bdi = bdi_get(bdev->bd_bdi);
+	return 0;
+}
+
 static struct dentry *apfs_mount(struct file_system_type *fs_type,
 		int flags, const char *dev_name, void *data)
 {
-	return mount_bdev(fs_type, flags, dev_name, data, apfs_fill_super);
+	struct super_block *sb;
+	struct apfs_sb_info *sbi;
+	struct block_device *bdev;
+	fmode_t mode = FMODE_READ | FMODE_EXCL;
+	int err;
+
+	/* The driver is read-only for now */
+	flags |= SB_RDONLY;
+
+	bdev = blkdev_get_by_path(dev_name, mode, fs_type);
+	if (IS_ERR(bdev))
+		return ERR_CAST(bdev);
+
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi) {
+		blkdev_put(bdev, mode);
+		return ERR_PTR(-ENOMEM);
+	}
+	err = apfs_attach_nxi(sbi, bdev);
+	if (err)
+		goto out_free_sbi;
+
+	err = parse_options(sbi, data);
+	if (err)
+		goto out_detach;
+
+	sb = sget(fs_type, apfs_test_super, apfs_set_super, flags | SB_NOSEC,
+		  sbi);
+	if (IS_ERR(sb)) {
+		err = PTR_ERR(sb);
+		goto out_detach;
+	}
+
+	if (sb->s_root) {
+		/* The volume is already mounted, so this sbi is not needed */
+		if ((flags ^ sb->s_flags) & SB_RDONLY) {
+			deactivate_locked_super(sb);
+			err = -EBUSY;
+			goto out_detach;
+		}
+		apfs_detach_nxi(sbi);
+		kfree(sbi->s_snap_name);
+		kfree(sbi->s_tier2_path);
+		kzfree(sbi->s_passphrase);
+		kfree(sbi);
+	} else {
+		sb->s_mode = mode;
+		snprintf(sb->s_id, sizeof(sb->s_id), "%pg", bdev);
+		err = apfs_fill_super(sb, data, flags & SB_SILENT ? 1 : 0);
+		if (err) {
+			deactivate_locked_super(sb);
+			return ERR_PTR(err);
+		}
+		sb->s_flags |= SB_ACTIVE;
+	}
+
+	return dget(sb->s_root);
+
+out_detach:
+	apfs_detach_nxi(sbi);
+out_free_sbi:
+	kfree(sbi->s_snap_name);
+	kfree(sbi->s_tier2_path);
+	kzfree(sbi->s_passphrase);
+	kfree(sbi);
+	return ERR_PTR(err);
+}
+
+static void apfs_kill_sb(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	kill_anon_super(sb);
+	apfs_detach_nxi(sbi);
+	free_percpu(sbi->s_stats);
+	apfs_iotrace_free(sbi);
+	kfree(sbi->s_snap_name);
+	kfree(sbi->s_tier2_path);
+	kzfree(sbi->s_passphrase);
+	kfree(sbi);
 }
 
 static struct file_system_type apfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "apfs",
 	.mount		= apfs_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= apfs_kill_sb,
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 MODULE_ALIAS_FS("apfs");
@@ -725,15 +1477,40 @@ static int __init init_apfs_fs(void)
 	err = init_inodecache();
 	if (err)
 		return err;
+	err = apfs_readpage_init();
+	if (err)
+		goto out_inodecache;
+	err = apfs_cache_register();
+	if (err)
+		goto out_readpage;
+	err = apfs_sysfs_init();
+	if (err)
+		goto out_cache;
+	apfs_debugfs_init();
 	err = register_filesystem(&apfs_fs_type);
 	if (err)
-		destroy_inodecache();
+		goto out_debugfs;
+	return 0;
+
+out_debugfs:
+	apfs_debugfs_exit();
+	apfs_sysfs_exit();
+out_cache:
+	apfs_cache_unregister();
+out_readpage:
+	apfs_readpage_exit();
+out_inodecache:
+	destroy_inodecache();
 	return err;
 }
 
 static void __exit exit_apfs_fs(void)
 {
 	unregister_filesystem(&apfs_fs_type);
+	apfs_debugfs_exit();
+	apfs_sysfs_exit();
+	apfs_cache_unregister();
+	apfs_readpage_exit();
 	destroy_inodecache();
 }
 
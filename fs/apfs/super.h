@@ -8,10 +8,20 @@
 #ifndef _APFS_SUPER_H
 #define _APFS_SUPER_H
 
+#include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/kobject.h>
 #include <linux/types.h>
+#include "btree.h"
+#include "crypto.h"
+#include "dir.h"
+#include "inode.h"
 #include "object.h"
 
+struct apfs_iotrace;
+struct apfs_stats;
+struct crypto_skcipher;
+
 /*
  * Structure used to store a range of physical blocks
  */
@@ -33,6 +43,10 @@ struct apfs_prange {
 #define APFS_NX_TX_MIN_CHECKPOINT_COUNT		4
 #define APFS_NX_EPH_INFO_VERSION_1		1
 
+/* Checkpoint area flags, stored in the highest bit of the base address */
+#define APFS_NX_XP_NONCONTIGUOUS		0x8000000000000000ULL
+#define APFS_NX_XP_MAX_BLOCKS			10000	/* Arbitrary limit */
+
 /* Container flags */
 #define APFS_NX_RESERVED_1			0x00000001LL
 #define APFS_NX_RESERVED_2			0x00000002LL
@@ -256,31 +270,114 @@ struct apfs_superblock {
 	__le64 apfs_er_state_oid;
 } __packed;
 
+/* Checkpoint map flags */
+#define APFS_CHECKPOINT_MAP_LAST		0x00000001
+
+/*
+ * Structure used to store the location of an ephemeral object
+ */
+struct apfs_checkpoint_mapping {
+	__le32 cpm_type;
+	__le32 cpm_subtype;
+	__le32 cpm_size;
+	__le32 cpm_pad;
+	__le64 cpm_fs_oid;
+	__le64 cpm_oid;
+	__le64 cpm_paddr;
+} __packed;
+
+/*
+ * On-disk representation of a checkpoint-mapping block
+ */
+struct apfs_checkpoint_map_phys {
+/*00*/	struct apfs_obj_phys cpm_o;
+/*20*/	__le32 cpm_flags;
+	__le32 cpm_count;
+/*28*/	struct apfs_checkpoint_mapping cpm_map[];
+} __packed;
+
+/*
+ * Run of physical blocks in a checkpoint area, as stored in memory
+ */
+struct apfs_xp_range {
+	u64 index;	/* Logical offset of the run inside the area */
+	u64 bno;	/* First physical block of the run */
+	u64 count;	/* Number of blocks in the run */
+};
+
+/*
+ * Container superblock data in memory, shared by all the volumes mounted
+ * from the same device
+ */
+struct apfs_nxsb_info {
+	struct block_device *nx_bdev;	/* Device for the container */
+	struct apfs_nx_superblock *nx_raw; /* On-disk main sb */
+	struct apfs_object nx_object;	/* Main superblock object */
+	u64 nx_xid;			/* Latest transaction id */
+
+	u32 nx_xp_desc_blocks;		/* Size of the checkpoint desc area */
+	int nx_xp_desc_nranges;		/* Number of runs in the desc area */
+	struct apfs_xp_range *nx_xp_desc; /* Layout of the checkpoint area */
+
+	u64 nx_omap_root;		/* Root node of the container omap */
+
+	struct block_device *nx_tier2_bdev; /* Fusion hard drive, or NULL */
+	u64 nx_fusion_mt_root;		/* Root node of the middle tree */
+	struct apfs_fusion_cache *nx_fusion_cache; /* Runs of the middle tree */
+
+	u64 nx_free_blocks;		/* Free blocks in the container */
+	u64 nx_avail_blocks;		/* Free blocks not held in reserve */
+
+	struct apfs_omap_cache nx_omap_cache; /* Shared by all the volumes */
+
+	unsigned int nx_refcnt;		/* Number of volume sbs using this */
+	struct list_head nx_list;	/* Entry in the list of containers */
+};
+
 /* Mount option flags */
 #define APFS_UID_OVERRIDE	1
 #define APFS_GID_OVERRIDE	2
 #define APFS_CHECK_NODES	4
+#define APFS_FSCACHE		8
+#define APFS_BLOOM		16
+#define APFS_IOTRACE		32
 
 /*
  * Superblock data in memory, both from the main superblock and the volume
  * checkpoint superblock.
  */
 struct apfs_sb_info {
-	struct apfs_nx_superblock *s_msb_raw;		/* On-disk main sb */
+	struct apfs_nxsb_info *s_nxi;			/* In-memory main sb */
 	struct apfs_superblock *s_vsb_raw;		/* On-disk volume sb */
 
-	u64 s_xid;			/* Latest transaction id */
+	u64 s_xid;			/* Transaction id for the volume */
+	char *s_snap_name;		/* Mounted snapshot, or NULL */
+	u64 s_snap_meta_tree;		/* Root of the snapshot metadata tree */
 	struct apfs_node *s_cat_root;	/* Root of the catalog tree */
 	struct apfs_node *s_omap_root;	/* Root of the object map tree */
 
-	struct apfs_object s_mobject;	/* Main superblock object */
 	struct apfs_object s_vobject;	/* Volume superblock object */
+	struct apfs_name_cache s_name_cache; /* Names for path lookups */
+	struct apfs_lookup_cache s_lookup_cache; /* Filenames to inodes */
+	struct apfs_inode_cache s_inode_cache; /* Raw inode records */
+	struct crypto_skcipher *s_vek_tfm; /* Volume encryption, or NULL */
+	struct apfs_node_cache s_node_cache; /* Decrypted metadata blocks */
+#ifdef CONFIG_APFS_FSCACHE
+	struct fscache_cookie *s_fscache; /* Cache index for the volume */
+#endif
+	struct apfs_stats __percpu *s_stats; /* Performance counters */
+	struct kobject s_kobj;		/* Directory in /sys/fs/apfs */
+	struct completion s_kobj_unregister;
+	struct dentry *s_debugfs;	/* Directory in debugfs */
+	struct apfs_iotrace *s_iotrace;	/* Recent metadata reads, or NULL */
 
 	/* Mount options */
 	unsigned int s_flags;
 	unsigned int s_vol_nr;		/* Index of the volume in the sb list */
 	kuid_t s_uid;			/* uid to override on-disk uid */
 	kgid_t s_gid;			/* gid to override on-disk gid */
+	char *s_passphrase;		/* Unlocks the volume, until mounted */
+	char *s_tier2_path;		/* Path to the fusion hard drive */
 
 	/* TODO: handle block sizes above the maximum of PAGE_SIZE? */
 	unsigned long s_blocksize;
@@ -292,10 +389,18 @@ static inline struct apfs_sb_info *APFS_SB(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+static inline struct apfs_nxsb_info *APFS_NXI(struct super_block *sb)
+{
+	return APFS_SB(sb)->s_nxi;
+}
+
 static inline bool apfs_is_case_insensitive(struct super_block *sb)
 {
 	return (APFS_SB(sb)->s_vsb_raw->apfs_incompatible_features &
 	       cpu_to_le64(APFS_INCOMPAT_CASE_INSENSITIVE)) != 0;
 }
 
+extern int apfs_cpm_lookup_oid(struct super_block *sb, u64 oid, u32 type,
+			       u64 *bno, u32 *size);
+
 #endif	/* _APFS_SUPER_H */
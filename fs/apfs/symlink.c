@@ -9,10 +9,11 @@
 #include <linux/slab.h>
 #include "apfs.h"
 #include "message.h"
+#include "sysfs.h"
 #include "xattr.h"
 
 /**
- * apfs_get_link - Follow a symbolic link
+ * __apfs_get_link - Follow a symbolic link
  * @dentry:	dentry for the link
  * @inode:	inode for the link
  * @done:	delayed call to free the returned buffer after use
@@ -20,8 +21,9 @@
  * Returns a pointer to a buffer containing the target path, or an appropriate
  * error pointer in case of failure.
  */
-static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
-				 struct delayed_call *done)
+static const char *__apfs_get_link(struct dentry *dentry,
+				   struct inode *inode,
+				   struct delayed_call *done)
 {
 	struct super_block *sb = inode->i_sb;
 	char *target, *err;
@@ -60,6 +62,17 @@ static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
 	return err;
 }
 
+static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
+				 struct delayed_call *done)
+{
+	u64 start = ktime_get_ns();
+	const char *ret;
+
+	ret = __apfs_get_link(dentry, inode, done);
+	apfs_lat_add(inode->i_sb, APFS_LAT_GET_LINK, start);
+	return ret;
+}
+
 const struct inode_operations apfs_symlink_inode_operations = {
 	.get_link	= apfs_get_link,
 	.getattr	= apfs_getattr,
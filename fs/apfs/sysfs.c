@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/sysfs.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include "apfs.h"
+#include "super.h"
+#include "sysfs.h"
+
+/* The /sys/fs/apfs directory */
+static struct kset *apfs_kset;
+
+static const char * const apfs_stat_names[APFS_STAT_COUNT] = {
+	[APFS_STAT_QUERY_OMAP]		= "query_omap",
+	[APFS_STAT_QUERY_CAT]		= "query_cat",
+	[APFS_STAT_QUERY_SNAP_META]	= "query_snap_meta",
+	[APFS_STAT_QUERY_FUSION]	= "query_fusion",
+	[APFS_STAT_NODE_READS]		= "node_reads",
+	[APFS_STAT_NODE_HITS]		= "node_hits",
+	[APFS_STAT_OMAP_LOOKUPS]	= "omap_lookups",
+	[APFS_STAT_CSUM_CHECKS]		= "csum_checks",
+	[APFS_STAT_CSUM_FAILURES]	= "csum_failures",
+	[APFS_STAT_EXTENT_LOOKUPS]	= "extent_lookups",
+	[APFS_STAT_EXTENT_HITS]		= "extent_hits",
+	[APFS_STAT_NORMALIZATIONS]	= "normalizations",
+	[APFS_STAT_META_BYTES]		= "meta_bytes",
+	[APFS_STAT_DATA_BYTES]		= "data_bytes",
+};
+
+static const char * const apfs_lat_names[APFS_LAT_COUNT] = {
+	[APFS_LAT_LOOKUP]	= "lookup",
+	[APFS_LAT_READDIR]	= "readdir",
+	[APFS_LAT_GETATTR]	= "getattr",
+	[APFS_LAT_READPAGE]	= "readpage",
+	[APFS_LAT_READPAGES]	= "readpages",
+	[APFS_LAT_XATTR_GET]	= "xattr_get",
+	[APFS_LAT_GET_LINK]	= "get_link",
+};
+
+/**
+ * apfs_stat_sum - Add up a performance counter across all cpus
+ * @sbi:	superblock info for the volume
+ * @stat:	the counter
+ */
+static u64 apfs_stat_sum(struct apfs_sb_info *sbi, enum apfs_stat stat)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->s_stats, cpu)->counters[stat];
+	return sum;
+}
+
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr,
+			  char *buf)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info,
+						s_kobj);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < APFS_STAT_COUNT; ++i) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n",
+				 apfs_stat_names[i], apfs_stat_sum(sbi, i));
+	}
+	return len;
+}
+
+/*
+ * Each line of the latency file has the name of an operation followed by its
+ * histogram: the number of calls for each of the APFS_LAT_BUCKETS log2 buckets
+ * of latency in nanoseconds, starting from [1, 2).
+ */
+static ssize_t latency_show(struct kobject *kobj, struct kobj_attribute *attr,
+			    char *buf)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info,
+						s_kobj);
+	struct apfs_stats *stats;
+	ssize_t len = 0;
+	int op, bucket, cpu;
+
+	for (op = 0; op < APFS_LAT_COUNT; ++op) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s",
+				 apfs_lat_names[op]);
+		for (bucket = 0; bucket < APFS_LAT_BUCKETS; ++bucket) {
+			u64 sum = 0;
+
+			for_each_possible_cpu(cpu) {
+				stats = per_cpu_ptr(sbi->s_stats, cpu);
+				sum += stats->latency[op][bucket];
+			}
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %llu",
+					 sum);
+		}
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+	return len;
+}
+
+/*
+ * Any write to latency_reset clears all the histograms.  Calls that end while
+ * the reset is going on may or may not get counted.
+ */
+static ssize_t latency_reset_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info,
+						s_kobj);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct apfs_stats *stats = per_cpu_ptr(sbi->s_stats, cpu);
+
+		memset(stats->latency, 0, sizeof(stats->latency));
+	}
+	return count;
+}
+
+static struct kobj_attribute apfs_attr_stats = __ATTR_RO(stats);
+static struct kobj_attribute apfs_attr_latency = __ATTR_RO(latency);
+static struct kobj_attribute apfs_attr_latency_reset =
+						__ATTR_WO(latency_reset);
+
+static struct attribute *apfs_sb_attrs[] = {
+	&apfs_attr_stats.attr,
+	&apfs_attr_latency.attr,
+	&apfs_attr_latency_reset.attr,
+	NULL,
+};
+
+static void apfs_sb_release(struct kobject *kobj)
+{
+	struct apfs_sb_info *sbi = container_of(kobj, struct apfs_sb_info,
+						s_kobj);
+
+	complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type apfs_sb_ktype = {
+	.default_attrs	= apfs_sb_attrs,
+	.sysfs_ops	= &kobj_sysfs_ops,
+	.release	= apfs_sb_release,
+};
+
+/**
+ * apfs_register_sysfs - Create the sysfs directory for a mounted volume
+ * @sb:		filesystem superblock
+ *
+ * The directory is named after the device number of the volume, as shown in
+ * /proc/self/mountinfo; a single container may have several volumes mounted
+ * at once.  Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_register_sysfs(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	int err;
+
+	sbi->s_kobj.kset = apfs_kset;
+	init_completion(&sbi->s_kobj_unregister);
+	err = kobject_init_and_add(&sbi->s_kobj, &apfs_sb_ktype, NULL,
+				   "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	if (err) {
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+	}
+	return err;
+}
+
+/**
+ * apfs_unregister_sysfs - Undo apfs_register_sysfs()
+ * @sb:		filesystem superblock
+ */
+void apfs_unregister_sysfs(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+
+	kobject_del(&sbi->s_kobj);
+	kobject_put(&sbi->s_kobj);
+	wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+/**
+ * apfs_sysfs_init - Create the /sys/fs/apfs directory
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_sysfs_init(void)
+{
+	apfs_kset = kset_create_and_add("apfs", NULL, fs_kobj);
+	if (!apfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * apfs_sysfs_exit - Undo apfs_sysfs_init()
+ */
+void apfs_sysfs_exit(void)
+{
+	kset_unregister(apfs_kset);
+}
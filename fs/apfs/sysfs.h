@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/sysfs.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _APFS_SYSFS_H
+#define _APFS_SYSFS_H
+
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/timekeeping.h>
+#include <linux/types.h>
+#include "super.h"
+
+/*
+ * Performance counters kept for each mounted volume
+ */
+enum apfs_stat {
+	/* Queries on each b-tree, in the order of the APFS_QUERY_* flags */
+	APFS_STAT_QUERY_OMAP,
+	APFS_STAT_QUERY_CAT,
+	APFS_STAT_QUERY_SNAP_META,
+	APFS_STAT_QUERY_FUSION,
+
+	APFS_STAT_NODE_READS,		/* Nodes read from disk */
+	APFS_STAT_NODE_HITS,		/* Nodes found in the buffer cache */
+	APFS_STAT_OMAP_LOOKUPS,		/* Object map translations */
+	APFS_STAT_CSUM_CHECKS,		/* Object checksums verified */
+	APFS_STAT_CSUM_FAILURES,	/* Bad object checksums */
+	APFS_STAT_EXTENT_LOOKUPS,	/* File extents requested */
+	APFS_STAT_EXTENT_HITS,		/* File extents found in the cache */
+	APFS_STAT_NORMALIZATIONS,	/* Filenames normalized */
+	APFS_STAT_META_BYTES,		/* Bytes of nodes read from disk */
+	APFS_STAT_DATA_BYTES,		/* Bytes of file data mapped */
+
+	APFS_STAT_COUNT
+};
+
+/*
+ * Operations with a latency histogram
+ */
+enum apfs_lat_op {
+	APFS_LAT_LOOKUP,
+	APFS_LAT_READDIR,
+	APFS_LAT_GETATTR,
+	APFS_LAT_READPAGE,
+	APFS_LAT_READPAGES,
+	APFS_LAT_XATTR_GET,
+	APFS_LAT_GET_LINK,
+
+	APFS_LAT_COUNT
+};
+
+/* Bucket i of a histogram counts latencies in [2^i, 2^(i+1)) nanoseconds */
+#define APFS_LAT_BUCKETS	32
+
+struct apfs_stats {
+	u64 counters[APFS_STAT_COUNT];
+	u64 latency[APFS_LAT_COUNT][APFS_LAT_BUCKETS];
+};
+
+/**
+ * apfs_stat_add - Add to a performance counter of a volume
+ * @sb:		filesystem superblock
+ * @stat:	the counter
+ * @val:	value to add
+ */
+static inline void apfs_stat_add(struct super_block *sb, enum apfs_stat stat,
+				 u64 val)
+{
+	this_cpu_add(APFS_SB(sb)->s_stats->counters[stat], val);
+}
+
+static inline void apfs_stat_inc(struct super_block *sb, enum apfs_stat stat)
+{
+	apfs_stat_add(sb, stat, 1);
+}
+
+/**
+ * apfs_lat_add - Add the latency of a call to the histogram for its operation
+ * @sb:		filesystem superblock
+ * @op:		the operation
+ * @start:	value of ktime_get_ns() when the call began
+ */
+static inline void apfs_lat_add(struct super_block *sb, enum apfs_lat_op op,
+				u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	int bucket = ns ? min_t(int, ilog2(ns), APFS_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(APFS_SB(sb)->s_stats->latency[op][bucket]);
+}
+
+extern int apfs_sysfs_init(void);
+extern void apfs_sysfs_exit(void);
+extern int apfs_register_sysfs(struct super_block *sb);
+extern void apfs_unregister_sysfs(struct super_block *sb);
+
+#endif	/* _APFS_SYSFS_H */
@@ -0,0 +1,9 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/fs/apfs/trace.c
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  linux/fs/apfs/trace.h
+ *
+ * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM apfs
+
+#if !defined(_APFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _APFS_TRACE_H
+
+#include <linux/fs.h>
+#include <linux/tracepoint.h>
+
+#define show_apfs_tree(tree)					\
+	__print_symbolic(tree,					\
+		{ 0x01,	"omap" },				\
+		{ 0x02,	"cat" },				\
+		{ 0x04,	"snap_meta" },				\
+		{ 0x08,	"fusion" })
+
+TRACE_EVENT(apfs_btree_query,
+	TP_PROTO(struct super_block *sb, unsigned int tree, u64 id, u8 type,
+		 u64 number, int depth, int nodes, int omaps, int err),
+
+	TP_ARGS(sb, tree, id, type, number, depth, nodes, omaps, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	tree)
+		__field(u64,		id)
+		__field(u8,		type)
+		__field(u64,		number)
+		__field(int,		depth)
+		__field(int,		nodes)
+		__field(int,		omaps)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->tree	= tree;
+		__entry->id	= id;
+		__entry->type	= type;
+		__entry->number	= number;
+		__entry->depth	= depth;
+		__entry->nodes	= nodes;
+		__entry->omaps	= omaps;
+		__entry->err	= err;
+	),
+
+	TP_printk("dev %d,%d tree %s key 0x%llx/%u/0x%llx depth %d nodes %d omaps %d err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  show_apfs_tree(__entry->tree), __entry->id, __entry->type,
+		  __entry->number, __entry->depth, __entry->nodes,
+		  __entry->omaps, __entry->err)
+);
+
+TRACE_EVENT(apfs_read_node,
+	TP_PROTO(struct super_block *sb, u64 block, bool cached, u64 csum_ns),
+
+	TP_ARGS(sb, block, cached, csum_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u64,		block)
+		__field(bool,		cached)
+		__field(u64,		csum_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->block		= block;
+		__entry->cached		= cached;
+		__entry->csum_ns	= csum_ns;
+	),
+
+	TP_printk("dev %d,%d block 0x%llx %s csum %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block,
+		  __entry->cached ? "hit" : "miss", __entry->csum_ns)
+);
+
+TRACE_EVENT(apfs_get_block,
+	TP_PROTO(struct inode *inode, sector_t iblock, u64 logical_addr,
+		 u64 phys_block_num, u64 ext_len, size_t map_len),
+
+	TP_ARGS(inode, iblock, logical_addr, phys_block_num, ext_len, map_len),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(sector_t,	iblock)
+		__field(u64,		logical_addr)
+		__field(u64,		phys_block_num)
+		__field(u64,		ext_len)
+		__field(size_t,		map_len)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->iblock		= iblock;
+		__entry->logical_addr	= logical_addr;
+		__entry->phys_block_num	= phys_block_num;
+		__entry->ext_len	= ext_len;
+		__entry->map_len	= map_len;
+	),
+
+	TP_printk("dev %d,%d ino 0x%lx iblock %llu extent 0x%llx+0x%llx at block 0x%llx map %zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long)__entry->iblock, __entry->logical_addr,
+		  __entry->ext_len, __entry->phys_block_num, __entry->map_len)
+);
+
+TRACE_EVENT(apfs_lookup_enter,
+	TP_PROTO(struct inode *dir, const struct qstr *name),
+
+	TP_ARGS(dir, name),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		dir)
+		__string(name,		name->name)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__assign_str(name, name->name);
+	),
+
+	TP_printk("dev %d,%d dir 0x%lx name %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name))
+);
+
+TRACE_EVENT(apfs_lookup_exit,
+	TP_PROTO(struct inode *dir, const struct qstr *name, u64 ino, int err),
+
+	TP_ARGS(dir, name, ino, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		dir)
+		__string(name,		name->name)
+		__field(u64,		ino)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__assign_str(name, name->name);
+		__entry->ino	= ino;
+		__entry->err	= err;
+	),
+
+	TP_printk("dev %d,%d dir 0x%lx name %s ino 0x%llx err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->err)
+);
+
+DECLARE_EVENT_CLASS(apfs_readdir_class,
+	TP_PROTO(struct inode *dir, loff_t pos, int err),
+
+	TP_ARGS(dir, pos, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		dir)
+		__field(loff_t,		pos)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__entry->pos	= pos;
+		__entry->err	= err;
+	),
+
+	TP_printk("dev %d,%d dir 0x%lx pos %lld err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->pos, __entry->err)
+);
+
+DEFINE_EVENT(apfs_readdir_class, apfs_readdir_enter,
+	TP_PROTO(struct inode *dir, loff_t pos, int err),
+	TP_ARGS(dir, pos, err)
+);
+
+DEFINE_EVENT(apfs_readdir_class, apfs_readdir_exit,
+	TP_PROTO(struct inode *dir, loff_t pos, int err),
+	TP_ARGS(dir, pos, err)
+);
+
+#endif /* _APFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -6,14 +6,18 @@
  */
 
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
 #include <linux/xattr.h>
 #include "apfs.h"
 #include "btree.h"
+#include "crypto.h"
 #include "extents.h"
+#include "fusion.h"
 #include "key.h"
 #include "super.h"
 #include "node.h"
 #include "message.h"
+#include "sysfs.h"
 #include "xattr.h"
 
 /**
@@ -87,6 +91,7 @@ static int apfs_xattr_extents_read(struct inode *parent,
 	struct apfs_key key;
 	struct apfs_query *query;
 	struct apfs_xattr_dstream *xdata;
+	char *plain = NULL;
 	u64 extent_id;
 	int length;
 	int ret;
@@ -102,13 +107,22 @@ static int apfs_xattr_extents_read(struct inode *parent,
 	if (length > size) /* xattr won't fit in the buffer */
 		return -ERANGE;
 
+	/* Encrypted blocks need a bounce buffer, since they get copied whole */
+	if (sbi->s_vek_tfm) {
+		plain = kmalloc(sb->s_blocksize, GFP_KERNEL);
+		if (!plain)
+			return -ENOMEM;
+	}
+
 	extent_id = le64_to_cpu(xdata->xattr_obj_id);
 	/* We will read all the extents, starting with the last one */
 	apfs_init_file_extent_key(extent_id, 0 /* offset */, &key);
 
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
-	if (!query)
+	if (!query) {
+		kzfree(plain);
 		return -ENOMEM;
+	}
 	query->key = &key;
 	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
 
@@ -146,6 +160,7 @@ static int apfs_xattr_extents_read(struct inode *parent,
 		file_off = ext.logical_addr;
 		for (j = 0; j < block_count; ++j) {
 			struct buffer_head *bh;
+			bool cached;
 			int bytes;
 
 			if (length <= file_off) /* Read the whole extent */
@@ -153,12 +168,27 @@ static int apfs_xattr_extents_read(struct inode *parent,
 			bytes = min(sb->s_blocksize,
 				    (unsigned long)(length - file_off));
 
-			bh = sb_bread(sb, ext.phys_block_num + j);
+			bh = __apfs_sb_bread(sb, ext.phys_block_num + j,
+					     &cached);
 			if (!bh) {
 				ret = -EIO;
 				goto done;
 			}
-			memcpy(buffer + file_off, bh->b_data, bytes);
+			if (plain) {
+				u64 unit = ext.crypto_id +
+					   apfs_blocks_to_units(sb, j);
+
+				err = apfs_decrypt_buf(sb, plain, bh->b_data,
+						       sb->s_blocksize, unit);
+				if (err) {
+					brelse(bh);
+					ret = err;
+					goto done;
+				}
+				memcpy(buffer + file_off, plain, bytes);
+			} else {
+				memcpy(buffer + file_off, bh->b_data, bytes);
+			}
 			brelse(bh);
 			file_off = file_off + bytes;
 		}
@@ -166,6 +196,7 @@ static int apfs_xattr_extents_read(struct inode *parent,
 
 done:
 	apfs_free_query(sb, query);
+	kzfree(plain);
 	return ret;
 }
 
@@ -252,8 +283,13 @@ static int apfs_xattr_osx_get(const struct xattr_handler *handler,
 				struct dentry *unused, struct inode *inode,
 				const char *name, void *buffer, size_t size)
 {
+	u64 start = ktime_get_ns();
+	int ret;
+
 	/* Ignore the fake 'osx' prefix */
-	return apfs_xattr_get(inode, name, buffer, size);
+	ret = apfs_xattr_get(inode, name, buffer, size);
+	apfs_lat_add(inode->i_sb, APFS_LAT_XATTR_GET, start);
+	return ret;
 }
 
 static const struct xattr_handler apfs_xattr_osx_handler = {